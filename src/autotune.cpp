@@ -0,0 +1,132 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "autotune.hpp"
+
+// a change has to save this much to be kept, timings of one tile are noisy
+#define AUTOTUNE_MIN_GAIN 0.97
+
+uint32_t autotuneFlags(const ncnn::Option& opt)
+{
+    uint32_t flags = 0;
+    if (opt.use_winograd_convolution) flags |= AUTOTUNE_WINOGRAD;
+    if (opt.use_sgemm_convolution) flags |= AUTOTUNE_SGEMM;
+    if (opt.use_shader_pack8) flags |= AUTOTUNE_PACK8;
+    if (opt.use_image_storage) flags |= AUTOTUNE_IMAGE_STORAGE;
+    if (opt.use_subgroup_basic) flags |= AUTOTUNE_SUBGROUP;
+    return flags;
+}
+
+void autotuneApply(ncnn::Option& opt, uint32_t flags)
+{
+    opt.use_winograd_convolution = (flags & AUTOTUNE_WINOGRAD) != 0;
+    opt.use_sgemm_convolution = (flags & AUTOTUNE_SGEMM) != 0;
+    opt.use_shader_pack8 = (flags & AUTOTUNE_PACK8) != 0;
+    opt.use_image_storage = (flags & AUTOTUNE_IMAGE_STORAGE) != 0;
+    opt.use_subgroup_basic = (flags & AUTOTUNE_SUBGROUP) != 0;
+    opt.use_subgroup_vote = (flags & AUTOTUNE_SUBGROUP) != 0;
+    opt.use_subgroup_ballot = (flags & AUTOTUNE_SUBGROUP) != 0;
+    opt.use_subgroup_shuffle = (flags & AUTOTUNE_SUBGROUP) != 0;
+}
+
+bool autotuneSearch(const ncnn::Option& base, const std::function<double(const ncnn::Option&)>& time_candidate, uint32_t& flags)
+{
+    uint32_t best_flags = autotuneFlags(base);
+    double best_time = time_candidate(base);
+
+    const uint32_t candidates[] = { AUTOTUNE_WINOGRAD, AUTOTUNE_SGEMM, AUTOTUNE_PACK8, AUTOTUNE_IMAGE_STORAGE, AUTOTUNE_SUBGROUP };
+    for (uint32_t flag : candidates)
+    {
+        ncnn::Option opt = base;
+        autotuneApply(opt, best_flags ^ flag);
+
+        const double t = time_candidate(opt);
+        if (t == HUGE_VAL)
+            continue;
+
+        // anything that runs beats a base that failed
+        if (best_time == HUGE_VAL || t < best_time * AUTOTUNE_MIN_GAIN)
+        {
+            best_flags ^= flag;
+            best_time = t;
+        }
+    }
+
+    flags = best_flags;
+    return best_time != HUGE_VAL;
+}
+
+std::string autotuneKey(const ncnn::GpuInfo& info, const std::string& modelpath, int tile_w, int tile_h, const ncnn::Option& base)
+{
+    char key[512];
+    snprintf(key, sizeof(key), "%s|%08x:%08x|%u|%dx%d|%d%d%d|%s", info.device_name(), info.vendor_id(), info.device_id(), info.driver_version(),
+        tile_w, tile_h, base.use_fp16_storage, base.use_fp16_arithmetic, base.use_int8_inference, modelpath.c_str());
+    return key;
+}
+
+std::string autotuneCachePath()
+{
+#ifdef _WIN32
+    const char* base = getenv("LOCALAPPDATA");
+    if (!base)
+        return std::string();
+    const std::string dir = std::string(base) + "\\vsnvk";
+    _mkdir(dir.c_str());
+    return dir + "\\autotune.txt";
+#else
+    std::string dir;
+    if (const char* xdg = getenv("XDG_CACHE_HOME"))
+        dir = xdg;
+    else if (const char* home = getenv("HOME"))
+        dir = std::string(home) + "/.cache";
+    else
+        return std::string();
+    mkdir(dir.c_str(), 0755);
+    dir += "/vsnvk";
+    mkdir(dir.c_str(), 0755);
+    return dir + "/autotune.txt";
+#endif
+}
+
+// one "key<TAB>flags" line per tuned model, a later line wins
+bool autotuneLookup(const std::string& cache_path, const std::string& key, uint32_t& flags)
+{
+    FILE* fp = cache_path.empty() ? nullptr : fopen(cache_path.c_str(), "rb");
+    if (!fp)
+        return false;
+
+    bool found = false;
+    std::vector<char> line(4096);
+    while (fgets(line.data(), (int)line.size(), fp))
+    {
+        char* tab = strrchr(line.data(), '\t');
+        if (!tab)
+            continue;
+        *tab = '\0';
+        if (key == line.data())
+        {
+            flags = (uint32_t)strtoul(tab + 1, nullptr, 16);
+            found = true;
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+void autotuneStore(const std::string& cache_path, const std::string& key, uint32_t flags)
+{
+    FILE* fp = cache_path.empty() ? nullptr : fopen(cache_path.c_str(), "ab");
+    if (!fp)
+        return;
+    fprintf(fp, "%s\t%x\n", key.c_str(), flags);
+    fclose(fp);
+}
@@ -0,0 +1,84 @@
+#ifndef AUTOTUNE_HPP
+#define AUTOTUNE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// ncnn
+#include "net.h"
+#include "gpu.h"
+
+// ncnn options the autotuner may flip, everything else stays as the engine set it
+enum {
+    AUTOTUNE_WINOGRAD = 1 << 0,
+    AUTOTUNE_SGEMM = 1 << 1,
+    AUTOTUNE_PACK8 = 1 << 2,
+    AUTOTUNE_IMAGE_STORAGE = 1 << 3,
+    AUTOTUNE_SUBGROUP = 1 << 4,
+};
+
+uint32_t autotuneFlags(const ncnn::Option& opt);
+void autotuneApply(ncnn::Option& opt, uint32_t flags);
+
+// flip one option at a time starting from base, keeping each change that makes time_candidate clearly faster
+// time_candidate returns HUGE_VAL for options that fail to load or run, those are never kept
+// returns false when not a single candidate ran, flags is then left as base and should not be cached
+bool autotuneSearch(const ncnn::Option& base, const std::function<double(const ncnn::Option&)>& time_candidate, uint32_t& flags);
+
+// results are keyed by device, driver, model file, tile size and storage precision
+std::string autotuneKey(const ncnn::GpuInfo& info, const std::string& modelpath, int tile_w, int tile_h, const ncnn::Option& base);
+
+// default results file in the user's cache directory, empty when there is none
+std::string autotuneCachePath();
+bool autotuneLookup(const std::string& cache_path, const std::string& key, uint32_t& flags);
+void autotuneStore(const std::string& cache_path, const std::string& key, uint32_t flags);
+
+// seconds one tile of a mid-grey frame takes through engine.process_gpu, after a warm-up run, HUGE_VAL if any run fails
+template <class Engine>
+double autotuneTime(const Engine& engine, int tile_w, int tile_h, int scale)
+{
+    const ncnn::VulkanDevice* vkdev = engine.vulkan_device();
+    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
+    ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
+
+    ncnn::Option opt;
+    opt.blob_vkallocator = blob_vkallocator;
+    opt.workspace_vkallocator = blob_vkallocator;
+    opt.staging_vkallocator = staging_vkallocator;
+
+    ncnn::Mat in(tile_w, tile_h, 3);
+    in.fill(128.f);
+
+    double seconds = HUGE_VAL;
+    for (int run = 0; run < 2; run++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        ncnn::VkCompute cmd(vkdev);
+        ncnn::VkMat in_gpu;
+        cmd.record_clone(in, in_gpu, opt);
+        ncnn::VkMat out_gpu;
+        out_gpu.create(tile_w * scale, tile_h * scale, 3, sizeof(float), blob_vkallocator);
+        if (out_gpu.empty()
+            || engine.process_gpu(in_gpu, 0, 0, tile_w, tile_h, out_gpu, cmd, blob_vkallocator, staging_vkallocator) != 0
+            || cmd.submit_and_wait() != 0)
+        {
+            seconds = HUGE_VAL;
+            break;
+        }
+
+        if (run > 0)
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    vkdev->reclaim_blob_allocator(blob_vkallocator);
+    vkdev->reclaim_staging_allocator(staging_vkallocator);
+
+    return seconds;
+}
+
+#endif // AUTOTUNE_HPP
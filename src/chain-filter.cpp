@@ -0,0 +1,290 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "filter-common.hpp"
+#include "model-file.hpp"
+#include "chain-filter.hpp"
+#include "gpu.h"
+#include "chain.hpp"
+#include "vsplugin.hpp"
+
+typedef struct {
+    VSNodeRef *node;
+    VSVideoInfo vi;
+    Chain *chain;
+} ChainFilterData;
+
+static int ChainFilter(const VSFrameRef *src, VSFrameRef *dst, ChainFilterData * const VS_RESTRICT d, const VSAPI *vsapi) noexcept {
+    const int w = vsapi->getFrameWidth(src, 0);
+    const int h = vsapi->getFrameHeight(src, 0);
+    const int src_stride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
+    const int dst_stride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
+    auto *             srcpR = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0));
+    auto *             srcpG = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1));
+    auto *             srcpB = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2));
+    auto * VS_RESTRICT dstpR = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0));
+    auto * VS_RESTRICT dstpG = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1));
+    auto * VS_RESTRICT dstpB = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2));
+
+    const int reductions = d->chain->tile_reductions();
+    const int ret = d->chain->process(srcpR, srcpG, srcpB, dstpR, dstpG, dstpB, w, h, src_stride, dst_stride);
+    logTileReduction("Chain-NCNN-Vulkan", reductions, d->chain->tile_reductions(), d->chain->current_tilesize(), d->chain->current_tilesize(), vsapi);
+    return ret;
+}
+
+static void VS_CC ChainFilterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<ChainFilterData *>(*instanceData);
+    vsapi->setVideoInfo(&d->vi, 1, node);
+}
+
+static const VSFrameRef *VS_CC ChainFilterGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<ChainFilterData *>(*instanceData);
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+        VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
+        int err = ChainFilter(src, dst, d, vsapi);
+        vsapi->freeFrame(src);
+        if (err) {
+            vsapi->freeFrame(dst);
+            vsapi->setFilterError("Chain-NCNN-Vulkan: Chain filter error.", frameCtx);
+        } else {
+            return dst;
+        }
+    }
+    return nullptr;
+}
+
+static void VS_CC ChainFilterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<ChainFilterData *>(instanceData);
+    vsapi->freeNode(d->node);
+    delete d->chain;
+    delete d;
+    tryDestoryGpuInstance();
+}
+
+void VS_CC ChainFilterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    ChainFilterData d{};
+    d.node = vsapi->propGetNode(in, "clip", 0, nullptr);
+    d.vi = *vsapi->getVideoInfo(d.node);
+
+    int gpuId, gpuThread, tileSize;
+    char const * err_prompt = nullptr;
+    std::string err_detail;
+    do {
+        int err;
+
+        err = tryCreateGpuInstance();
+        if (err) {
+            err_prompt = "create gpu instance failed";
+            break;
+        }
+
+        if (!isConstantFormat(&d.vi) || d.vi.format->colorFamily != cmRGB || d.vi.format->sampleType != stFloat || d.vi.format->bitsPerSample != 32) {
+            err_prompt = "only constant RGB format and 32 bit float input supported";
+            break;
+        }
+
+        gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", 0, &err));
+        if (gpuId < 0 || gpuId >= ncnn::get_gpu_count()) {
+            err_prompt = "invalid 'gpu_id'";
+            break;
+        }
+
+        int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
+        if (customGpuThread > 0) {
+            gpuThread = customGpuThread;
+        }
+        else {
+            gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
+        }
+        gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
+
+        tileSize = int64ToIntS(vsapi->propGetInt(in, "tile_size", 0, &err));
+        if (tileSize != 0 && tileSize < 32) {
+            err_prompt = "'tile_size' must be greater than or equal to 32";
+            break;
+        }
+        if (tileSize % 4) {
+            err_prompt = "'tile_size' must be multiple of 4";
+            break;
+        }
+
+        const int numStages = vsapi->propNumElements(in, "filter");
+        if (numStages < 1) {
+            err_prompt = "'filter' must name at least one stage";
+            break;
+        }
+
+        const std::string pluginFilePath{ vsapi->getPluginPath(vsapi->getPluginById(VSPLUGIN_IDENTIFIER_STR, core)) };
+        const std::string pluginDir = pluginFilePath.substr(0, pluginFilePath.find_last_of('/'));
+        const double heapBudget = ncnn::get_gpu_device(gpuId)->get_heap_budget(); // in MByte
+
+        d.chain = new Chain;
+        d.chain->strip_workers = stripWorkers(gpuId, gpuThread);
+        for (int si = 0; si < numStages && !err_prompt; si++) {
+            const std::string filter{ vsapi->propGetData(in, "filter", si, nullptr) };
+
+            std::string modelName;
+            const char *m = vsapi->propGetData(in, "model", si, &err);
+            if (!err)
+                modelName = m;
+
+            int noise = int64ToIntS(vsapi->propGetInt(in, "noise", si, &err));
+            if (err)
+                noise = 0;
+
+            int scale = int64ToIntS(vsapi->propGetInt(in, "scale", si, &err));
+            bool hasScale = !err;
+
+            Waifu2x *waifu2x = nullptr;
+            RealESRGAN *real_esrgan = nullptr;
+            int prepadding;
+            std::string paramPath, modelPath;
+            int stageTileSize = tileSize;
+
+            if (filter == "waifu2x") {
+                if (!hasScale)
+                    scale = 2;
+                if (modelName.empty())
+                    modelName = "upconv_7_anime_style_art_rgb";
+                if (noise < -1 || noise > 3) {
+                    err_prompt = "'noise' must be -1, 0, 1, 2, or 3";
+                    break;
+                }
+                if (scale != 1 && scale != 2) {
+                    err_prompt = "'scale' must be 1 or 2 for waifu2x stages";
+                    break;
+                }
+                if (modelName != "upconv_7_anime_style_art_rgb" && modelName != "upconv_7_photo" && modelName != "cunet") {
+                    err_prompt = "waifu2x 'model' must be upconv_7_anime_style_art_rgb, upconv_7_photo or cunet";
+                    break;
+                }
+                if (scale == 1 && noise == -1) {
+                    err_prompt = "use 'noise=-1' and 'scale=1' at same time is useless";
+                    break;
+                }
+                const bool cunet = modelName == "cunet";
+                if (scale == 1 && !cunet) {
+                    err_prompt = "only cunet model support 'scale=1'";
+                    break;
+                }
+
+                std::string name;
+                if (noise == -1)
+                    name = "scale2.0x_model";
+                else if (scale == 1)
+                    name = "noise" + std::to_string(noise) + "_model";
+                else
+                    name = "noise" + std::to_string(noise) + "_scale2.0x_model";
+
+                const std::string modelsDir = pluginDir + "/ncnn-models/Waifu2x/models-" + modelName + "/";
+                paramPath = modelsDir + name + ".param";
+                modelPath = modelsDir + name + ".bin";
+
+                if (stageTileSize == 0) {
+                    double factor = (cunet ? 1.5 : 1) * gpuThread;
+                    if (heapBudget / factor > 900)
+                        stageTileSize = 360;
+                    else if (heapBudget / factor > 450)
+                        stageTileSize = 240;
+                    else
+                        stageTileSize = 180;
+                }
+
+                if (cunet && scale == 1)
+                    prepadding = 28;
+                else if (cunet)
+                    prepadding = 18;
+                else
+                    prepadding = 7;
+
+                waifu2x = new Waifu2x(gpuId, gpuThread, 0);
+                waifu2x->noise = noise;
+                waifu2x->scale = scale;
+                waifu2x->tilesize_w = stageTileSize;
+                waifu2x->tilesize_h = stageTileSize;
+                waifu2x->prepadding = prepadding;
+            } else if (filter == "realesrgan") {
+                if (!hasScale)
+                    scale = 4;
+                if (modelName.empty())
+                    modelName = "realesrgan-x4plus";
+                if (scale != 4) {
+                    err_prompt = "'scale' must be 4 for realesrgan stages";
+                    break;
+                }
+
+                const std::string modelsDir = pluginDir + "/ncnn-models/Real-ESRGAN/";
+                paramPath = modelsDir + modelName + ".param";
+                modelPath = modelsDir + modelName + ".bin";
+
+                if (stageTileSize == 0) {
+                    if (heapBudget > 1900)
+                        stageTileSize = 200;
+                    else if (heapBudget > 550)
+                        stageTileSize = 100;
+                    else if (heapBudget > 190)
+                        stageTileSize = 64;
+                    else
+                        stageTileSize = 32;
+                }
+
+                prepadding = 10;
+
+                real_esrgan = new RealESRGAN(gpuId, gpuThread, 0);
+                real_esrgan->scale = scale;
+                real_esrgan->tilesize = stageTileSize;
+                real_esrgan->prepadding = prepadding;
+            } else {
+                err_prompt = "'filter' must be waifu2x or realesrgan";
+                break;
+            }
+
+            // check model file readable
+            if (!modelFileExists(paramPath) || !modelFileExists(modelPath)) {
+                delete waifu2x;
+                delete real_esrgan;
+                err_detail = "can't open model file " + paramPath;
+                err_prompt = err_detail.c_str();
+                break;
+            }
+
+            if (waifu2x ? waifu2x->load(paramPath, modelPath) : real_esrgan->load(paramPath, modelPath)) {
+                delete waifu2x;
+                delete real_esrgan;
+                err_detail = "can't load model " + paramPath;
+                err_prompt = err_detail.c_str();
+                break;
+            }
+
+            // the first stage decides the strip size, the chain adds the halos the later stages need around it
+            if (si == 0)
+                d.chain->tilesize = stageTileSize;
+            if (waifu2x)
+                d.chain->add(waifu2x);
+            else
+                d.chain->add(real_esrgan);
+        }
+
+        break;
+    } while (false);
+
+    if (err_prompt) {
+        vsapi->setError(out, (std::string{"Chain-NCNN-Vulkan: "} + err_prompt).c_str());
+        vsapi->freeNode(d.node);
+        delete d.chain;
+        tryDestoryGpuInstance();
+        return;
+    }
+
+    d.vi.width *= d.chain->scale();
+    d.vi.height *= d.chain->scale();
+
+    auto *data = new ChainFilterData{ d };
+
+    vsapi->createFilter(in, out, "Chain", ChainFilterInit, ChainFilterGetFrame, ChainFilterFree, fmParallel, 0, data, core);
+}
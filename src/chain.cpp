@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <utility>
+
+#include "chain.hpp"
+
+Chain::Chain()
+{
+    tilesize = 200;
+    strip_workers = 1;
+    _scale = 1;
+    _halo = 0;
+    _tile_shift = 0;
+}
+
+void Chain::add(Waifu2x* waifu2x)
+{
+    Stage stage;
+    stage.waifu2x.reset(waifu2x);
+    stage.scale = waifu2x->scale;
+    add_stage(std::move(stage), waifu2x->prepadding);
+}
+
+void Chain::add(RealESRGAN* real_esrgan)
+{
+    Stage stage;
+    stage.real_esrgan.reset(real_esrgan);
+    stage.scale = real_esrgan->scale;
+    add_stage(std::move(stage), real_esrgan->prepadding);
+}
+
+void Chain::add_stage(Stage stage, int prepadding)
+{
+    // the padding is in the stage's input pixels, _scale of them to a source pixel
+    stage.halo = (prepadding + _scale - 1) / _scale;
+    _halo += stage.halo;
+    _scale *= stage.scale;
+    _stages.push_back(std::move(stage));
+}
+
+int Chain::process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int w, int h, int src_stride, int dst_stride) const
+{
+    if (_stages.empty())
+        return -1;
+
+    const Stage& first = _stages[0];
+    const ncnn::VulkanDevice* vkdev = first.waifu2x ? first.waifu2x->vulkan_device() : first.real_esrgan->vulkan_device();
+    // the strips are copied in and out as the first stage's net would
+    const ncnn::Option& opt = first.waifu2x ? first.waifu2x->net_options() : first.real_esrgan->net_options();
+
+    const StripFrame frame = { srcpR, srcpG, srcpB, nullptr, dstpR, dstpG, dstpB, nullptr, w, h, src_stride, dst_stride, nullptr, 0 };
+
+    return processShrinkingTiles(_tile_shift, tilesize, tilesize, w, h, [&](int tile_w, int tile_h, const TileRegion& region, FailedRegions& failed) {
+        return processStrips(vkdev, opt, nullptr, _scale, _halo, strip_workers, frame, region, tile_w, tile_h,
+            [&](const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, const unsigned char*) {
+                return record(in_gpu, x0, y0, width, height, out_gpu, cmd, blob_vkallocator, staging_vkallocator);
+            }, failed);
+    });
+}
+
+int Chain::record(const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator) const
+{
+    const int channels = 3;
+
+    // intermediate results stay referenced until they have been consumed
+    std::vector<ncnn::VkMat> mids(_stages.size() - 1);
+
+    // the region of in_gpu, in source pixels, that the current stage input holds
+    const ncnn::VkMat* stage_in = &in_gpu;
+    int in_x0 = 0;
+    int in_y0 = 0;
+    int in_scale = 1;
+    int halo = _halo;
+
+    for (size_t si = 0; si < _stages.size(); si++)
+    {
+        const Stage& stage = _stages[si];
+
+        // each stage covers the region with what the later stages read around it,
+        // cut off only where the strip ends at the frame edge, which the stages then pad as their own edge
+        halo -= stage.halo;
+        const int out_x0 = std::max(x0 - halo, 0);
+        const int out_y0 = std::max(y0 - halo, 0);
+        const int out_x1 = std::min(x0 + width + halo, in_gpu.w);
+        const int out_y1 = std::min(y0 + height + halo, in_gpu.h);
+
+        ncnn::VkMat* stage_out = &out_gpu;
+        if (si + 1 < _stages.size())
+        {
+            stage_out = &mids[si];
+            stage_out->create((out_x1 - out_x0) * in_scale * stage.scale, (out_y1 - out_y0) * in_scale * stage.scale, channels, sizeof(float), blob_vkallocator);
+            if (stage_out->empty())
+                return TILE_OUT_OF_MEMORY;
+        }
+
+        const int sx = (out_x0 - in_x0) * in_scale;
+        const int sy = (out_y0 - in_y0) * in_scale;
+        const int sw = (out_x1 - out_x0) * in_scale;
+        const int sh = (out_y1 - out_y0) * in_scale;
+        const int ret = stage.waifu2x
+            ? stage.waifu2x->process_gpu(*stage_in, sx, sy, sw, sh, *stage_out, cmd, blob_vkallocator, staging_vkallocator)
+            : stage.real_esrgan->process_gpu(*stage_in, sx, sy, sw, sh, *stage_out, cmd, blob_vkallocator, staging_vkallocator);
+        if (ret != 0)
+            return ret;
+
+        stage_in = stage_out;
+        in_x0 = out_x0;
+        in_y0 = out_y0;
+        in_scale *= stage.scale;
+    }
+
+    // the intermediate results must be consumed before they are released
+    if (_stages.size() > 1)
+    {
+        if (cmd.submit_and_wait() != 0)
+            return -1;
+        cmd.reset();
+    }
+
+    return 0;
+}
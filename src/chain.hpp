@@ -0,0 +1,66 @@
+#ifndef CHAIN_HPP
+#define CHAIN_HPP
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// ncnn
+#include "net.h"
+#include "gpu.h"
+
+#include "tile-process.hpp"
+#include "waifu2x.hpp"
+#include "real-esrgan.hpp"
+
+// Waifu2x and RealESRGAN stages run back to back on the strips of processStrips, the intermediate results staying in device memory
+// each strip carries enough rows and columns around it for the combined receptive field, so only the last stage's output is downloaded
+class Chain
+{
+public:
+    Chain();
+
+    // takes the loaded engine, with its scale and prepadding set; stages run in the order they were added, on the first one's device
+    void add(Waifu2x* waifu2x);
+    void add(RealESRGAN* real_esrgan);
+
+    // product of the stage scales
+    int scale() const { return _scale; }
+
+    // a strip that fails for lack of device memory is retried with smaller strips, which are kept from then on;
+    // the stages' own tiles stay as configured
+    int process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int width, int height, int src_stride, int dst_stride) const;
+
+    // strip size in use, smaller than the configured one after running out of device memory
+    int current_tilesize() const { return reducedTilesize(tilesize, _tile_shift); }
+    // how many times the strips were halved
+    int tile_reductions() const { return _tile_shift; }
+
+public:
+    // strips are this many source rows high and grouped in columns of this width
+    int tilesize;
+
+    // strips of one frame run on up to this many compute queues at once, 1 keeps them in order on one
+    int strip_workers;
+
+private:
+    struct Stage
+    {
+        std::unique_ptr<Waifu2x> waifu2x;
+        std::unique_ptr<RealESRGAN> real_esrgan;
+        int scale;
+        // source pixels this stage reads around its output, on top of what the later stages need
+        int halo;
+    };
+
+    int record(const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator) const;
+
+    void add_stage(Stage stage, int prepadding);
+
+    std::vector<Stage> _stages;
+    int _scale;
+    int _halo;
+    mutable std::atomic<int> _tile_shift;
+};
+
+#endif // CHAIN_HPP
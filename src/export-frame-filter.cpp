@@ -1,8 +1,11 @@
+#include <cstdio>
+#include <memory>
 #include <string>
 #include <vapoursynth/VSHelper.h>
 
 #include "filter-common.hpp"
 #include "export-frame-filter.hpp"
+#include "frame-writer.hpp"
 
 typedef struct {
     std::string dir;
@@ -12,10 +15,15 @@ typedef struct {
     VSVideoInfo vi;
     VSNodeRef *node;
     const VSAPI *vsapi;
+    std::unique_ptr<FrameWriter> writer;
 } ExportFrameFilterData;
 
 static void ExportFrameFilterDataFreeAndClear(ExportFrameFilterData **d)
 {
+    if (*d == nullptr)
+        return;
+    // flush pending writes before the node goes away
+    (*d)->writer.reset();
     if ((*d)->vsapi != nullptr && (*d)->node != nullptr) {
         (*d)->vsapi->freeNode((*d)->node);
         (*d)->node = nullptr;
@@ -37,6 +45,20 @@ static const VSFrameRef *VS_CC ExportFrameFilterGetFrame(int n, int activationRe
         vsapi->requestFrameFilter(n, d->node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
         const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+
+        if (d->writer->failed()) {
+            vsapi->freeFrame(src);
+            vsapi->setFilterError("Export-Frame-Filter: writing frames failed, see the log for the file.", frameCtx);
+            return nullptr;
+        }
+
+        if (d->frame < 0 || d->frame == n) {
+            char number[16];
+            snprintf(number, sizeof(number), "%06d", n);
+            // the writer keeps its own reference until the file is on disk
+            d->writer->push(vsapi->cloneFrameRef(src), d->dir + "/" + d->prefix + number + d->suffix);
+        }
+
         return src;
     }
     return nullptr;
@@ -58,19 +80,53 @@ void VS_CC ExportFrameFilterCreate(const VSMap *in, VSMap *out, void *userData,
     d->vsapi = vsapi;
 
     do {
-        vsapi->propGetData(in, "dir", 0, &err);
+        const char *dir = vsapi->propGetData(in, "dir", 0, &err);
         if (err) {
             err_prompt = "'dir' must be set";
             break;
         }
+        d->dir = dir;
+
+        const char *prefix = vsapi->propGetData(in, "prefix", 0, &err);
+        d->prefix = err ? "" : prefix;
+
+        const char *suffix = vsapi->propGetData(in, "suffix", 0, &err);
+        d->suffix = err ? ".raw" : suffix;
+
+        d->frame = int64ToIntS(vsapi->propGetInt(in, "frame", 0, &err));
+        if (err)
+            d->frame = -1;
+        if (d->frame >= d->vi.numFrames) {
+            err_prompt = "'frame' is out of range";
+            break;
+        }
+
+        int threads = int64ToIntS(vsapi->propGetInt(in, "threads", 0, &err));
+        if (err)
+            threads = 2;
+        if (threads < 1) {
+            err_prompt = "'threads' must be greater than or equal to 1";
+            break;
+        }
+
+        int queue = int64ToIntS(vsapi->propGetInt(in, "queue", 0, &err));
+        if (err)
+            queue = 8;
+        if (queue < 1) {
+            err_prompt = "'queue' must be greater than or equal to 1";
+            break;
+        }
+
+        bool directIO = !!vsapi->propGetInt(in, "direct_io", 0, &err);
+
+        d->writer.reset(new FrameWriter(vsapi, threads, queue, directIO));
     } while (false);
 
     if (err_prompt) {
         vsapi->setError(out, (std::string{"Export-Frame-Filter: "} + err_prompt).c_str());
-        vsapi->freeNode(d->node);
-        return;
+        goto bail;
     }
-    
+
     vsapi->createFilter(in, out, "ExportFrame", ExportFrameFilterInit, ExportFrameFilterGetFrame, ExportFrameFilterFree, fmParallel, 0, d, core);
     d = nullptr;
 
@@ -1,3 +1,10 @@
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "filter-common.hpp"
+#include <vapoursynth/VSHelper.h>
 #include "gpu.h"
 
 static ncnn::Mutex instanceLock;
@@ -18,3 +25,360 @@ void tryDestoryGpuInstance() {
         ncnn::destroy_gpu_instance();
     }
 }
+
+static void boxBlur(float *weight, int width, int height, int radius) {
+    if (radius <= 0)
+        return;
+
+    std::vector<float> line(std::max(width, height));
+    const float norm = 1.f / (2 * radius + 1);
+
+    for (int y = 0; y < height; y++) {
+        float *row = weight + y * width;
+        std::copy(row, row + width, line.begin());
+        float sum = line[0] * radius;
+        for (int x = 0; x <= radius; x++)
+            sum += line[std::min(x, width - 1)];
+        for (int x = 0; x < width; x++) {
+            row[x] = sum * norm;
+            sum += line[std::min(x + radius + 1, width - 1)] - line[std::max(x - radius, 0)];
+        }
+    }
+
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++)
+            line[y] = weight[y * width + x];
+        float sum = line[0] * radius;
+        for (int y = 0; y <= radius; y++)
+            sum += line[std::min(y, height - 1)];
+        for (int y = 0; y < height; y++) {
+            weight[y * width + x] = sum * norm;
+            sum += line[std::min(y + radius + 1, height - 1)] - line[std::max(y - radius, 0)];
+        }
+    }
+
+    // running sums leave tiny residues where the blur has fully faded out, which would keep whole tiles alive
+    for (int i = 0; i < width * height; i++) {
+        if (weight[i] < 1e-4f)
+            weight[i] = 0.f;
+        else if (weight[i] > 1.f - 1e-4f)
+            weight[i] = 1.f;
+    }
+}
+
+void makeRoiWeight(float *weight, int width, int height, int roiX, int roiY, int roiW, int roiH, int feather) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            bool inside = x >= roiX && x < roiX + roiW && y >= roiY && y < roiY + roiH;
+            weight[y * width + x] = inside ? 1.f : 0.f;
+        }
+    }
+    boxBlur(weight, width, height, feather);
+}
+
+void makeMaskWeight(float *weight, const VSFrameRef *mask, int feather, const VSAPI *vsapi) {
+    const VSFormat *fi = vsapi->getFrameFormat(mask);
+    const int width = vsapi->getFrameWidth(mask, 0);
+    const int height = vsapi->getFrameHeight(mask, 0);
+    const int stride = vsapi->getStride(mask, 0);
+    const uint8_t *srcp = vsapi->getReadPtr(mask, 0);
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = srcp + y * stride;
+        for (int x = 0; x < width; x++) {
+            float v;
+            if (fi->sampleType == stFloat)
+                v = reinterpret_cast<const float *>(row)[x];
+            else if (fi->bytesPerSample == 1)
+                v = row[x] / float((1 << fi->bitsPerSample) - 1);
+            else
+                v = reinterpret_cast<const uint16_t *>(row)[x] / float((1 << fi->bitsPerSample) - 1);
+            weight[y * width + x] = std::min(1.f, std::max(0.f, v));
+        }
+    }
+    boxBlur(weight, width, height, feather);
+}
+
+const char *getRoiMaskArgs(const VSMap *in, const VSVideoInfo *vi, VSNodeRef **mask, std::vector<float> &roiWeight, int &feather, const VSAPI *vsapi) {
+    int err;
+
+    feather = int64ToIntS(vsapi->propGetInt(in, "feather", 0, &err));
+    if (err)
+        feather = 8;
+    if (feather < 0)
+        return "'feather' must be greater than or equal to 0";
+
+    const int roiCount = vsapi->propNumElements(in, "roi");
+    *mask = vsapi->propGetNode(in, "mask", 0, &err);
+
+    if (roiCount > 0 && *mask)
+        return "'roi' and 'mask' can't be used at the same time";
+
+    if (roiCount > 0) {
+        if (roiCount != 4)
+            return "'roi' must be [x, y, width, height]";
+
+        const int roiX = int64ToIntS(vsapi->propGetInt(in, "roi", 0, nullptr));
+        const int roiY = int64ToIntS(vsapi->propGetInt(in, "roi", 1, nullptr));
+        const int roiW = int64ToIntS(vsapi->propGetInt(in, "roi", 2, nullptr));
+        const int roiH = int64ToIntS(vsapi->propGetInt(in, "roi", 3, nullptr));
+        if (roiX < 0 || roiY < 0 || roiW <= 0 || roiH <= 0 || roiX + roiW > vi->width || roiY + roiH > vi->height)
+            return "'roi' must lie inside the frame";
+
+        roiWeight.resize(static_cast<size_t>(vi->width) * vi->height);
+        makeRoiWeight(roiWeight.data(), vi->width, vi->height, roiX, roiY, roiW, roiH, feather);
+    }
+
+    if (*mask) {
+        const VSVideoInfo *mvi = vsapi->getVideoInfo(*mask);
+        if (!isConstantFormat(mvi) || mvi->format->colorFamily != cmGray || mvi->width != vi->width || mvi->height != vi->height)
+            return "'mask' must be a constant format gray clip with the same dimensions as 'clip'";
+        if (!(mvi->format->sampleType == stInteger && mvi->format->bitsPerSample <= 16) && !(mvi->format->sampleType == stFloat && mvi->format->bitsPerSample == 32))
+            return "'mask' must be 8-16 bit integer or 32 bit float";
+    }
+
+    return nullptr;
+}
+
+const char *getAlphaArg(const VSMap *in, const VSVideoInfo *vi, VSNodeRef **alpha, const VSAPI *vsapi) {
+    int err;
+    *alpha = vsapi->propGetNode(in, "alpha", 0, &err);
+    if (!*alpha)
+        return nullptr;
+
+    const VSVideoInfo *avi = vsapi->getVideoInfo(*alpha);
+    if (!isConstantFormat(avi) || avi->format->colorFamily != cmGray || avi->format->sampleType != stFloat || avi->format->bitsPerSample != 32
+        || avi->width != vi->width || avi->height != vi->height)
+        return "'alpha' must be a constant format gray 32 bit float clip with the same dimensions as 'clip'";
+    if (avi->numFrames < vi->numFrames)
+        return "'alpha' must have at least as many frames as 'clip'";
+
+    return nullptr;
+}
+
+const char *getAlphaFrame(int n, VSNodeRef *alpha, const VSFrameRef *src, const VSFrameRef **alphaFrame, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    int err;
+    if (alpha)
+        *alphaFrame = vsapi->getFrameFilter(n, alpha, frameCtx);
+    else
+        *alphaFrame = vsapi->propGetFrame(vsapi->getFramePropsRO(src), "_Alpha", 0, &err);
+    if (!*alphaFrame)
+        return nullptr;
+
+    // the engines address the alpha plane with the strides of the rgb planes
+    const VSFormat *format = vsapi->getFrameFormat(*alphaFrame);
+    if (format->colorFamily != cmGray || format->sampleType != stFloat || format->bitsPerSample != 32
+        || vsapi->getFrameWidth(*alphaFrame, 0) != vsapi->getFrameWidth(src, 0) || vsapi->getFrameHeight(*alphaFrame, 0) != vsapi->getFrameHeight(src, 0)
+        || vsapi->getStride(*alphaFrame, 0) != vsapi->getStride(src, 0))
+        return "the alpha frame must be gray 32 bit float with the same dimensions as the frame";
+
+    return nullptr;
+}
+
+std::vector<std::string> getServerArgs(const VSMap *in, const VSAPI *vsapi) {
+    std::vector<std::string> servers;
+    const int count = vsapi->propNumElements(in, "server");
+    for (int i = 0; i < count; i++)
+        servers.emplace_back(vsapi->propGetData(in, "server", i, nullptr));
+    return servers;
+}
+
+void logTileReduction(const char *filterName, int reductionsBefore, int reductionsAfter, int tileW, int tileH, const VSAPI *vsapi) {
+    if (reductionsAfter <= reductionsBefore)
+        return;
+
+    const std::string message = std::string{ filterName } + ": out of device memory, tile size reduced to "
+        + std::to_string(tileW) + "x" + std::to_string(tileH) + " (" + std::to_string(reductionsAfter) + " reductions so far)";
+    vsapi->logMessage(mtWarning, message.c_str());
+}
+
+int stripWorkers(int gpuId, int gpuThread) {
+    return std::max(1, static_cast<int>(ncnn::get_gpu_info(gpuId).compute_queue_count()) / std::max(gpuThread, 1));
+}
+
+Lookahead::Buffer::~Buffer() {
+    for (auto &frame : ready)
+        vsapi->freeFrame(frame.second);
+}
+
+void VS_CC Lookahead::frameDone(void *userData, const VSFrameRef *f, int n, VSNodeRef *node, const char *errorMsg) {
+    auto *buffer = static_cast<std::shared_ptr<Buffer> *>(userData);
+    // a failed fetch leaves nothing behind, the frame's own request then reports the error
+    if (f) {
+        std::lock_guard<std::mutex> guard((*buffer)->lock);
+        auto &slot = (*buffer)->ready[n];
+        (*buffer)->vsapi->freeFrame(slot);
+        slot = f;
+    }
+    delete buffer;
+}
+
+void Lookahead::prefetch(int n, VSNodeRef *node, int numFrames, const VSAPI *vsapi) {
+    if (frames <= 0)
+        return;
+
+    {
+        // frames left behind by a seek or never asked for again don't pile up
+        std::lock_guard<std::mutex> guard(buffer->lock);
+        buffer->vsapi = vsapi;
+        for (auto it = buffer->ready.begin(); it != buffer->ready.end();) {
+            if (it->first < n - frames || it->first > n + frames) {
+                vsapi->freeFrame(it->second);
+                it = buffer->ready.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // parallel requests arrive slightly out of order, anything moving forward within the window counts as linear
+    const int prev = last.exchange(n);
+    if (n <= prev || n - prev > frames)
+        return;
+
+    // frame n already started up to prev + frames, only the new end of the window is needed
+    const int first = prev < 0 ? n + 1 : std::max(n + 1, prev + frames + 1);
+    for (int i = first; i <= n + frames && i < numFrames; i++)
+        vsapi->getFrameAsync(i, node, frameDone, new std::shared_ptr<Buffer>(buffer));
+}
+
+const VSFrameRef *Lookahead::take(int n) {
+    if (frames <= 0)
+        return nullptr;
+
+    std::lock_guard<std::mutex> guard(buffer->lock);
+    auto it = buffer->ready.find(n);
+    if (it == buffer->ready.end())
+        return nullptr;
+    const VSFrameRef *frame = it->second;
+    buffer->ready.erase(it);
+    return frame;
+}
+
+FrameBatch::Group::~Group() {
+    for (auto dst : dsts)
+        vsapi->freeFrame(dst);
+}
+
+void FrameBatch::request(int n, VSNodeRef *node, int numFrames, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    const int first = n / frames * frames;
+    for (int i = first; i < first + frames && i < numFrames; i++)
+        if (i != n)
+            vsapi->requestFrameFilter(i, node, frameCtx);
+}
+
+const VSFrameRef *FrameBatch::get(int n, VSNodeRef *node, int numFrames, VSFrameContext *frameCtx, const VSAPI *vsapi, const Process &process, std::string &error) {
+    const int first = n / frames * frames;
+    const int count = std::min(frames, numFrames - first);
+
+    std::promise<std::shared_ptr<Group>> promise;
+    std::shared_future<std::shared_ptr<Group>> result;
+    bool run = false;
+    int id;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = groups.find(first);
+        if (it == groups.end()) {
+            Pending &pending = groups[first];
+            pending.result = promise.get_future().share();
+            pending.taken.assign(count, false);
+            pending.remaining = count;
+            pending.id = nextId++;
+            it = groups.find(first);
+            run = true;
+
+            // a group some of whose frames are never asked for (a trim, a SelectEvery after the filter) would stay forever otherwise
+            while (static_cast<int>(groups.size()) > std::max(maxGroups, 1)) {
+                auto oldest = groups.begin();
+                for (auto i = groups.begin(); i != groups.end(); ++i)
+                    if (i->second.id < oldest->second.id)
+                        oldest = i;
+                groups.erase(oldest);
+            }
+        }
+        result = it->second.result;
+        id = it->second.id;
+    }
+
+    if (run) {
+        // every frame of the group was requested along with n, so any of them may run it
+        std::vector<const VSFrameRef *> srcs;
+        for (int i = first; i < first + count; i++)
+            srcs.push_back(vsapi->getFrameFilter(i, node, frameCtx));
+
+        auto group = std::make_shared<Group>();
+        group->vsapi = vsapi;
+        const char *err = process(srcs, group->dsts);
+        if (err)
+            group->error = err;
+
+        for (auto src : srcs)
+            vsapi->freeFrame(src);
+        promise.set_value(group);
+    }
+
+    // holding the group keeps its outputs alive even if the last of its frames drops it meanwhile
+    const std::shared_ptr<Group> group = result.get();
+    if (!group->error.empty())
+        error = group->error;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = groups.find(first);
+        if (it != groups.end() && it->second.id == id && !it->second.taken[n - first]) {
+            it->second.taken[n - first] = true;
+            if (--it->second.remaining == 0)
+                groups.erase(it);
+        }
+    }
+
+    return group->error.empty() ? vsapi->cloneFrameRef(group->dsts[n - first]) : nullptr;
+}
+
+int packMosaic(const std::vector<const VSFrameRef *> &frames, int gutter, bool reflect, std::vector<float> &mosaic, const VSAPI *vsapi) {
+    const int width = vsapi->getFrameWidth(frames[0], 0);
+    const int height = vsapi->getFrameHeight(frames[0], 0);
+    const int cell = width + 2 * gutter;
+    const int mosaicWidth = cell * static_cast<int>(frames.size());
+    const size_t plane = static_cast<size_t>(mosaicWidth) * height;
+
+    // source column of each mosaic column of a cell, as RealESRGAN's preproc reflects and Waifu2x's clamps past the edge
+    std::vector<int> columns(cell);
+    for (int x = 0; x < cell; x++) {
+        int v = x - gutter;
+        if (reflect)
+            v = (width - 1) - std::abs(std::abs(v) - (width - 1));
+        columns[x] = std::min(std::max(v, 0), width - 1);
+    }
+
+    mosaic.resize(plane * 3);
+    for (size_t i = 0; i < frames.size(); i++) {
+        for (int p = 0; p < 3; p++) {
+            const int srcStride = vsapi->getStride(frames[i], p) / static_cast<int>(sizeof(float));
+            const float *srcp = reinterpret_cast<const float *>(vsapi->getReadPtr(frames[i], p));
+            float *dstp = mosaic.data() + plane * p + cell * i;
+
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < cell; x++)
+                    dstp[x] = srcp[columns[x]];
+                srcp += srcStride;
+                dstp += mosaicWidth;
+            }
+        }
+    }
+    return mosaicWidth;
+}
+
+void unpackMosaic(const float *mosaic, int mosaicWidth, int height, int gutter, int scale, const std::vector<VSFrameRef *> &frames, const VSAPI *vsapi) {
+    const int cell = mosaicWidth / static_cast<int>(frames.size());
+    const int outStride = mosaicWidth * scale;
+    const size_t plane = static_cast<size_t>(outStride) * height * scale;
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        for (int p = 0; p < 3; p++) {
+            const float *srcp = mosaic + plane * p + (cell * i + gutter) * scale;
+            vs_bitblt(vsapi->getWritePtr(frames[i], p), vsapi->getStride(frames[i], p), srcp, outStride * static_cast<int>(sizeof(float)),
+                      vsapi->getFrameWidth(frames[i], p) * sizeof(float), vsapi->getFrameHeight(frames[i], p));
+        }
+    }
+}
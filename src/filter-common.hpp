@@ -1,5 +1,128 @@
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <vapoursynth/VapourSynth.h>
+
 #define FreeAndClear(p) \
     if ((p) != nullptr && (*(p)) != nullptr) { delete (*(p)); (*(p)) = nullptr; }
 
 int tryCreateGpuInstance();
 void tryDestoryGpuInstance();
+
+// network weight for the 'roi' and 'mask' options, one float per input pixel
+// the region is 1, and its edge is feathered with a box blur of radius feather
+void makeRoiWeight(float *weight, int width, int height, int roiX, int roiY, int roiW, int roiH, int feather);
+void makeMaskWeight(float *weight, const VSFrameRef *mask, int feather, const VSAPI *vsapi);
+
+// read the shared 'roi', 'mask' and 'feather' arguments, returns an error message or nullptr
+// on success either mask is set or roiWeight holds the weight of the rectangle, or neither when both are absent
+const char *getRoiMaskArgs(const VSMap *in, const VSVideoInfo *vi, VSNodeRef **mask, std::vector<float> &roiWeight, int &feather, const VSAPI *vsapi);
+
+// read the 'alpha' argument, a gray 32 bit float clip the size of 'clip', returns an error message or nullptr
+const char *getAlphaArg(const VSMap *in, const VSVideoInfo *vi, VSNodeRef **alpha, const VSAPI *vsapi);
+
+// the alpha plane of frame n, from the 'alpha' clip when set and otherwise the _Alpha frame attached to src,
+// alphaFrame is left nullptr when there is neither; returns an error message or nullptr, alphaFrame must be freed either way
+const char *getAlphaFrame(int n, VSNodeRef *alpha, const VSFrameRef *src, const VSFrameRef **alphaFrame, VSFrameContext *frameCtx, const VSAPI *vsapi);
+
+// addresses given to 'server', unix socket paths or host:port of tcp workers, empty when unset
+std::vector<std::string> getServerArgs(const VSMap *in, const VSAPI *vsapi);
+
+// warn when a frame left the engine with more tile reductions than it started with,
+// the engines halve their tiles after running out of device memory and keep the smaller size
+void logTileReduction(const char *filterName, int reductionsBefore, int reductionsAfter, int tileW, int tileH, const VSAPI *vsapi);
+
+// the engines' strip_workers: compute queues of gpuId that gpuThread frame threads leave idle take strips of the same frame
+int stripWorkers(int gpuId, int gpuThread);
+
+// run load on its own thread and return its result to wait on, so creating a filter returns at once,
+// independent filters of a script load in parallel and only the first frame waits for the net
+template <class Load>
+auto loadInBackground(Load load) -> std::shared_future<decltype(load())> {
+    return std::async(std::launch::async, load).share();
+}
+
+// 'lookahead' argument: while frames are requested in order, the next frames are fetched from upstream as well,
+// so slow source filters are already working on them while the current frame is on the GPU
+// the fetches are not requests of frame n, which never waits for them, and what arrives is kept in a ready buffer
+struct Lookahead {
+    int frames = 0;
+    std::atomic<int> last{ -1 };
+
+    Lookahead() : buffer(std::make_shared<Buffer>()) {}
+    Lookahead(const Lookahead &other) : frames(other.frames), last(other.last.load()), buffer(std::make_shared<Buffer>()) {}
+
+    // call in arInitial of frame n, starts fetching the frames after it and drops buffered ones outside the window
+    void prefetch(int n, VSNodeRef *node, int numFrames, const VSAPI *vsapi);
+
+    // frame n if it already arrived, the reference passing to the caller, otherwise nullptr and it must be requested
+    const VSFrameRef *take(int n);
+
+private:
+    struct Buffer {
+        std::mutex lock;
+        std::map<int, const VSFrameRef *> ready;
+        const VSAPI *vsapi = nullptr;
+        ~Buffer();
+    };
+
+    static void VS_CC frameDone(void *userData, const VSFrameRef *f, int n, VSNodeRef *node, const char *errorMsg);
+
+    // fetches still running hold it as well, they may finish after the filter is freed
+    std::shared_ptr<Buffer> buffer;
+};
+
+// 'batch' argument: consecutive frames are upscaled in groups of this many, packed side by side into one mosaic,
+// so small frames share tiles, extractions and submits instead of each paying for its own
+struct FrameBatch {
+    // fills one output per source frame, returns an error message or nullptr
+    typedef std::function<const char *(const std::vector<const VSFrameRef *> &srcs, std::vector<VSFrameRef *> &dsts)> Process;
+
+    int frames = 1;
+    // groups kept for frames that haven't been asked for yet, the oldest is dropped beyond this
+    // and recomputed should one of its frames still come, set it to the core's thread count
+    int maxGroups = 1;
+
+    FrameBatch() = default;
+    FrameBatch(const FrameBatch &other) : frames(other.frames), maxGroups(other.maxGroups) {}
+
+    // call in arInitial after requesting frame n itself, asks for the rest of n's group
+    void request(int n, VSNodeRef *node, int numFrames, VSFrameContext *frameCtx, const VSAPI *vsapi);
+
+    // the output of frame n, the first frame of a group to get here runs process over the whole group and the others wait for it
+    // the wait is bounded by that one process call: the running thread already holds every source frame of the group
+    // and never waits on another, so a worker thread is blocked at most for one group's upscale
+    // returns nullptr with error set when process failed
+    const VSFrameRef *get(int n, VSNodeRef *node, int numFrames, VSFrameContext *frameCtx, const VSAPI *vsapi, const Process &process, std::string &error);
+
+private:
+    struct Group {
+        const VSAPI *vsapi = nullptr;
+        std::vector<VSFrameRef *> dsts;
+        std::string error;
+        ~Group();
+    };
+    struct Pending {
+        std::shared_future<std::shared_ptr<Group>> result;
+        std::vector<bool> taken;
+        int remaining;
+        int id;
+    };
+
+    std::mutex lock;
+    std::map<int, Pending> groups; // by first frame, dropped once every frame of the group had its output or when evicted
+    int nextId = 0;
+};
+
+// lay the rgb planes of frames side by side, each between gutter columns padded the way the engine pads a frame edge,
+// mirroring it with reflect and repeating the edge pixels otherwise, so the network sees every frame as if it were alone;
+// returns the width of the planes written to mosaic
+int packMosaic(const std::vector<const VSFrameRef *> &frames, int gutter, bool reflect, std::vector<float> &mosaic, const VSAPI *vsapi);
+// copy each frame out of a packed mosaic upscaled by scale, mosaicWidth and height being those before upscaling
+void unpackMosaic(const float *mosaic, int mosaicWidth, int height, int gutter, int scale, const std::vector<VSFrameRef *> &frames, const VSAPI *vsapi);
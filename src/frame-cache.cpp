@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "frame-cache.hpp"
+
+#define FRAME_CACHE_MAGIC "VSNVKIDX"
+#define FRAME_CACHE_VERSION 1
+#define FRAME_CACHE_ALIGN 4096
+
+typedef struct {
+    char magic[8];
+    int64_t version;
+    int64_t frame_size;
+} FrameCacheIndexHeader;
+
+typedef struct {
+    uint64_t key;
+    int64_t offset;
+} FrameCacheIndexEntry;
+
+#ifndef _WIN32
+// exclusive lock on the index, held while other processes could otherwise append to the same cache
+class IndexLock
+{
+public:
+    explicit IndexLock(int fd) : _fd(fd) { _locked = flock(_fd, LOCK_EX) == 0; }
+    ~IndexLock() { if (_locked) flock(_fd, LOCK_UN); }
+    bool locked() const { return _locked; }
+
+private:
+    int _fd;
+    bool _locked;
+};
+#endif
+
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t hashFrame(const VSFrameRef *frame, const VSAPI *vsapi, uint64_t seed) {
+    const VSFormat *fi = vsapi->getFrameFormat(frame);
+    uint64_t h = mix64(seed ^ 0x9e3779b97f4a7c15ULL);
+
+    for (int plane = 0; plane < fi->numPlanes; plane++) {
+        const int rowSize = vsapi->getFrameWidth(frame, plane) * fi->bytesPerSample;
+        const int height = vsapi->getFrameHeight(frame, plane);
+        const int stride = vsapi->getStride(frame, plane);
+        const uint8_t *srcp = vsapi->getReadPtr(frame, plane);
+
+        for (int y = 0; y < height; y++) {
+            const uint8_t *row = srcp + static_cast<int64_t>(y) * stride;
+            int x = 0;
+            for (; x + 8 <= rowSize; x += 8) {
+                uint64_t v;
+                memcpy(&v, row + x, 8);
+                h = (h ^ v) * 0x100000001b3ULL;
+                h ^= h >> 29;
+            }
+            for (; x < rowSize; x++)
+                h = (h ^ row[x]) * 0x100000001b3ULL;
+        }
+    }
+
+    return mix64(h);
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return mix64(h);
+}
+
+FrameCache::FrameCache()
+{
+    _segment_fd = -1;
+    _index_fd = -1;
+    _frame_size = 0;
+    _record_size = 0;
+    _segment_size = 0;
+}
+
+FrameCache::~FrameCache()
+{
+#ifndef _WIN32
+    if (_segment_fd >= 0) close(_segment_fd);
+    if (_index_fd >= 0) close(_index_fd);
+#endif
+}
+
+int FrameCache::open(const std::string& dir, const std::string& name, int64_t frame_size)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    _frame_size = frame_size;
+    _record_size = (frame_size + FRAME_CACHE_ALIGN - 1) / FRAME_CACHE_ALIGN * FRAME_CACHE_ALIGN;
+
+    const std::string base = dir + "/" + name;
+    _segment_fd = ::open((base + ".seg").c_str(), O_RDWR | O_CREAT, 0644);
+    _index_fd = ::open((base + ".idx").c_str(), O_RDWR | O_CREAT, 0644);
+    if (_segment_fd < 0 || _index_fd < 0)
+        return -1;
+
+    IndexLock index_lock(_index_fd);
+    if (!index_lock.locked())
+        return -1;
+
+    struct stat st;
+    if (fstat(_segment_fd, &st))
+        return -1;
+    _segment_size = st.st_size;
+
+    FrameCacheIndexHeader header{};
+    bool valid = pread(_index_fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, FRAME_CACHE_MAGIC, sizeof(header.magic)) == 0
+        && header.version == FRAME_CACHE_VERSION
+        && header.frame_size == frame_size;
+
+    if (valid)
+    {
+        std::vector<FrameCacheIndexEntry> entries(4096);
+        off_t pos = sizeof(header);
+        for (;;)
+        {
+            ssize_t n = pread(_index_fd, entries.data(), entries.size() * sizeof(FrameCacheIndexEntry), pos);
+            if (n <= 0)
+                break;
+            const size_t count = n / sizeof(FrameCacheIndexEntry);
+            for (size_t i = 0; i < count; i++)
+            {
+                // entries past the end of the segment come from a segment that was cut short
+                if (entries[i].offset + _record_size <= _segment_size)
+                    _offsets[entries[i].key] = entries[i].offset;
+            }
+            pos += count * sizeof(FrameCacheIndexEntry);
+            if (count < entries.size())
+                break;
+        }
+        // drop a torn trailing entry so appends stay aligned
+        if (ftruncate(_index_fd, pos))
+            return -1;
+    }
+    else
+    {
+        // new cache, or one written for a different frame size
+        if (ftruncate(_segment_fd, 0) || ftruncate(_index_fd, 0))
+            return -1;
+        _segment_size = 0;
+
+        memcpy(header.magic, FRAME_CACHE_MAGIC, sizeof(header.magic));
+        header.version = FRAME_CACHE_VERSION;
+        header.frame_size = frame_size;
+        if (pwrite(_index_fd, &header, sizeof(header), 0) != sizeof(header))
+            return -1;
+    }
+
+    // a partially written trailing record is overwritten by the next append
+    _segment_size = _segment_size / FRAME_CACHE_ALIGN * FRAME_CACHE_ALIGN;
+    for (const auto& it : _offsets)
+        _segment_size = std::max(_segment_size, it.second + _record_size);
+
+    return 0;
+#endif
+}
+
+bool FrameCache::read(uint64_t key, VSFrameRef *dst, const VSAPI *vsapi) const
+{
+#ifdef _WIN32
+    return false;
+#else
+    int64_t offset;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        auto it = _offsets.find(key);
+        if (it == _offsets.end())
+            return false;
+        offset = it->second;
+    }
+
+    // records never move once indexed, so the mapping needs no lock
+    const int64_t page = sysconf(_SC_PAGESIZE);
+    const int64_t map_offset = offset / page * page;
+    const size_t map_size = _frame_size + (offset - map_offset);
+
+    void *map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, _segment_fd, map_offset);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, map_size, MADV_SEQUENTIAL);
+
+    const VSFormat *fi = vsapi->getFrameFormat(dst);
+    const uint8_t *srcp = static_cast<const uint8_t *>(map) + (offset - map_offset);
+    for (int plane = 0; plane < fi->numPlanes; plane++) {
+        const int rowSize = vsapi->getFrameWidth(dst, plane) * fi->bytesPerSample;
+        const int height = vsapi->getFrameHeight(dst, plane);
+        const int stride = vsapi->getStride(dst, plane);
+        uint8_t *dstp = vsapi->getWritePtr(dst, plane);
+        for (int y = 0; y < height; y++) {
+            memcpy(dstp + static_cast<int64_t>(y) * stride, srcp, rowSize);
+            srcp += rowSize;
+        }
+    }
+
+    munmap(map, map_size);
+    return true;
+#endif
+}
+
+void FrameCache::write(uint64_t key, const VSFrameRef *frame, const VSAPI *vsapi)
+{
+#ifndef _WIN32
+    std::vector<uint8_t> record(_record_size, 0);
+
+    const VSFormat *fi = vsapi->getFrameFormat(frame);
+    uint8_t *dstp = record.data();
+    for (int plane = 0; plane < fi->numPlanes; plane++) {
+        const int rowSize = vsapi->getFrameWidth(frame, plane) * fi->bytesPerSample;
+        const int height = vsapi->getFrameHeight(frame, plane);
+        const int stride = vsapi->getStride(frame, plane);
+        const uint8_t *srcp = vsapi->getReadPtr(frame, plane);
+        for (int y = 0; y < height; y++) {
+            memcpy(dstp, srcp + static_cast<int64_t>(y) * stride, rowSize);
+            dstp += rowSize;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    // another thread may have rendered the same frame meanwhile
+    if (_offsets.count(key))
+        return;
+
+    IndexLock index_lock(_index_fd);
+    if (!index_lock.locked())
+        return;
+
+    // another process sharing the cache may have appended since open, so both ends are taken from the files
+    struct stat segment_st, index_st;
+    if (fstat(_segment_fd, &segment_st) || fstat(_index_fd, &index_st))
+        return;
+    // a trailing partial record or entry can only be left by a writer that died, overwrite it
+    const int64_t offset = std::max(_segment_size, static_cast<int64_t>(segment_st.st_size) / FRAME_CACHE_ALIGN * FRAME_CACHE_ALIGN);
+    const off_t index_pos = sizeof(FrameCacheIndexHeader)
+        + (index_st.st_size - static_cast<off_t>(sizeof(FrameCacheIndexHeader))) / sizeof(FrameCacheIndexEntry) * sizeof(FrameCacheIndexEntry);
+
+    if (pwrite(_segment_fd, record.data(), _record_size, offset) != _record_size)
+        return;
+    _segment_size = offset + _record_size;
+
+    FrameCacheIndexEntry entry{ key, offset };
+    if (pwrite(_index_fd, &entry, sizeof(entry), index_pos) != sizeof(entry))
+        return;
+
+    _offsets[key] = offset;
+#endif
+}
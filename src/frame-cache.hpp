@@ -0,0 +1,44 @@
+#ifndef FRAME_CACHE_HPP
+#define FRAME_CACHE_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <vapoursynth/VapourSynth.h>
+
+// 64-bit hash of every plane of frame, rows only so stride padding is ignored
+uint64_t hashFrame(const VSFrameRef *frame, const VSAPI *vsapi, uint64_t seed = 0);
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
+
+// append-only on-disk store of output frames
+// <name>.seg holds the frames at 4096-byte aligned offsets, <name>.idx the (key, offset) pairs
+// the index is written after the frame, so an interrupted run only leaves unreferenced data
+// open and every append hold flock on <name>.idx, so several processes can share one cache directory
+class FrameCache
+{
+public:
+    FrameCache();
+    ~FrameCache();
+
+    // frame_size is the packed byte size of one frame, a cache written with another size is discarded
+    int open(const std::string& dir, const std::string& name, int64_t frame_size);
+
+    // copy the frame stored under key straight from the segment mapping into dst, false on a miss
+    bool read(uint64_t key, VSFrameRef *dst, const VSAPI *vsapi) const;
+
+    void write(uint64_t key, const VSFrameRef *frame, const VSAPI *vsapi);
+
+private:
+    int _segment_fd;
+    int _index_fd;
+    int64_t _frame_size;
+    int64_t _record_size;
+    int64_t _segment_size;
+
+    mutable std::mutex _lock;
+    std::unordered_map<uint64_t, int64_t> _offsets;
+};
+
+#endif // FRAME_CACHE_HPP
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <cstdio>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "frame-writer.hpp"
+
+static void *alignedAlloc(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, FRAME_WRITER_ALIGN);
+#else
+    void *p = nullptr;
+    if (posix_memalign(&p, FRAME_WRITER_ALIGN, size))
+        return nullptr;
+    return p;
+#endif
+}
+
+static void alignedFree(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static int64_t alignUp(int64_t v) {
+    return (v + FRAME_WRITER_ALIGN - 1) / FRAME_WRITER_ALIGN * FRAME_WRITER_ALIGN;
+}
+
+FrameWriter::FrameWriter(const VSAPI *vsapi, int num_threads, int max_queued, bool direct_io)
+    : _vsapi(vsapi), _max_queued(std::max(max_queued, 1)), _direct_io(direct_io), _stop(false), _failed(false)
+{
+    for (int i = 0; i < std::max(num_threads, 1); i++)
+        _threads.emplace_back(&FrameWriter::worker, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stop = true;
+    }
+    _not_empty.notify_all();
+    for (auto &t : _threads)
+        t.join();
+}
+
+void FrameWriter::push(const VSFrameRef *frame, const std::string &path)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _not_full.wait(lock, [this] { return _queue.size() < _max_queued; });
+    _queue.push_back(Job{ frame, path });
+    lock.unlock();
+    _not_empty.notify_one();
+}
+
+void FrameWriter::worker()
+{
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _not_empty.wait(lock, [this] { return _stop || !_queue.empty(); });
+            // drain the queue before stopping so freeing the filter flushes
+            if (_queue.empty())
+                return;
+            job = _queue.front();
+            _queue.pop_front();
+        }
+        _not_full.notify_one();
+
+        if (!write(job.frame, job.path)) {
+            _failed = true;
+            _vsapi->logMessage(mtWarning, ("Export-Frame-Filter: failed to write " + job.path).c_str());
+        }
+        _vsapi->freeFrame(job.frame);
+    }
+}
+
+bool FrameWriter::write(const VSFrameRef *frame, const std::string &path) const
+{
+    const VSFormat *fi = _vsapi->getFrameFormat(frame);
+
+    FrameWriterHeader header{};
+    memcpy(header.magic, FRAME_WRITER_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.colorFamily = fi->colorFamily;
+    header.sampleType = fi->sampleType;
+    header.bitsPerSample = fi->bitsPerSample;
+    header.bytesPerSample = fi->bytesPerSample;
+    header.numPlanes = fi->numPlanes;
+
+    int64_t size = FRAME_WRITER_ALIGN;
+    for (int plane = 0; plane < fi->numPlanes; plane++) {
+        header.width[plane] = _vsapi->getFrameWidth(frame, plane);
+        header.height[plane] = _vsapi->getFrameHeight(frame, plane);
+        header.offset[plane] = size;
+        size = alignUp(size + int64_t(header.width[plane]) * header.height[plane] * fi->bytesPerSample);
+    }
+
+    // the whole file goes out in one aligned write, which O_DIRECT requires
+    auto *buf = static_cast<uint8_t *>(alignedAlloc(size));
+    if (!buf)
+        return false;
+    memset(buf, 0, FRAME_WRITER_ALIGN);
+    memcpy(buf, &header, sizeof(header));
+
+    for (int plane = 0; plane < fi->numPlanes; plane++) {
+        const int rowSize = header.width[plane] * fi->bytesPerSample;
+        const int stride = _vsapi->getStride(frame, plane);
+        const uint8_t *srcp = _vsapi->getReadPtr(frame, plane);
+        uint8_t *dstp = buf + header.offset[plane];
+        for (int y = 0; y < header.height[plane]; y++)
+            memcpy(dstp + int64_t(y) * rowSize, srcp + int64_t(y) * stride, rowSize);
+    }
+
+    bool ok = true;
+#ifdef _WIN32
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp || fwrite(buf, 1, size, fp) != size_t(size))
+        ok = false;
+    if (fp)
+        fclose(fp);
+#else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (_direct_io)
+        flags |= O_DIRECT;
+#endif
+    int fd = open(path.c_str(), flags, 0644);
+    if (fd < 0) {
+        ok = false;
+    } else {
+        int64_t written = 0;
+        while (ok && written < size) {
+            ssize_t n = ::write(fd, buf + written, size - written);
+            if (n <= 0)
+                ok = false;
+            else
+                written += n;
+        }
+        if (close(fd))
+            ok = false;
+    }
+#endif
+
+    alignedFree(buf);
+    return ok;
+}
@@ -0,0 +1,68 @@
+#ifndef FRAME_WRITER_HPP
+#define FRAME_WRITER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <vapoursynth/VapourSynth.h>
+
+// header of the files written by FrameWriter, padded to FRAME_WRITER_ALIGN bytes
+// each plane follows at the next aligned offset, rows packed without stride padding
+#define FRAME_WRITER_MAGIC "VSNVKRAW"
+#define FRAME_WRITER_ALIGN 4096
+
+typedef struct {
+    char magic[8];
+    int32_t version;
+    int32_t colorFamily;
+    int32_t sampleType;
+    int32_t bitsPerSample;
+    int32_t bytesPerSample;
+    int32_t numPlanes;
+    int32_t width[3];
+    int32_t height[3];
+    int64_t offset[3];
+} FrameWriterHeader;
+
+class FrameWriter
+{
+public:
+    // direct_io opens files with O_DIRECT where available, bypassing the page cache
+    FrameWriter(const VSAPI *vsapi, int num_threads, int max_queued, bool direct_io);
+    // writes everything still queued before returning
+    ~FrameWriter();
+
+    // takes over the frame reference, blocks while max_queued frames are waiting
+    void push(const VSFrameRef *frame, const std::string &path);
+
+    // set once any write failed, the failure itself is logged
+    bool failed() const { return _failed; }
+
+private:
+    struct Job {
+        const VSFrameRef *frame;
+        std::string path;
+    };
+
+    void worker();
+    bool write(const VSFrameRef *frame, const std::string &path) const;
+
+    const VSAPI *_vsapi;
+    size_t _max_queued;
+    bool _direct_io;
+
+    std::mutex _lock;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+    std::deque<Job> _queue;
+    bool _stop;
+    std::atomic<bool> _failed;
+    std::vector<std::thread> _threads;
+};
+
+#endif // FRAME_WRITER_HPP
@@ -0,0 +1,153 @@
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef VSNVK_EMBED_MODELS
+#include <cmrc/cmrc.hpp>
+CMRC_DECLARE(vsnvk_models);
+#endif
+
+#include "model-file.hpp"
+
+// ncnn
+#include "datareader.h"
+
+#ifdef VSNVK_EMBED_MODELS
+// resources are named by their path below ncnn-models, wherever the caller thinks that directory is
+static bool findEmbedded(const std::string& path, cmrc::file& file)
+{
+    const size_t pos = path.rfind("ncnn-models/");
+    const std::string name = pos == std::string::npos ? path : path.substr(pos + 12);
+
+    const cmrc::embedded_filesystem fs = cmrc::vsnvk_models::get_filesystem();
+    if (!fs.is_file(name))
+        return false;
+
+    file = fs.open(name);
+    return true;
+}
+#endif
+
+ModelFile::ModelFile() : _data(nullptr), _size(0), _map(nullptr)
+{
+}
+
+ModelFile::~ModelFile()
+{
+    close();
+}
+
+int ModelFile::open(const std::string& path)
+{
+    close();
+
+#ifdef VSNVK_EMBED_MODELS
+    cmrc::file file;
+    if (findEmbedded(path, file))
+    {
+        _data = reinterpret_cast<const unsigned char*>(file.begin());
+        _size = file.size();
+        return 0;
+    }
+#endif
+
+#ifdef _WIN32
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return -1;
+
+    fseek(fp, 0, SEEK_END);
+    _buffer.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    const size_t nread = fread(_buffer.data(), 1, _buffer.size(), fp);
+    fclose(fp);
+    if (nread != _buffer.size())
+    {
+        _buffer.clear();
+        return -1;
+    }
+
+    _data = _buffer.data();
+    _size = _buffer.size();
+    return 0;
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    _map = map;
+    _data = static_cast<const unsigned char*>(map);
+    _size = st.st_size;
+    return 0;
+#endif
+}
+
+void ModelFile::close()
+{
+#ifndef _WIN32
+    if (_map)
+        munmap(_map, _size);
+#endif
+    _buffer.clear();
+    _data = nullptr;
+    _size = 0;
+    _map = nullptr;
+}
+
+bool modelFileExists(const std::string& path)
+{
+#ifdef VSNVK_EMBED_MODELS
+    cmrc::file file;
+    if (findEmbedded(path, file))
+        return true;
+#endif
+
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+
+    fclose(fp);
+    return true;
+}
+
+int loadNet(ncnn::Net& net, const std::string& parampath, const std::string& modelpath, ModelFile& weights)
+{
+    // the text parser needs a terminated string, params are small enough to copy
+    std::string param;
+    {
+        ModelFile file;
+        if (file.open(parampath))
+            return -1;
+
+        param.assign(reinterpret_cast<const char*>(file.data()), file.size());
+    }
+
+    if (net.load_param_mem(param.c_str()))
+        return -1;
+
+    if (weights.open(modelpath))
+        return -1;
+
+    // fp32 weights are referenced in place instead of copied
+    const unsigned char* mem = weights.data();
+    const ncnn::DataReaderFromMemory dr(mem);
+    return net.load_model(dr);
+}
@@ -0,0 +1,41 @@
+#ifndef MODEL_FILE_HPP
+#define MODEL_FILE_HPP
+
+#include <string>
+#include <vector>
+
+// ncnn
+#include "net.h"
+
+// contents of a .param or .bin file, read-only
+// files embedded at build time (EMBED_MODELS) are found by their path below ncnn-models and used in place,
+// anything else is mapped from disk so the weights are never copied through a read buffer
+class ModelFile
+{
+public:
+    ModelFile();
+    ~ModelFile();
+
+    ModelFile(const ModelFile&) = delete;
+    ModelFile& operator=(const ModelFile&) = delete;
+
+    int open(const std::string& path);
+    void close();
+
+    const unsigned char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    const unsigned char* _data;
+    size_t _size;
+    void* _map;
+    std::vector<unsigned char> _buffer;
+};
+
+// embedded or readable on disk
+bool modelFileExists(const std::string& path);
+
+// load the net from parampath and modelpath, the weights may point into weights, which must outlive the net
+int loadNet(ncnn::Net& net, const std::string& parampath, const std::string& modelpath, ModelFile& weights);
+
+#endif
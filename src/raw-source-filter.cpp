@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <vapoursynth/VSHelper.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "filter-common.hpp"
+#include "frame-writer.hpp"
+#include "raw-source-filter.hpp"
+
+typedef struct {
+    std::string dir;
+    std::string prefix;
+    std::string suffix;
+    int readahead;
+    FrameWriterHeader header;
+    int64_t fileSize;
+    VSVideoInfo vi;
+} RawSourceFilterData;
+
+static std::string rawFramePath(const RawSourceFilterData *d, int n) {
+    char number[16];
+    snprintf(number, sizeof(number), "%06d", n);
+    return d->dir + "/" + d->prefix + number + d->suffix;
+}
+
+static bool readHeader(const std::string &path, FrameWriterHeader &header, int64_t &fileSize) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, FRAME_WRITER_MAGIC, sizeof(header.magic)) == 0;
+    fseek(fp, 0, SEEK_END);
+    fileSize = ftell(fp);
+    fclose(fp);
+    return ok;
+}
+
+// copy the planes of a mapped or loaded file into dst, rows are packed in the file
+static void copyPlanes(const uint8_t *file, const FrameWriterHeader &header, VSFrameRef *dst, const VSAPI *vsapi) {
+    for (int plane = 0; plane < header.numPlanes; plane++) {
+        const int rowSize = header.width[plane] * header.bytesPerSample;
+        vs_bitblt(vsapi->getWritePtr(dst, plane), vsapi->getStride(dst, plane), file + header.offset[plane], rowSize, rowSize, header.height[plane]);
+    }
+}
+
+static void VS_CC RawSourceFilterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<RawSourceFilterData *>(*instanceData);
+    vsapi->setVideoInfo(&d->vi, 1, node);
+}
+
+static const VSFrameRef *VS_CC RawSourceFilterGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<RawSourceFilterData *>(*instanceData);
+
+    if (activationReason != arInitial)
+        return nullptr;
+
+    const std::string path = rawFramePath(d, n);
+    VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, nullptr, core);
+    bool ok = false;
+
+#ifdef _WIN32
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp) {
+        std::vector<uint8_t> file(d->fileSize);
+        if (fread(file.data(), 1, file.size(), fp) == file.size() && memcmp(file.data(), &d->header, sizeof(d->header)) == 0) {
+            copyPlanes(file.data(), d->header, dst, vsapi);
+            ok = true;
+        }
+        fclose(fp);
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == d->fileSize) {
+            void *map = mmap(nullptr, d->fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, d->fileSize, MADV_SEQUENTIAL);
+                madvise(map, d->fileSize, MADV_WILLNEED);
+                // every frame is written by the same ExportFrame, so the header must match byte for byte
+                if (memcmp(map, &d->header, sizeof(d->header)) == 0) {
+                    copyPlanes(static_cast<const uint8_t *>(map), d->header, dst, vsapi);
+                    ok = true;
+                }
+                munmap(map, d->fileSize);
+            }
+        }
+        close(fd);
+    }
+
+    // start reading the following frames into the page cache while this one is being processed
+    for (int i = 1; i <= d->readahead && n + i < d->vi.numFrames; i++) {
+        int next = open(rawFramePath(d, n + i).c_str(), O_RDONLY);
+        if (next < 0)
+            break;
+        posix_fadvise(next, 0, 0, POSIX_FADV_WILLNEED);
+        close(next);
+    }
+#endif
+
+    if (!ok) {
+        vsapi->freeFrame(dst);
+        vsapi->setFilterError(("Raw-Source-Filter: can't read " + path).c_str(), frameCtx);
+        return nullptr;
+    }
+
+    return dst;
+}
+
+static void VS_CC RawSourceFilterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<RawSourceFilterData *>(instanceData);
+    delete d;
+}
+
+void VS_CC RawSourceFilterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    RawSourceFilterData d{};
+
+    char const * err_prompt = nullptr;
+    do {
+        int err;
+
+        const char *dir = vsapi->propGetData(in, "dir", 0, &err);
+        if (err) {
+            err_prompt = "'dir' must be set";
+            break;
+        }
+        d.dir = dir;
+
+        const char *prefix = vsapi->propGetData(in, "prefix", 0, &err);
+        d.prefix = err ? "" : prefix;
+
+        const char *suffix = vsapi->propGetData(in, "suffix", 0, &err);
+        d.suffix = err ? ".raw" : suffix;
+
+        d.readahead = int64ToIntS(vsapi->propGetInt(in, "readahead", 0, &err));
+        if (err)
+            d.readahead = 2;
+        if (d.readahead < 0) {
+            err_prompt = "'readahead' must be greater than or equal to 0";
+            break;
+        }
+
+        if (!readHeader(rawFramePath(&d, 0), d.header, d.fileSize)) {
+            err_prompt = "can't read the first frame";
+            break;
+        }
+        if (d.header.version != 1 || d.header.numPlanes < 1 || d.header.numPlanes > 3) {
+            err_prompt = "unsupported file version";
+            break;
+        }
+
+        int64_t expected = 0;
+        for (int plane = 0; plane < d.header.numPlanes; plane++)
+            expected = std::max(expected, d.header.offset[plane] + int64_t(d.header.width[plane]) * d.header.height[plane] * d.header.bytesPerSample);
+        if (d.fileSize < expected) {
+            err_prompt = "the first frame is truncated";
+            break;
+        }
+
+        int ssw = 0, ssh = 0;
+        if (d.header.numPlanes > 1) {
+            while ((d.header.width[0] >> ssw) > d.header.width[1])
+                ssw++;
+            while ((d.header.height[0] >> ssh) > d.header.height[1])
+                ssh++;
+        }
+
+        d.vi.format = vsapi->registerFormat(d.header.colorFamily, d.header.sampleType, d.header.bitsPerSample, ssw, ssh, core);
+        if (!d.vi.format) {
+            err_prompt = "unsupported format in the first frame";
+            break;
+        }
+        d.vi.width = d.header.width[0];
+        d.vi.height = d.header.height[0];
+
+        d.vi.fpsNum = vsapi->propGetInt(in, "fpsnum", 0, &err);
+        if (err)
+            d.vi.fpsNum = 24;
+        d.vi.fpsDen = vsapi->propGetInt(in, "fpsden", 0, &err);
+        if (err)
+            d.vi.fpsDen = 1;
+        if (d.vi.fpsNum < 1 || d.vi.fpsDen < 1) {
+            err_prompt = "'fpsnum' and 'fpsden' must be greater than or equal to 1";
+            break;
+        }
+        muldivRational(&d.vi.fpsNum, &d.vi.fpsDen, 1, 1);
+
+        // the clip ends at the first missing frame number
+        d.vi.numFrames = int64ToIntS(vsapi->propGetInt(in, "length", 0, &err));
+        if (err) {
+            FrameWriterHeader header;
+            int64_t fileSize;
+            d.vi.numFrames = 1;
+            while (readHeader(rawFramePath(&d, d.vi.numFrames), header, fileSize))
+                d.vi.numFrames++;
+        }
+        if (d.vi.numFrames < 1) {
+            err_prompt = "'length' must be greater than or equal to 1";
+            break;
+        }
+    } while (false);
+
+    if (err_prompt) {
+        vsapi->setError(out, (std::string{"Raw-Source-Filter: "} + err_prompt).c_str());
+        return;
+    }
+
+    auto *data = new RawSourceFilterData{ d };
+
+    vsapi->createFilter(in, out, "RawSource", RawSourceFilterInit, RawSourceFilterGetFrame, RawSourceFilterFree, fmParallel, 0, data, core);
+}
@@ -0,0 +1,3 @@
+#include <vapoursynth/VSHelper.h>
+
+void VS_CC RawSourceFilterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi);
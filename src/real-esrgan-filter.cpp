@@ -1,204 +1,477 @@
-/*
-  MIT License
-
-  Copyright (c) 2018-2019 HolyWu
-  Copyright (c) 2019-2020 NaLan ZeYu
-
-  Permission is hereby granted, free of charge, to any person obtaining a copy
-  of this software and associated documentation files (the "Software"), to deal
-  in the Software without restriction, including without limitation the rights
-  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
-  copies of the Software, and to permit persons to whom the Software is
-  furnished to do so, subject to the following conditions:
-
-  The above copyright notice and this permission notice shall be included in all
-  copies or substantial portions of the Software.
-
-  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-  SOFTWARE.
-*/
-
-#include <fstream>
-#include <algorithm>
-
-#include "filter-common.hpp"
-#include "real-esrgan-filter.hpp"
-#include "gpu.h"
-#include "real-esrgan.hpp"
-#include "vsplugin.hpp"
-
-typedef struct {
-    VSNodeRef *node;
-    VSVideoInfo vi;
-    RealESRGAN *real_esrgan;
-} RealESRGANFilterData;
-
-static int RealESRGANFilter(const VSFrameRef *src, VSFrameRef *dst, RealESRGANFilterData * const VS_RESTRICT d, const VSAPI *vsapi) noexcept {
-    const int width = vsapi->getFrameWidth(src, 0);
-    const int height = vsapi->getFrameHeight(src, 0);
-    const int srcStride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
-    const int dstStride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
-    auto *             srcR = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0));
-    auto *             srcG = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1));
-    auto *             srcB = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2));
-    auto * VS_RESTRICT dstR = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0));
-    auto * VS_RESTRICT dstG = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1));
-    auto * VS_RESTRICT dstB = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2));
-    return d->real_esrgan->process(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride);
-}
-
-static void VS_CC RealESRGANFilterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
-    auto *d = static_cast<RealESRGANFilterData *>(*instanceData);
-    vsapi->setVideoInfo(&d->vi, 1, node);
-}
-
-static const VSFrameRef *VS_CC RealESRGANFilterGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    auto *d = static_cast<RealESRGANFilterData *>(*instanceData);
-
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
-        int err = RealESRGANFilter(src, dst, d, vsapi);
-        if (err) {
-            vsapi->setFilterError("RealESRGAN-NCNN-Vulkan: RealESRGAN filter error.", frameCtx);
-        } else {
-            return dst;
-        }
-    }
-    return nullptr;
-}
-
-static void VS_CC RealESRGANFilterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    auto *d = static_cast<RealESRGANFilterData *>(instanceData);
-    vsapi->freeNode(d->node);
-    delete d->real_esrgan;
-    delete d;
-    tryDestoryGpuInstance();
-}
-
-void VS_CC RealESRGANFilterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
-    RealESRGANFilterData d{};
-    d.node = vsapi->propGetNode(in, "clip", 0, nullptr);
-    d.vi = *vsapi->getVideoInfo(d.node);
-
-    int gpuId, ttaMode, scale, tileSize, gpuThread;
-    std::string modelName, paramPath, modelPath;
-    char const * err_prompt = nullptr;
-    do {
-        int err;
-
-        err = tryCreateGpuInstance();
-        if (err) {
-            err_prompt = "create gpu instance failed";
-            break;
-        }
-
-        if (!isConstantFormat(&d.vi) || d.vi.format->colorFamily != cmRGB || d.vi.format->sampleType != stFloat || d.vi.format->bitsPerSample != 32) {
-            err_prompt = "only constant RGB format and 32 bit float input supported";
-            break;
-        }
-
-        gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", 0, &err));
-        if (gpuId < 0 || gpuId >= ncnn::get_gpu_count()) {
-            err_prompt = "invalid 'gpu_id'";
-            break;
-        }
-
-        ttaMode = int64ToIntS(vsapi->propGetInt(in, "tta_mode", 0, &err));
-        if (ttaMode < 0 || ttaMode > 1) {
-            err_prompt = "'tta_mode' must be 0 or 1";
-            break;
-        }
-
-        scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
-        if (err)
-            scale = 4;
-        if (scale != 4) {
-            err_prompt = "'scale' must be 4";
-            break;
-        }
-
-        modelName = std::string(vsapi->propGetData(in, "model", 0, &err));
-        if (err)
-            modelName = "realesrgan-x4plus";
-
-        int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
-        if (customGpuThread > 0) {
-            gpuThread = customGpuThread;
-        }
-        else {
-            gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
-        }
-        gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
-
-        tileSize = int64ToIntS(vsapi->propGetInt(in, "tile_size", 0, &err));
-        if (err || tileSize == 0) {
-            double heap_budget = ncnn::get_gpu_device(gpuId)->get_heap_budget(); // in MByte
-            if (heap_budget > 1900)
-                tileSize = 200;
-            else if (heap_budget > 550)
-                tileSize = 100;
-            else if (heap_budget > 190)
-                tileSize = 64;
-            else
-                tileSize = 32;
-        }
-        if (tileSize < 32) {
-            err_prompt = "'tile_size' must be greater than or equal to 32";
-            break;
-        }
-        if (tileSize % 4) {
-            err_prompt = "'tile_size' must be multiple of 4";
-            break;
-        }
-
-        // set model path
-        const std::string pluginFilePath{ vsapi->getPluginPath(vsapi->getPluginById(VSPLUGIN_IDENTIFIER_STR, core)) };
-        const std::string pluginDir = pluginFilePath.substr(0, pluginFilePath.find_last_of('/'));
-
-        std::string modelsDir = pluginDir + "/ncnn-models/Real-ESRGAN/";
-
-        paramPath = modelsDir + modelName + ".param";
-        modelPath = modelsDir + modelName + ".bin";
-
-        // check model file readable
-        std::ifstream pf(paramPath);
-        std::ifstream mf(modelPath);
-        if (!pf.good() || !mf.good()) {
-            err_prompt = "can't open model file";
-            break;
-        }
-
-        break;
-    } while (false);
-
-    if (err_prompt) {
-        vsapi->setError(out, (std::string{"RealESRGAN-NCNN-Vulkan: "} + err_prompt).c_str());
-        vsapi->freeNode(d.node);
-        tryDestoryGpuInstance();
-        return;
-    }
-
-    int prepadding = 10;
-
-    d.real_esrgan = new RealESRGAN(gpuId, gpuThread, ttaMode);
-    d.real_esrgan->scale = scale;
-    d.real_esrgan->tilesize = tileSize;
-    d.real_esrgan->prepadding = prepadding;
-
-    d.real_esrgan->load(paramPath, modelPath);
-
-    d.vi.width *= scale;
-    d.vi.height *= scale;
-
-    auto *data = new RealESRGANFilterData{ d };
-
-    vsapi->createFilter(in, out, "RealESRGAN", RealESRGANFilterInit, RealESRGANFilterGetFrame, RealESRGANFilterFree, fmParallel, 0, data, core);
-}
+/*
+  MIT License
+
+  Copyright (c) 2018-2019 HolyWu
+  Copyright (c) 2019-2020 NaLan ZeYu
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+
+#include "autotune.hpp"
+#include "filter-common.hpp"
+#include "model-file.hpp"
+#include "frame-cache.hpp"
+#include "remote-client.hpp"
+#include "real-esrgan-filter.hpp"
+#include "gpu.h"
+#include "real-esrgan.hpp"
+#include "vsplugin.hpp"
+
+typedef struct {
+    VSNodeRef *node;
+    VSNodeRef *mask;
+    VSNodeRef *alpha;
+    VSVideoInfo vi;
+    RealESRGAN *real_esrgan;
+    std::shared_future<int> loaded; // load and autotune run in the background from create
+    std::vector<float> roiWeight;
+    int feather;
+    FrameCache *cache;
+    RemoteClient *remote; // set when frames go to a vsnvk-server
+    RemoteSpec remoteSpec;
+    Lookahead lookahead;
+    FrameBatch batch;
+    bool autotune;
+    std::string autotuneCache;
+} RealESRGANFilterData;
+
+static int RealESRGANFilter(const VSFrameRef *src, VSFrameRef *dst, const VSFrameRef *srcAlpha, VSFrameRef *dstAlpha, const float *weight, RealESRGANFilterData * const VS_RESTRICT d, const VSAPI *vsapi) noexcept {
+    const int width = vsapi->getFrameWidth(src, 0);
+    const int height = vsapi->getFrameHeight(src, 0);
+    const int srcStride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
+    const int dstStride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
+    auto *             srcR = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0));
+    auto *             srcG = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1));
+    auto *             srcB = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2));
+    auto * VS_RESTRICT dstR = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0));
+    auto * VS_RESTRICT dstG = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1));
+    auto * VS_RESTRICT dstB = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2));
+    auto *             srcA = srcAlpha ? reinterpret_cast<const float *>(vsapi->getReadPtr(srcAlpha, 0)) : nullptr;
+    auto * VS_RESTRICT dstA = dstAlpha ? reinterpret_cast<float *>(vsapi->getWritePtr(dstAlpha, 0)) : nullptr;
+    if (d->loaded.get())
+        return -1;
+    const int reductions = d->real_esrgan->tile_reductions();
+    const int ret = d->real_esrgan->process(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride, weight, width, srcA, dstA);
+    logTileReduction("RealESRGAN-NCNN-Vulkan", reductions, d->real_esrgan->tile_reductions(), d->real_esrgan->current_tilesize(), d->real_esrgan->current_tilesize(), vsapi);
+    return ret;
+}
+
+// upscale a group of frames as one mosaic, see FrameBatch
+static const char *RealESRGANBatch(const std::vector<const VSFrameRef *> &srcs, std::vector<VSFrameRef *> &dsts, RealESRGANFilterData * const VS_RESTRICT d, VSCore *core, const VSAPI *vsapi) {
+    if (d->loaded.get())
+        return "RealESRGAN filter error";
+
+    const int gutter = d->real_esrgan->prepadding;
+    const int scale = d->real_esrgan->scale;
+    std::vector<float> in, out;
+    const int width = packMosaic(srcs, gutter, true, in, vsapi);
+    const int height = vsapi->getFrameHeight(srcs[0], 0);
+    const size_t inPlane = static_cast<size_t>(width) * height;
+    const size_t outPlane = inPlane * scale * scale;
+    out.resize(outPlane * 3);
+
+    const int reductions = d->real_esrgan->tile_reductions();
+    const int ret = d->real_esrgan->process(in.data(), in.data() + inPlane, in.data() + inPlane * 2, out.data(), out.data() + outPlane, out.data() + outPlane * 2, width, height, width, width * scale);
+    logTileReduction("RealESRGAN-NCNN-Vulkan", reductions, d->real_esrgan->tile_reductions(), d->real_esrgan->current_tilesize(), d->real_esrgan->current_tilesize(), vsapi);
+    if (ret)
+        return "RealESRGAN filter error";
+
+    for (auto src : srcs) {
+        VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
+        // batches don't take alpha, an attached one no longer matches the frame size
+        vsapi->propDeleteKey(vsapi->getFramePropsRW(dst), "_Alpha");
+        dsts.push_back(dst);
+    }
+    unpackMosaic(out.data(), width, height, gutter, scale, dsts, vsapi);
+    return nullptr;
+}
+
+static void VS_CC RealESRGANFilterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<RealESRGANFilterData *>(*instanceData);
+    vsapi->setVideoInfo(&d->vi, 1, node);
+}
+
+static const VSFrameRef *VS_CC RealESRGANFilterGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<RealESRGANFilterData *>(*instanceData);
+
+    const VSFrameRef *src = nullptr;
+    if (activationReason == arInitial) {
+        d->lookahead.prefetch(n, d->node, d->vi.numFrames, vsapi);
+        // a frame the lookahead already fetched isn't requested again, with no other clip to wait for it runs right away
+        if (d->batch.frames == 1)
+            src = d->lookahead.take(n);
+        if (!src || d->mask || d->alpha) {
+            *frameData = const_cast<VSFrameRef *>(src);
+            if (!src)
+                vsapi->requestFrameFilter(n, d->node, frameCtx);
+            if (d->batch.frames > 1)
+                d->batch.request(n, d->node, d->vi.numFrames, frameCtx, vsapi);
+            if (d->mask)
+                vsapi->requestFrameFilter(n, d->mask, frameCtx);
+            if (d->alpha)
+                vsapi->requestFrameFilter(n, d->alpha, frameCtx);
+            return nullptr;
+        }
+    } else if (activationReason == arAllFramesReady) {
+        if (d->batch.frames > 1) {
+            std::string batchError;
+            const VSFrameRef *dst = d->batch.get(n, d->node, d->vi.numFrames, frameCtx, vsapi, [&](const std::vector<const VSFrameRef *> &srcs, std::vector<VSFrameRef *> &dsts) {
+                return RealESRGANBatch(srcs, dsts, d, core, vsapi);
+            }, batchError);
+            if (!dst)
+                vsapi->setFilterError(("RealESRGAN-NCNN-Vulkan: " + batchError + ".").c_str(), frameCtx);
+            return dst;
+        }
+
+        src = *frameData ? static_cast<const VSFrameRef *>(*frameData) : vsapi->getFrameFilter(n, d->node, frameCtx);
+    } else {
+        if (activationReason == arError)
+            vsapi->freeFrame(static_cast<const VSFrameRef *>(*frameData));
+        return nullptr;
+    }
+
+    const VSFrameRef *srcAlpha = nullptr;
+    const char *alphaError = d->remote ? nullptr : getAlphaFrame(n, d->alpha, src, &srcAlpha, frameCtx, vsapi);
+
+    const VSFrameRef *mask = d->mask ? vsapi->getFrameFilter(n, d->mask, frameCtx) : nullptr;
+    VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
+    VSFrameRef *dstAlpha = srcAlpha && !alphaError ? vsapi->newVideoFrame(vsapi->getFrameFormat(srcAlpha), d->vi.width, d->vi.height, srcAlpha, core) : nullptr;
+
+    // the cache holds rgb only, frames with alpha always run
+    const bool useCache = d->cache && !srcAlpha;
+    uint64_t cacheKey = 0;
+    std::string remoteError;
+    int err = 0;
+    if (useCache) {
+        cacheKey = hashFrame(src, vsapi);
+        if (mask)
+            cacheKey = hashFrame(mask, vsapi, cacheKey);
+    }
+
+    if (alphaError) {
+        err = 1;
+    } else if (!useCache || !d->cache->read(cacheKey, dst, vsapi)) {
+        std::vector<float> maskWeight;
+        const float *weight = d->roiWeight.empty() ? nullptr : d->roiWeight.data();
+        if (mask) {
+            maskWeight.resize(static_cast<size_t>(vsapi->getFrameWidth(src, 0)) * vsapi->getFrameHeight(src, 0));
+            makeMaskWeight(maskWeight.data(), mask, d->feather, vsapi);
+            weight = maskWeight.data();
+        }
+
+        if (d->remote) {
+            // servers don't take alpha, an attached one no longer matches the frame size
+            vsapi->propDeleteKey(vsapi->getFramePropsRW(dst), "_Alpha");
+
+            const int srcStride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
+            const int dstStride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
+            err = d->remote->process(d->remoteSpec,
+                reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0)), reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1)), reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2)),
+                reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0)), reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1)), reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2)),
+                srcStride, dstStride, remoteError);
+        } else {
+            err = RealESRGANFilter(src, dst, srcAlpha, dstAlpha, weight, d, vsapi);
+        }
+        if (!err && dstAlpha)
+            vsapi->propSetFrame(vsapi->getFramePropsRW(dst), "_Alpha", dstAlpha, paReplace);
+        else if (!err && d->cache)
+            d->cache->write(cacheKey, dst, vsapi);
+    }
+
+    vsapi->freeFrame(mask);
+    vsapi->freeFrame(dstAlpha);
+    vsapi->freeFrame(srcAlpha);
+    vsapi->freeFrame(src);
+    if (err) {
+        vsapi->freeFrame(dst);
+        if (alphaError)
+            vsapi->setFilterError((std::string{"RealESRGAN-NCNN-Vulkan: "} + alphaError + ".").c_str(), frameCtx);
+        else if (!remoteError.empty())
+            vsapi->setFilterError(("RealESRGAN-NCNN-Vulkan: " + remoteError + ".").c_str(), frameCtx);
+        else
+            vsapi->setFilterError("RealESRGAN-NCNN-Vulkan: RealESRGAN filter error.", frameCtx);
+    } else {
+        return dst;
+    }
+    return nullptr;
+}
+
+static void VS_CC RealESRGANFilterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<RealESRGANFilterData *>(instanceData);
+    vsapi->freeNode(d->node);
+    vsapi->freeNode(d->mask);
+    vsapi->freeNode(d->alpha);
+    if (d->loaded.valid())
+        d->loaded.wait();
+    delete d->real_esrgan;
+    delete d->cache;
+    bool remote = d->remote != nullptr;
+    delete d->remote;
+    delete d;
+    if (!remote)
+        tryDestoryGpuInstance();
+}
+
+void VS_CC RealESRGANFilterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    RealESRGANFilterData d{};
+    d.node = vsapi->propGetNode(in, "clip", 0, nullptr);
+    d.vi = *vsapi->getVideoInfo(d.node);
+
+    int gpuId, ttaMode, scale, tileSize, gpuThread, precision, arithmetic;
+    std::string modelName, paramPath, modelPath;
+    char const * err_prompt = nullptr;
+    int err;
+    const std::vector<std::string> servers = getServerArgs(in, vsapi);
+    const bool remote = !servers.empty();
+    do {
+        // with a server this process never touches the device
+        if (!remote) {
+            err = tryCreateGpuInstance();
+            if (err) {
+                err_prompt = "create gpu instance failed";
+                break;
+            }
+        }
+
+        if (!isConstantFormat(&d.vi) || d.vi.format->colorFamily != cmRGB || d.vi.format->sampleType != stFloat || d.vi.format->bitsPerSample != 32) {
+            err_prompt = "only constant RGB format and 32 bit float input supported";
+            break;
+        }
+
+        gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", 0, &err));
+        if (gpuId < 0 || (!remote && gpuId >= ncnn::get_gpu_count())) {
+            err_prompt = "invalid 'gpu_id'";
+            break;
+        }
+
+        ttaMode = int64ToIntS(vsapi->propGetInt(in, "tta_mode", 0, &err));
+        if (ttaMode != 0 && ttaMode != 1 && ttaMode != 2 && ttaMode != 4 && ttaMode != 8) {
+            err_prompt = "'tta_mode' must be 0, 1, 2, 4 or 8";
+            break;
+        }
+
+        scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
+        if (err)
+            scale = 4;
+        if (scale != 4) {
+            err_prompt = "'scale' must be 4";
+            break;
+        }
+
+        modelName = std::string(vsapi->propGetData(in, "model", 0, &err));
+        if (err)
+            modelName = "realesrgan-x4plus";
+
+        precision = int64ToIntS(vsapi->propGetInt(in, "precision", 0, &err));
+        if (err)
+            precision = 16;
+        if (precision != 0 && precision != 8 && precision != 16 && precision != 32) {
+            err_prompt = "'precision' must be 0, 8, 16 or 32";
+            break;
+        }
+        // precision=8 uses the copy written by vsnvk-int8 next to the float model
+        if (precision == 8)
+            modelName += "-int8";
+
+        arithmetic = int64ToIntS(vsapi->propGetInt(in, "arithmetic", 0, &err));
+        if (err)
+            arithmetic = precision == 0 ? 0 : 32;
+        if (arithmetic != 0 && arithmetic != 16 && arithmetic != 32) {
+            err_prompt = "'arithmetic' must be 0, 16 or 32";
+            break;
+        }
+
+        int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
+        if (remote) {
+            // frames in flight to each server
+            gpuThread = customGpuThread > 0 ? customGpuThread : 2;
+        }
+        else {
+            if (customGpuThread > 0) {
+                gpuThread = customGpuThread;
+            }
+            else {
+                gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
+            }
+            gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
+        }
+
+        tileSize = int64ToIntS(vsapi->propGetInt(in, "tile_size", 0, &err));
+        // with a server, 0 leaves the choice to the server
+        if (!remote && (err || tileSize == 0)) {
+            double heap_budget = ncnn::get_gpu_device(gpuId)->get_heap_budget(); // in MByte
+            if (heap_budget > 1900)
+                tileSize = 200;
+            else if (heap_budget > 550)
+                tileSize = 100;
+            else if (heap_budget > 190)
+                tileSize = 64;
+            else
+                tileSize = 32;
+        }
+        if (tileSize != 0 && tileSize < 32) {
+            err_prompt = "'tile_size' must be greater than or equal to 32";
+            break;
+        }
+        if (tileSize % 4) {
+            err_prompt = "'tile_size' must be multiple of 4";
+            break;
+        }
+
+        err_prompt = getRoiMaskArgs(in, &d.vi, &d.mask, d.roiWeight, d.feather, vsapi);
+        if (err_prompt)
+            break;
+
+        err_prompt = getAlphaArg(in, &d.vi, &d.alpha, vsapi);
+        if (err_prompt)
+            break;
+
+        d.lookahead.frames = int64ToIntS(vsapi->propGetInt(in, "lookahead", 0, &err));
+        if (d.lookahead.frames < 0) {
+            err_prompt = "'lookahead' must be greater than or equal to 0";
+            break;
+        }
+
+        d.batch.frames = int64ToIntS(vsapi->propGetInt(in, "batch", 0, &err));
+        if (err)
+            d.batch.frames = 1;
+        if (d.batch.frames < 1) {
+            err_prompt = "'batch' must be greater than or equal to 1";
+            break;
+        }
+        d.batch.maxGroups = vsapi->getCoreInfo(core)->numThreads;
+
+        d.autotune = !!vsapi->propGetInt(in, "autotune", 0, &err);
+        if (d.autotune)
+            d.autotuneCache = autotuneCachePath();
+
+        const char *cacheDir = vsapi->propGetData(in, "cache_dir", 0, &err);
+        if (!err) {
+            // everything that changes the output goes into the cache file name
+            const int params[8] = { d.vi.width, d.vi.height, scale, ttaMode, precision, arithmetic, d.feather, d.mask != nullptr };
+            uint64_t name = hashBytes(params, sizeof(params));
+            name = hashBytes(modelName.data(), modelName.size(), name);
+            if (!d.roiWeight.empty())
+                name = hashBytes(d.roiWeight.data(), d.roiWeight.size() * sizeof(float), name);
+
+            char cacheName[32];
+            snprintf(cacheName, sizeof(cacheName), "realesrgan-%016llx", static_cast<unsigned long long>(name));
+
+            d.cache = new FrameCache;
+            if (d.cache->open(cacheDir, cacheName, int64_t(d.vi.width) * scale * d.vi.height * scale * 3 * sizeof(float))) {
+                err_prompt = "can't open cache in 'cache_dir'";
+                break;
+            }
+        }
+
+        // every frame of a batch gets the same treatment as a whole mosaic
+        if (d.batch.frames > 1 && (remote || d.mask || !d.roiWeight.empty() || d.alpha || d.cache)) {
+            err_prompt = "'batch' can't be used with 'roi', 'mask', 'alpha', 'cache_dir' or 'server'";
+            break;
+        }
+
+        // the int8 net runs on the cpu, which has neither the augmentation nor the roi shaders
+        if (precision == 8 && (remote || ttaMode != 0 || d.mask || !d.roiWeight.empty())) {
+            err_prompt = "'precision=8' runs on the CPU and can't be used with 'tta_mode', 'roi', 'mask' or 'server'";
+            break;
+        }
+
+        if (remote) {
+            if (d.mask || !d.roiWeight.empty()) {
+                err_prompt = "'roi' and 'mask' can't be used with 'server'";
+                break;
+            }
+            if (d.alpha) {
+                err_prompt = "'alpha' can't be used with 'server'";
+                break;
+            }
+            d.remote = new RemoteClient(servers, d.vi.width, d.vi.height, scale, gpuThread);
+            d.remoteSpec.engine = REMOTE_ENGINE_REALESRGAN;
+            d.remoteSpec.gpu_id = gpuId;
+            d.remoteSpec.tta_mode = ttaMode;
+            d.remoteSpec.scale = scale;
+            d.remoteSpec.tile_w = d.remoteSpec.tile_h = tileSize;
+            d.remoteSpec.prepadding = 10;
+            d.remoteSpec.precision = precision;
+            d.remoteSpec.arithmetic = arithmetic;
+            strncpy(d.remoteSpec.model, ("Real-ESRGAN/" + modelName).c_str(), sizeof(d.remoteSpec.model) - 1);
+            break;
+        }
+
+        // set model path
+        const std::string pluginFilePath{ vsapi->getPluginPath(vsapi->getPluginById(VSPLUGIN_IDENTIFIER_STR, core)) };
+        const std::string pluginDir = pluginFilePath.substr(0, pluginFilePath.find_last_of('/'));
+
+        std::string modelsDir = pluginDir + "/ncnn-models/Real-ESRGAN/";
+
+        paramPath = modelsDir + modelName + ".param";
+        modelPath = modelsDir + modelName + ".bin";
+
+        // check model file readable
+        if (!modelFileExists(paramPath) || !modelFileExists(modelPath)) {
+            err_prompt = "can't open model file";
+            break;
+        }
+
+        break;
+    } while (false);
+
+    if (err_prompt) {
+        vsapi->setError(out, (std::string{"RealESRGAN-NCNN-Vulkan: "} + err_prompt).c_str());
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.mask);
+        vsapi->freeNode(d.alpha);
+        delete d.cache;
+        delete d.remote;
+        if (!remote)
+            tryDestoryGpuInstance();
+        return;
+    }
+
+    int prepadding = 10;
+
+    if (!remote) {
+        d.real_esrgan = new RealESRGAN(gpuId, gpuThread, ttaMode, precision, arithmetic);
+        d.real_esrgan->scale = scale;
+        d.real_esrgan->tilesize = tileSize;
+        d.real_esrgan->prepadding = prepadding;
+        d.real_esrgan->strip_workers = stripWorkers(gpuId, gpuThread);
+
+        RealESRGAN *real_esrgan = d.real_esrgan;
+        const bool autotune = d.autotune;
+        const std::string autotuneCache = d.autotuneCache;
+        d.loaded = loadInBackground([=]() {
+            int ret = real_esrgan->load(paramPath, modelPath);
+            if (!ret && autotune)
+                ret = real_esrgan->autotune(paramPath, modelPath, autotuneCache);
+            return ret;
+        });
+    }
+
+    d.vi.width *= scale;
+    d.vi.height *= scale;
+
+    auto *data = new RealESRGANFilterData{ d };
+
+    vsapi->createFilter(in, out, "RealESRGAN", RealESRGANFilterInit, RealESRGANFilterGetFrame, RealESRGANFilterFree, fmParallel, 0, data, core);
+}
@@ -2,6 +2,8 @@
 #include <algorithm>
 
 #include "real-esrgan.hpp"
+#include "autotune.hpp"
+#include "cpu.h"
 
 static const uint32_t realesrgan_preproc_spv_data[] = {
     #include "realesrgan_preproc.spv.hex.h"
@@ -40,22 +42,40 @@ static const uint32_t realesrgan_postproc_tta_fp16s_spv_data[] = {
 static const uint32_t realesrgan_postproc_tta_int8s_spv_data[] = {
     #include "realesrgan_postproc_tta_int8s.spv.hex.h"
 };
+static const uint32_t roi_blend_spv_data[] = {
+    #include "roi_blend.spv.hex.h"
+};
 
-RealESRGAN::RealESRGAN(int gpuid, int num_threads, bool tta_mode)
+RealESRGAN::RealESRGAN(int gpuid, int num_threads, int tta_mode, int precision, int arithmetic)
 {
-    _net.opt.use_vulkan_compute = true;
-    _net.opt.use_fp16_packed = true;
-    _net.opt.use_fp16_storage = true;
-    _net.opt.use_fp16_arithmetic = false;
+    // 0 picks the fastest mode the device supports
+    const ncnn::GpuInfo& info = ncnn::get_gpu_info(gpuid);
+    if (precision == 0)
+        precision = info.support_fp16_storage() ? 16 : 32;
+    if (arithmetic == 0)
+        arithmetic = precision != 32 && info.support_fp16_arithmetic() ? 16 : 32;
+
+    // int8 models run on the cpu with every core, ncnn's vulkan backend would only move their quantized
+    // convolutions there anyway and copy each blob between the devices around them
+    _net.opt.use_vulkan_compute = precision != 8;
+    _net.opt.use_fp16_packed = precision != 32;
+    _net.opt.use_fp16_storage = precision != 32;
+    _net.opt.use_fp16_arithmetic = arithmetic == 16;
     _net.opt.use_int8_storage = false;
     _net.opt.use_int8_arithmetic = false;
-    _net.opt.num_threads = num_threads;
+    _net.opt.num_threads = precision == 8 ? ncnn::get_big_cpu_count() : num_threads;
 
-    _tta_mode = tta_mode;
-    _preproc = nullptr;
+    // tta_mode 1 keeps the original meaning of all 8 augmentations
+    _tta_count = tta_mode == 1 ? 8 : std::max(tta_mode, 1);
+    _tile_shift = 0;
+    strip_workers = 1;
     _preproc = nullptr;
+    _postproc = nullptr;
+    _roi_blend = nullptr;
+    _bicubic = nullptr;
 
-    _net.set_vulkan_device(gpuid);
+    if (_net.opt.use_vulkan_compute)
+        _net.set_vulkan_device(gpuid);
 }
 
 RealESRGAN::~RealESRGAN()
@@ -63,12 +83,23 @@ RealESRGAN::~RealESRGAN()
     // cleanup preprocess and postprocess pipeline
     if (_preproc) delete _preproc;
     if (_postproc) delete _postproc;
+    if (_roi_blend) delete _roi_blend;
+
+    if (_bicubic)
+    {
+        _bicubic->destroy_pipeline(_net.opt);
+        delete _bicubic;
+    }
 }
 
 int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
 {
-    _net.load_param(parampath.c_str());
-    _net.load_model(modelpath.c_str());
+    if (loadNet(_net, parampath, modelpath, _weights))
+        return -1;
+
+    // the cpu net needs none of the shaders
+    if (!_net.opt.use_vulkan_compute)
+        return 0;
 
     // initialize preprocess and postprocess pipeline
     {
@@ -79,27 +110,31 @@ int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
         specializations[0].i = 0;
 #endif
 
+        std::vector<ncnn::vk_specialization_type> tta_specializations(2);
+        tta_specializations[0] = specializations[0];
+        tta_specializations[1].i = _tta_count;
+
         _preproc = new ncnn::Pipeline(_net.vulkan_device());
         _preproc->set_optimal_local_size_xyz(32, 32, 3);
 
         _postproc = new ncnn::Pipeline(_net.vulkan_device());
         _postproc->set_optimal_local_size_xyz(32, 32, 3);
 
-        if (_tta_mode)
+        if (_tta_count > 1)
         {
             if (_net.opt.use_fp16_storage && _net.opt.use_int8_storage)
-                _preproc->create(realesrgan_preproc_tta_int8s_spv_data, sizeof(realesrgan_preproc_tta_int8s_spv_data), specializations);
+                _preproc->create(realesrgan_preproc_tta_int8s_spv_data, sizeof(realesrgan_preproc_tta_int8s_spv_data), tta_specializations);
             else if (_net.opt.use_fp16_storage)
-                _preproc->create(realesrgan_preproc_tta_fp16s_spv_data, sizeof(realesrgan_preproc_tta_fp16s_spv_data), specializations);
+                _preproc->create(realesrgan_preproc_tta_fp16s_spv_data, sizeof(realesrgan_preproc_tta_fp16s_spv_data), tta_specializations);
             else
-                _preproc->create(realesrgan_preproc_tta_spv_data, sizeof(realesrgan_preproc_tta_spv_data), specializations);
+                _preproc->create(realesrgan_preproc_tta_spv_data, sizeof(realesrgan_preproc_tta_spv_data), tta_specializations);
 
             if (_net.opt.use_fp16_storage && _net.opt.use_int8_storage)
-                _postproc->create(realesrgan_postproc_tta_int8s_spv_data, sizeof(realesrgan_postproc_tta_int8s_spv_data), specializations);
+                _postproc->create(realesrgan_postproc_tta_int8s_spv_data, sizeof(realesrgan_postproc_tta_int8s_spv_data), tta_specializations);
             else if (_net.opt.use_fp16_storage)
-                _postproc->create(realesrgan_postproc_tta_fp16s_spv_data, sizeof(realesrgan_postproc_tta_fp16s_spv_data), specializations);
+                _postproc->create(realesrgan_postproc_tta_fp16s_spv_data, sizeof(realesrgan_postproc_tta_fp16s_spv_data), tta_specializations);
             else
-                _postproc->create(realesrgan_postproc_tta_spv_data, sizeof(realesrgan_postproc_tta_spv_data), specializations);
+                _postproc->create(realesrgan_postproc_tta_spv_data, sizeof(realesrgan_postproc_tta_spv_data), tta_specializations);
         }
         else
         {
@@ -117,91 +152,138 @@ int RealESRGAN::load(const std::string& parampath, const std::string& modelpath)
             else
                 _postproc->create(realesrgan_postproc_spv_data, sizeof(realesrgan_postproc_spv_data), specializations);
         }
+
+        // reads and writes the fp32 strips directly, so no storage variants
+        _roi_blend = new ncnn::Pipeline(_net.vulkan_device());
+        _roi_blend->set_optimal_local_size_xyz(32, 32, 3);
+        _roi_blend->create(roi_blend_spv_data, sizeof(roi_blend_spv_data), std::vector<ncnn::vk_specialization_type>());
+    }
+
+    // the alpha channel skips the network and is resampled bicubic by scale
+    if (scale > 1)
+    {
+        _bicubic = ncnn::create_layer("Interp");
+        _bicubic->vkdev = _net.vulkan_device();
+
+        ncnn::ParamDict pd;
+        pd.set(0, 3);// bicubic
+        pd.set(1, (float)scale);
+        pd.set(2, (float)scale);
+        _bicubic->load_param(pd);
+
+        _bicubic->create_pipeline(_net.opt);
     }
 
     return 0;
 }
 
-int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int w, int h, int src_stride, int dst_stride) const
+int RealESRGAN::autotune(const std::string& parampath, const std::string& modelpath, const std::string& cache_path)
+{
+    // the options autotune tries are all vulkan ones
+    if (!_net.opt.use_vulkan_compute)
+        return 0;
+
+    const ncnn::Option base = _net.opt;
+    const std::string key = autotuneKey(_net.vulkan_device()->info, modelpath, tilesize, tilesize, base);
+
+    uint32_t flags;
+    if (!autotuneLookup(cache_path, key, flags))
+    {
+        const bool tuned = autotuneSearch(base, [&](const ncnn::Option& opt) {
+            if (reload(parampath, modelpath, opt))
+                return (double)HUGE_VAL;
+            return autotuneTime(*this, tilesize, tilesize, scale);
+        }, flags);
+        if (tuned)
+            autotuneStore(cache_path, key, flags);
+    }
+
+    ncnn::Option opt = base;
+    autotuneApply(opt, flags);
+    return reload(parampath, modelpath, opt);
+}
+
+int RealESRGAN::reload(const std::string& parampath, const std::string& modelpath, const ncnn::Option& opt)
+{
+    // the pre/post pipelines only depend on the storage options, which autotune leaves alone
+    const ncnn::VulkanDevice* vkdev = _net.vulkan_device();
+    _net.clear();
+    _net.opt = opt;
+    _net.set_vulkan_device(vkdev);
+
+    return loadNet(_net, parampath, modelpath, _weights);
+}
+
+int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int w, int h, int src_stride, int dst_stride, const float* weight, int weight_stride, const float* srcpA, float* dstpA) const
+{
+    const StripFrame frame = { srcpR, srcpG, srcpB, srcpA, dstpR, dstpG, dstpB, dstpA, w, h, src_stride, dst_stride, weight, weight_stride };
+    if (!_net.opt.use_vulkan_compute)
+    {
+        const CpuTileLayout layout = { "data", "output", true, 1, true };
+        return processCpuTiles(_net, layout, scale, prepadding, frame, tilesize, tilesize);
+    }
+
+    return processShrinkingTiles(_tile_shift, tilesize, tilesize, w, h, [&](int tile_w, int tile_h, const TileRegion& region, FailedRegions& failed) {
+        return processStrips(_net.vulkan_device(), _net.opt, _roi_blend, scale, prepadding, strip_workers, frame, region, tile_w, tile_h,
+            [&](const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, const unsigned char* tile_mask) {
+                return process_gpu_with_tile(in_gpu, x0, y0, width, height, out_gpu, cmd, blob_vkallocator, staging_vkallocator, tile_w, tile_h, tile_mask);
+            }, failed);
+    });
+}
+
+int RealESRGAN::process_gpu(const ncnn::VkMat& in_gpu, int x0, int y0, int w, int h, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, const unsigned char* tile_mask) const
+{
+    const int shift = _tile_shift;
+    return process_gpu_with_tile(in_gpu, x0, y0, w, h, out_gpu, cmd, blob_vkallocator, staging_vkallocator, reducedTilesize(tilesize, shift), reducedTilesize(tilesize, shift), tile_mask);
+}
+
+int RealESRGAN::process_gpu_with_tile(const ncnn::VkMat& in_gpu, int x0, int y0, int w, int h, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, int tile_w, int tile_h, const unsigned char* tile_mask) const
 {
     const int channels = 3;
-    const int elempack = 1;
 
-    const int TILE_SIZE_W = tilesize;
-    const int TILE_SIZE_H = tilesize;
+    const int TILE_SIZE_W = tile_w;
+    const int TILE_SIZE_H = tile_h;
+
+    const int xtiles = (w + TILE_SIZE_W - 1) / TILE_SIZE_W;
+    const int ytiles = (h + TILE_SIZE_H - 1) / TILE_SIZE_H;
+
+    const size_t in_out_tile_elemsize = _net.opt.use_fp16_storage ? 2u : 4u;
 
-    ncnn::VkAllocator* blob_vkallocator = _net.vulkan_device()->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = _net.vulkan_device()->acquire_staging_allocator();
+    // a fourth input channel is alpha, which preproc cuts out, the bicubic layer upscales and postproc puts back
+    const int in_channels = in_gpu.c;
 
     ncnn::Option opt = _net.opt;
     opt.blob_vkallocator = blob_vkallocator;
     opt.workspace_vkallocator = blob_vkallocator;
     opt.staging_vkallocator = staging_vkallocator;
 
-    // each tile 100x100
-    const int xtiles = (w + TILE_SIZE_W - 1) / TILE_SIZE_W;
-    const int ytiles = (h + TILE_SIZE_H - 1) / TILE_SIZE_H;
+    int ret = 0;
 
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+    const TtaExtractor tta(_net, _tta_count);
 
-    //#pragma omp parallel for num_threads(2)
     for (int yi = 0; yi < ytiles; yi++)
     {
         const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_H, h) - yi * TILE_SIZE_H;
 
-        int in_tile_y0 = std::max(yi * TILE_SIZE_H - prepadding, 0);
-        int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_H + prepadding, h);
-        const int in_tile_w = w;
-        const int in_tile_h = in_tile_y1 - in_tile_y0;
-
-        ncnn::Mat in;
-        in.create(in_tile_w, in_tile_h, channels, sizeof(float));
-
-        float *in_tile_r = in.channel(0);
-        float *in_tile_g = in.channel(1);
-        float *in_tile_b = in.channel(2);
-        const float *sr = srcpR + in_tile_y0 * src_stride;
-        const float *sg = srcpG + in_tile_y0 * src_stride;
-        const float *sb = srcpB + in_tile_y0 * src_stride;
-        for (int y = 0; y < in_tile_h; y++)
-        {
-            for (int x = 0; x < in_tile_w; x++)
-            {
-                in_tile_r[in_tile_w * y + x] = sr[src_stride * y + x] * 255.f;
-                in_tile_g[in_tile_w * y + x] = sg[src_stride * y + x] * 255.f;
-                in_tile_b[in_tile_w * y + x] = sb[src_stride * y + x] * 255.f;
-            }
-        }
-
-        ncnn::VkCompute cmd(_net.vulkan_device());
-
-        // upload
-        ncnn::VkMat in_gpu;
-        {
-            cmd.record_clone(in, in_gpu, opt);
-
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
-            }
-        }
-
-        int out_tile_y0 = std::max(yi * TILE_SIZE_H, 0);
-        int out_tile_y1 = std::min((yi + 1) * TILE_SIZE_H, h);
-
-        ncnn::VkMat out_gpu;
-        out_gpu.create(w * scale, (out_tile_y1 - out_tile_y0) * scale, channels, sizeof(float), blob_vkallocator);
+        // output rows are addressed through offset_x, the postproc shaders index top_blob linearly
+        const int out_tile_y0 = yi * TILE_SIZE_H * scale;
+        const int out_tile_h = tile_h_nopad * scale;
 
         for (int xi = 0; xi < xtiles; xi++)
         {
+            if (tile_mask && !tile_mask[yi * xtiles + xi])
+                continue;
+
             const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_W, w) - xi * TILE_SIZE_W;
 
-            if (_tta_mode)
+            const int out_tile_x0 = xi * TILE_SIZE_W * scale;
+            const int out_tile_w = std::min(TILE_SIZE_W * scale, out_gpu.w - out_tile_x0);
+
+            if (_tta_count > 1)
             {
                 // preproc
                 ncnn::VkMat in_tile_gpu[8];
-                ncnn::VkMat dummy_alpha_tile_gpu;
+                ncnn::VkMat in_alpha_tile_gpu;
                 {
                     // crop tile
                     int tile_x0 = xi * TILE_SIZE_W - prepadding;
@@ -209,14 +291,27 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
                     int tile_y0 = yi * TILE_SIZE_H - prepadding;
                     int tile_y1 = std::min((yi + 1) * TILE_SIZE_H, h) + prepadding;
 
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[channels].create(tile_x1 - tile_x0, tile_y1 - tile_y0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
+                    for (int ti = 0; ti < _tta_count; ti++)
+                    {
+                        // augmentations 4-7 are transposed
+                        if (ti < 4)
+                            in_tile_gpu[ti].create(tile_x1 - tile_x0, tile_y1 - tile_y0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
+                        else
+                            in_tile_gpu[ti].create(tile_y1 - tile_y0, tile_x1 - tile_x0, channels, in_out_tile_elemsize, 1, blob_vkallocator);
+                    }
+                    for (int ti = 0; ti < _tta_count; ti++)
+                    {
+                        if (in_tile_gpu[ti].empty())
+                            ret = TILE_OUT_OF_MEMORY;
+                    }
+                    if (in_channels == 4)
+                    {
+                        in_alpha_tile_gpu.create(tile_w_nopad, tile_h_nopad, 1, in_out_tile_elemsize, 1, blob_vkallocator);
+                        if (in_alpha_tile_gpu.empty())
+                            ret = TILE_OUT_OF_MEMORY;
+                    }
+                    if (ret != 0)
+                        break;
 
                     std::vector<ncnn::VkMat> bindings(10);
                     bindings[0] = in_gpu;
@@ -228,7 +323,7 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
                     bindings[6] = in_tile_gpu[5];
                     bindings[7] = in_tile_gpu[6];
                     bindings[8] = in_tile_gpu[7];
-                    bindings[9] = dummy_alpha_tile_gpu;
+                    bindings[9] = in_alpha_tile_gpu;
 
                     std::vector<ncnn::vk_constant_type> constants(13);
                     constants[0].i = in_gpu.w;
@@ -239,34 +334,41 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
                     constants[5].i = in_tile_gpu[0].cstep;
                     constants[6].i = prepadding;
                     constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_W;
-                    constants[9].i = std::min(yi * TILE_SIZE_H, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = dummy_alpha_tile_gpu.w;
-                    constants[12].i = dummy_alpha_tile_gpu.h;
+                    constants[8].i = x0 + xi * TILE_SIZE_W;
+                    constants[9].i = y0 + yi * TILE_SIZE_H;
+                    constants[10].i = in_channels;
+                    constants[11].i = in_alpha_tile_gpu.w;
+                    constants[12].i = in_alpha_tile_gpu.h;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu[0].w;
                     dispatcher.h = in_tile_gpu[0].h;
-                    dispatcher.c = channels;
+                    dispatcher.c = in_channels;
 
                     cmd.record_pipeline(_preproc, bindings, constants, dispatcher);
                 }
 
-                // realesrgan
-                ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
+                // alpha
+                ncnn::VkMat out_alpha_tile_gpu;
+                if (in_channels == 4)
                 {
-                    ncnn::Extractor ex = _net.create_extractor();
-
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+                    if (_bicubic)
+                        _bicubic->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+                    else
+                        out_alpha_tile_gpu = in_alpha_tile_gpu;
+                    if (out_alpha_tile_gpu.empty())
+                    {
+                        ret = TILE_OUT_OF_MEMORY;
+                        break;
+                    }
+                }
 
-                    ex.input("data", in_tile_gpu[ti]);
+                // realesrgan
+                ncnn::VkMat out_tile_gpu[8];
+                ret = tta.extract("data", "output", in_tile_gpu, out_tile_gpu, cmd, blob_vkallocator, staging_vkallocator);
 
-                    ex.extract("output", out_tile_gpu[ti], cmd);
-                }
+                if (ret != 0)
+                    break;
 
                 // postproc
                 {
@@ -279,7 +381,7 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
                     bindings[5] = out_tile_gpu[5];
                     bindings[6] = out_tile_gpu[6];
                     bindings[7] = out_tile_gpu[7];
-                    bindings[8] = dummy_alpha_tile_gpu;
+                    bindings[8] = out_alpha_tile_gpu;
                     bindings[9] = out_gpu;
 
                     std::vector<ncnn::vk_constant_type> constants(13);
@@ -287,20 +389,20 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
                     constants[1].i = out_tile_gpu[0].h;
                     constants[2].i = out_tile_gpu[0].cstep;
                     constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
+                    constants[4].i = out_tile_h;
                     constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_W * scale;
-                    constants[7].i = std::min(TILE_SIZE_W * scale, out_gpu.w - xi * TILE_SIZE_W * scale);
+                    constants[6].i = out_tile_y0 * out_gpu.w + out_tile_x0;
+                    constants[7].i = out_tile_w;
                     constants[8].i = prepadding * scale;
                     constants[9].i = prepadding * scale;
-                    constants[10].i = channels;
-                    constants[11].i = dummy_alpha_tile_gpu.w;
-                    constants[12].i = dummy_alpha_tile_gpu.h;
+                    constants[10].i = in_channels;
+                    constants[11].i = out_alpha_tile_gpu.w;
+                    constants[12].i = out_alpha_tile_gpu.h;
 
                     ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_W * scale, out_gpu.w - xi * TILE_SIZE_W * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
+                    dispatcher.w = out_tile_w;
+                    dispatcher.h = out_tile_h;
+                    dispatcher.c = in_channels;
 
                     cmd.record_pipeline(_postproc, bindings, constants, dispatcher);
                 }
@@ -309,7 +411,7 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
             {
                 // preproc
                 ncnn::VkMat in_tile_gpu;
-                ncnn::VkMat dummy_alpha_tile_gpu;
+                ncnn::VkMat in_alpha_tile_gpu;
                 {
                     // crop tile
                     int tile_x0 = xi * TILE_SIZE_W - prepadding;
@@ -318,11 +420,26 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
                     int tile_y1 = std::min((yi + 1) * TILE_SIZE_H, h) + prepadding;
 
                     in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                    if (in_tile_gpu.empty())
+                    {
+                        ret = TILE_OUT_OF_MEMORY;
+                        break;
+                    }
+
+                    if (in_channels == 4)
+                    {
+                        in_alpha_tile_gpu.create(tile_w_nopad, tile_h_nopad, 1, in_out_tile_elemsize, 1, blob_vkallocator);
+                        if (in_alpha_tile_gpu.empty())
+                        {
+                            ret = TILE_OUT_OF_MEMORY;
+                            break;
+                        }
+                    }
 
                     std::vector<ncnn::VkMat> bindings(3);
                     bindings[0] = in_gpu;
                     bindings[1] = in_tile_gpu;
-                    bindings[2] = dummy_alpha_tile_gpu;
+                    bindings[2] = in_alpha_tile_gpu;
 
                     std::vector<ncnn::vk_constant_type> constants(13);
                     constants[0].i = in_gpu.w;
@@ -333,20 +450,35 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
                     constants[5].i = in_tile_gpu.cstep;
                     constants[6].i = prepadding;
                     constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_W;
-                    constants[9].i = std::min(yi * TILE_SIZE_H, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = dummy_alpha_tile_gpu.w;
-                    constants[12].i = dummy_alpha_tile_gpu.h;
+                    constants[8].i = x0 + xi * TILE_SIZE_W;
+                    constants[9].i = y0 + yi * TILE_SIZE_H;
+                    constants[10].i = in_channels;
+                    constants[11].i = in_alpha_tile_gpu.w;
+                    constants[12].i = in_alpha_tile_gpu.h;
 
                     ncnn::VkMat dispatcher;
                     dispatcher.w = in_tile_gpu.w;
                     dispatcher.h = in_tile_gpu.h;
-                    dispatcher.c = channels;
+                    dispatcher.c = in_channels;
 
                     cmd.record_pipeline(_preproc, bindings, constants, dispatcher);
                 }
 
+                // alpha
+                ncnn::VkMat out_alpha_tile_gpu;
+                if (in_channels == 4)
+                {
+                    if (_bicubic)
+                        _bicubic->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+                    else
+                        out_alpha_tile_gpu = in_alpha_tile_gpu;
+                    if (out_alpha_tile_gpu.empty())
+                    {
+                        ret = TILE_OUT_OF_MEMORY;
+                        break;
+                    }
+                }
+
                 // realesrgan
                 ncnn::VkMat out_tile_gpu;
                 {
@@ -358,14 +490,17 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
 
                     ex.input("data", in_tile_gpu);
 
-                    ex.extract("output", out_tile_gpu, cmd);
+                    ret = ex.extract("output", out_tile_gpu, cmd);
                 }
 
+                if (ret != 0)
+                    break;
+
                 // postproc
                 {
                     std::vector<ncnn::VkMat> bindings(3);
                     bindings[0] = out_tile_gpu;
-                    bindings[1] = dummy_alpha_tile_gpu;
+                    bindings[1] = out_alpha_tile_gpu;
                     bindings[2] = out_gpu;
 
                     std::vector<ncnn::vk_constant_type> constants(13);
@@ -373,59 +508,40 @@ int RealESRGAN::process(const float* srcpR, const float* srcpG, const float* src
                     constants[1].i = out_tile_gpu.h;
                     constants[2].i = out_tile_gpu.cstep;
                     constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
+                    constants[4].i = out_tile_h;
                     constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_W * scale;
-                    constants[7].i = std::min(TILE_SIZE_W * scale, out_gpu.w - xi * TILE_SIZE_W * scale);
+                    constants[6].i = out_tile_y0 * out_gpu.w + out_tile_x0;
+                    constants[7].i = out_tile_w;
                     constants[8].i = prepadding * scale;
                     constants[9].i = prepadding * scale;
-                    constants[10].i = channels;
-                    constants[11].i = dummy_alpha_tile_gpu.w;
-                    constants[12].i = dummy_alpha_tile_gpu.h;
+                    constants[10].i = in_channels;
+                    constants[11].i = out_alpha_tile_gpu.w;
+                    constants[12].i = out_alpha_tile_gpu.h;
 
                     ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_W * scale, out_gpu.w - xi * TILE_SIZE_W * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
+                    dispatcher.w = out_tile_w;
+                    dispatcher.h = out_tile_h;
+                    dispatcher.c = in_channels;
 
                     cmd.record_pipeline(_postproc, bindings, constants, dispatcher);
                 }
             }
 
-            if (xtiles > 1)
+            // tiles from the worker allocators must be consumed before they are reclaimed
+            if (xtiles * ytiles > 1 || tta.parallel())
             {
-                cmd.submit_and_wait();
+                if (cmd.submit_and_wait() != 0 && ret == 0)
+                    ret = -1;
                 cmd.reset();
             }
-        }
 
-        // download
-        {
-            ncnn::Mat out;
-
-            cmd.record_clone(out_gpu, out, opt);
-            cmd.submit_and_wait();
-
-            const float* out_tile_r = out.channel(0);
-            const float* out_tile_g = out.channel(1);
-            const float* out_tile_b = out.channel(2);
-            float* dr = dstpR + yi * TILE_SIZE_H * scale * dst_stride;
-            float* dg = dstpG + yi * TILE_SIZE_H * scale * dst_stride;
-            float* db = dstpB + yi * TILE_SIZE_H * scale * dst_stride;
-            for (int y = 0; y < out.h; y++)
-            {
-                for (int x = 0; x < out.w; x++)
-                {
-                    dr[dst_stride * y + x] = std::min(1.f, std::max(0.f, out_tile_r[out.w * y + x] / 255.f));
-                    dg[dst_stride * y + x] = std::min(1.f, std::max(0.f, out_tile_g[out.w * y + x] / 255.f));
-                    db[dst_stride * y + x] = std::min(1.f, std::max(0.f, out_tile_b[out.w * y + x] / 255.f));
-                }
-            }
+            if (ret != 0)
+                break;
         }
-    }
 
-    _net.vulkan_device()->reclaim_blob_allocator(blob_vkallocator);
-    _net.vulkan_device()->reclaim_staging_allocator(staging_vkallocator);
+        if (ret != 0)
+            break;
+    }
 
-    return 0;
+    return ret;
 }
@@ -0,0 +1,320 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "remote-client.hpp"
+
+// how long a worker that failed is left out before it is tried again
+#define REMOTE_RETRY_DELAY std::chrono::seconds(5)
+
+// a worker that doesn't accept or answer for this long is treated as one that dropped the connection,
+// long enough for a frame that waits behind other clients' frames on a busy worker
+#define REMOTE_TIMEOUT_SECONDS 120
+
+RemoteClient::RemoteClient(const std::vector<std::string>& addresses, int width, int height, int scale, int max_connections)
+{
+    _width = width;
+    _height = height;
+    _scale = scale;
+    _in_size = int64_t(width) * height * 3 * sizeof(float);
+    _out_size = _in_size * scale * scale;
+    _max_connections = max_connections;
+
+    for (const std::string& address : addresses)
+        _workers.push_back(Worker{ address, 0, std::vector<Connection*>(), std::chrono::steady_clock::time_point() });
+}
+
+RemoteClient::~RemoteClient()
+{
+    for (Worker& w : _workers)
+    {
+        for (Connection* c : w.idle)
+            close_connection(c);
+    }
+}
+
+#ifndef _WIN32
+// the timeouts also bound connect, and a send or recv that times out fails like one on a closed socket
+static int open_socket(int family, int type, int protocol)
+{
+    int fd = socket(family, type, protocol);
+    if (fd >= 0)
+    {
+        timeval timeout{};
+        timeout.tv_sec = REMOTE_TIMEOUT_SECONDS;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    return fd;
+}
+
+static int connect_address(const std::string& address, bool& is_tcp)
+{
+    // anything that is not a path and has a port is a tcp worker
+    const size_t colon = address.rfind(':');
+    is_tcp = !address.empty() && address[0] != '/' && colon != std::string::npos;
+
+    if (!is_tcp)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+
+        int fd = open_socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+            return fd;
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &res))
+        return -1;
+
+    int fd = -1;
+    for (addrinfo* ai = res; ai; ai = ai->ai_next)
+    {
+        fd = open_socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+#endif
+
+RemoteClient::Connection* RemoteClient::open_connection(int worker, std::string& error)
+{
+#ifdef _WIN32
+    error = "not supported on Windows";
+    return nullptr;
+#else
+    static std::atomic<int> counter{ 0 };
+
+    const std::string& address = _workers[worker].address;
+    Connection* c = new Connection{ worker, -1, false, nullptr, _in_size + _out_size, std::vector<unsigned char>() };
+
+    bool is_tcp;
+    c->fd = connect_address(address, is_tcp);
+    if (c->fd < 0)
+    {
+        error = "can't connect to " + address;
+        close_connection(c);
+        return nullptr;
+    }
+
+    RemoteHello hello{};
+    hello.magic = REMOTE_MAGIC;
+    hello.version = REMOTE_VERSION;
+    hello.shm_size = c->data_size;
+
+    if (is_tcp)
+    {
+        // an empty shm_name tells the worker the planes come over the socket
+        c->inline_data = true;
+        c->buffer.resize(c->data_size);
+        c->data = c->buffer.data();
+    }
+    else
+    {
+        snprintf(hello.shm_name, sizeof(hello.shm_name), "/vsnvk-%d-%d", int(getpid()), counter++);
+
+        int shm_fd = shm_open(hello.shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (shm_fd < 0)
+        {
+            error = "can't create shared memory";
+            close_connection(c);
+            return nullptr;
+        }
+        void* shm = MAP_FAILED;
+        if (ftruncate(shm_fd, c->data_size) == 0)
+            shm = mmap(nullptr, c->data_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        close(shm_fd);
+        if (shm != MAP_FAILED)
+            c->data = static_cast<unsigned char*>(shm);
+    }
+
+    // the server maps the memory while handling the hello, the name is not needed after that
+    RemoteReply reply{};
+    bool ok = c->data && remoteSend(c->fd, &hello, sizeof(hello)) && remoteRecv(c->fd, &reply, sizeof(reply));
+    if (!c->inline_data)
+        shm_unlink(hello.shm_name);
+    if (!ok || reply.status != 0)
+    {
+        error = ok ? std::string(reply.error, strnlen(reply.error, sizeof(reply.error))) : "handshake with " + address + " failed";
+        close_connection(c);
+        return nullptr;
+    }
+
+    return c;
+#endif
+}
+
+void RemoteClient::close_connection(Connection* c)
+{
+#ifndef _WIN32
+    if (c->data && !c->inline_data) munmap(c->data, c->data_size);
+    if (c->fd >= 0) close(c->fd);
+#endif
+    delete c;
+}
+
+RemoteClient::Connection* RemoteClient::acquire(std::string& error)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+
+    for (;;)
+    {
+        // least loaded worker that is not waiting out a failure
+        const auto now = std::chrono::steady_clock::now();
+        int best = -1;
+        bool any_up = false;
+        for (int i = 0; i < (int)_workers.size(); i++)
+        {
+            if (_workers[i].retry_at > now)
+                continue;
+            any_up = true;
+            if (_workers[i].in_flight < _max_connections && (best < 0 || _workers[i].in_flight < _workers[best].in_flight))
+                best = i;
+        }
+
+        if (!any_up)
+        {
+            error = "no worker reachable";
+            return nullptr;
+        }
+
+        if (best < 0)
+        {
+            _idle_cv.wait_for(lock, std::chrono::milliseconds(100));
+            continue;
+        }
+
+        Worker& w = _workers[best];
+        w.in_flight++;
+
+        if (!w.idle.empty())
+        {
+            Connection* c = w.idle.back();
+            w.idle.pop_back();
+            return c;
+        }
+
+        lock.unlock();
+        Connection* c = open_connection(best, error);
+        lock.lock();
+
+        if (c)
+            return c;
+
+        w.in_flight--;
+        w.retry_at = std::chrono::steady_clock::now() + REMOTE_RETRY_DELAY;
+        _idle_cv.notify_all();
+    }
+}
+
+void RemoteClient::release(Connection* c, bool broken)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    Worker& w = _workers[c->worker];
+    w.in_flight--;
+    if (broken)
+    {
+        w.retry_at = std::chrono::steady_clock::now() + REMOTE_RETRY_DELAY;
+        close_connection(c);
+    }
+    else
+    {
+        w.idle.push_back(c);
+    }
+    _idle_cv.notify_all();
+}
+
+int RemoteClient::process(const RemoteSpec& spec, const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int src_stride, int dst_stride, std::string& error)
+{
+#ifdef _WIN32
+    error = "not supported on Windows";
+    return -1;
+#else
+    const int w = _width;
+    const int h = _height;
+    const int out_w = w * _scale;
+    const int out_h = h * _scale;
+
+    // a lost connection is retried once per worker
+    for (int attempt = 0; attempt <= (int)_workers.size(); attempt++)
+    {
+        Connection* c = acquire(error);
+        if (!c)
+            return -1;
+
+        float* in = reinterpret_cast<float*>(c->data);
+        const float* srcp[3] = { srcpR, srcpG, srcpB };
+        for (int p = 0; p < 3; p++)
+        {
+            for (int y = 0; y < h; y++)
+                memcpy(in + (int64_t(p) * h + y) * w, srcp[p] + int64_t(y) * src_stride, w * sizeof(float));
+        }
+
+        RemoteRequest request{};
+        request.spec = spec;
+        request.width = w;
+        request.height = h;
+
+        RemoteReply reply{};
+        bool ok = remoteSend(c->fd, &request, sizeof(request))
+            && (!c->inline_data || remoteSend(c->fd, c->data, _in_size))
+            && remoteRecv(c->fd, &reply, sizeof(reply))
+            && (!c->inline_data || reply.status != 0 || remoteRecv(c->fd, c->data + _in_size, _out_size));
+        if (!ok)
+        {
+            error = "lost connection to " + _workers[c->worker].address;
+            release(c, true);
+            continue;
+        }
+        if (reply.status != 0)
+        {
+            error = std::string(reply.error, strnlen(reply.error, sizeof(reply.error)));
+            release(c, false);
+            return -1;
+        }
+
+        const float* out = reinterpret_cast<const float*>(c->data + _in_size);
+        float* dstp[3] = { dstpR, dstpG, dstpB };
+        for (int p = 0; p < 3; p++)
+        {
+            for (int y = 0; y < out_h; y++)
+                memcpy(dstp[p] + int64_t(y) * dst_stride, out + (int64_t(p) * out_h + y) * out_w, out_w * sizeof(float));
+        }
+
+        release(c, false);
+        return 0;
+    }
+
+    return -1;
+#endif
+}
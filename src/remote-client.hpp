@@ -0,0 +1,61 @@
+#ifndef REMOTE_CLIENT_HPP
+#define REMOTE_CLIENT_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "remote-protocol.hpp"
+
+// runs frames on one or more vsnvk-server workers instead of a local device
+// each frame in flight uses its own connection; over a unix socket the planes travel through shared memory,
+// over tcp they follow the request on the socket
+class RemoteClient
+{
+public:
+    // addresses are unix socket paths or host:port of tcp workers
+    RemoteClient(const std::vector<std::string>& addresses, int width, int height, int scale, int max_connections);
+    ~RemoteClient();
+
+    // a worker that drops the connection is skipped for a while and the frame is retried on another one
+    int process(const RemoteSpec& spec, const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int src_stride, int dst_stride, std::string& error);
+
+private:
+    struct Connection
+    {
+        int worker;
+        int fd;
+        bool inline_data;
+        unsigned char* data;
+        int64_t data_size;
+        std::vector<unsigned char> buffer;
+    };
+
+    struct Worker
+    {
+        std::string address;
+        int in_flight;
+        std::vector<Connection*> idle;
+        std::chrono::steady_clock::time_point retry_at;
+    };
+
+    Connection* acquire(std::string& error);
+    void release(Connection* c, bool broken);
+    Connection* open_connection(int worker, std::string& error);
+    void close_connection(Connection* c);
+
+    int _width;
+    int _height;
+    int _scale;
+    int64_t _in_size;
+    int64_t _out_size;
+    int _max_connections;
+
+    std::mutex _lock;
+    std::condition_variable _idle_cv;
+    std::vector<Worker> _workers;
+};
+
+#endif // REMOTE_CLIENT_HPP
@@ -0,0 +1,88 @@
+#ifndef REMOTE_PROTOCOL_HPP
+#define REMOTE_PROTOCOL_HPP
+
+// wire format shared by the plugin and vsnvk-server
+// a connection starts with RemoteHello, then carries one RemoteRequest / RemoteReply pair per frame
+// frames are packed planar 32-bit float rgb, either in the shared memory named in the hello
+// (input at offset 0, output right after it) or, without shared memory, right after the message
+
+#include <cstddef>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+#define REMOTE_MAGIC 0x4b564e56
+#define REMOTE_VERSION 2
+
+enum {
+    REMOTE_ENGINE_WAIFU2X = 0,
+    REMOTE_ENGINE_REALESRGAN = 1,
+};
+
+// everything the server needs to find or load a net, sent with every frame so per-frame models work
+typedef struct {
+    int32_t engine;
+    int32_t gpu_id;
+    int32_t tta_mode;
+    int32_t noise;
+    int32_t scale;
+    int32_t tile_w; // 0 lets the server choose
+    int32_t tile_h;
+    int32_t prepadding;
+    int32_t precision; // as the filter argument, 0 lets the server's device choose
+    int32_t arithmetic;
+    char model[256]; // relative to the server's models directory, without .param / .bin
+} RemoteSpec;
+
+typedef struct {
+    uint32_t magic;
+    int32_t version;
+    char shm_name[64];
+    int64_t shm_size;
+} RemoteHello;
+
+typedef struct {
+    RemoteSpec spec;
+    int32_t width;
+    int32_t height;
+} RemoteRequest;
+
+typedef struct {
+    int32_t status; // 0 on success
+    char error[124];
+} RemoteReply;
+
+#ifndef _WIN32
+static inline bool remoteSend(int fd, const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    while (size > 0) {
+#ifdef MSG_NOSIGNAL
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+#else
+        ssize_t n = send(fd, p, size, 0);
+#endif
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static inline bool remoteRecv(int fd, void *data, size_t size) {
+    char *p = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+#endif
+
+#endif // REMOTE_PROTOCOL_HPP
@@ -0,0 +1,491 @@
+// vsnvk-server: one process that owns the device and the nets for every plugin instance on this machine
+// usage: vsnvk-server [-s socket_path] [-t tcp_port] [-b bind_address] [-m models_dir] [-j gpu_threads] [-c model_cache]
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "gpu.h"
+#include "model-file.hpp"
+#include "real-esrgan.hpp"
+#include "remote-protocol.hpp"
+#include "waifu2x.hpp"
+
+struct Engine
+{
+    std::unique_ptr<Waifu2x> waifu2x;
+    std::unique_ptr<RealESRGAN> realesrgan;
+    int scale;
+};
+
+struct EngineEntry
+{
+    std::string key;
+    std::shared_future<std::shared_ptr<Engine> > engine;
+};
+
+struct Job
+{
+    std::shared_ptr<Engine> engine;
+    int width;
+    int height;
+    const float* in;
+    float* out;
+    std::promise<int> done;
+};
+
+// largest frame buffer a tcp client may ask for
+#define REMOTE_MAX_INLINE_SIZE (int64_t(2) << 30)
+
+static std::string models_dir = "ncnn-models";
+static size_t model_cache = 4;
+
+// a net is loaded outside engines_lock, clients asking for it meanwhile wait on its future
+static std::mutex engines_lock;
+static std::list<EngineEntry> engines; // most recently used first
+
+static std::mutex jobs_lock;
+static std::condition_variable jobs_cv;
+static std::deque<Job*> jobs;
+
+// the spec comes from the socket, so it is checked as the filters check their arguments before anything is built from it
+static const char* check_spec(const RemoteSpec& spec)
+{
+    if (spec.gpu_id < 0 || spec.gpu_id >= ncnn::get_gpu_count())
+        return "invalid gpu_id";
+    if (spec.tta_mode != 0 && spec.tta_mode != 1 && spec.tta_mode != 2 && spec.tta_mode != 4 && spec.tta_mode != 8)
+        return "'tta_mode' must be 0, 1, 2, 4 or 8";
+    // precision=8 runs on the cpu of the vapoursynth process, the filters never send it
+    if (spec.precision != 0 && spec.precision != 16 && spec.precision != 32)
+        return "'precision' must be 0, 16 or 32";
+    if (spec.arithmetic != 0 && spec.arithmetic != 16 && spec.arithmetic != 32)
+        return "'arithmetic' must be 0, 16 or 32";
+    if ((spec.tile_w != 0 && spec.tile_w < 32) || (spec.tile_h != 0 && spec.tile_h < 32))
+        return "'tile_size' must be greater than or equal to 32";
+    if (spec.tile_w % 4 || spec.tile_h % 4)
+        return "'tile_size' must be multiple of 4";
+
+    if (spec.engine == REMOTE_ENGINE_WAIFU2X)
+    {
+        if (spec.noise < -1 || spec.noise > 3)
+            return "'noise' must be -1, 0, 1, 2, or 3";
+        if (spec.scale != 1 && spec.scale != 2)
+            return "'scale' must be 1 or 2";
+        if (spec.scale == 1 && spec.noise == -1)
+            return "use 'noise=-1' and 'scale=1' at same time is useless";
+        // 28 is cunet at scale 1, 18 cunet at scale 2 and 7 the upconv models
+        if (spec.scale == 1 && spec.prepadding != 28)
+            return "only cunet model support 'scale=1'";
+        if (spec.scale == 2 && spec.prepadding != 18 && spec.prepadding != 7)
+            return "invalid prepadding";
+    }
+    else if (spec.engine == REMOTE_ENGINE_REALESRGAN)
+    {
+        if (spec.scale != 4)
+            return "'scale' must be 4";
+        if (spec.prepadding != 10)
+            return "invalid prepadding";
+    }
+    else
+    {
+        return "unknown engine";
+    }
+
+    const size_t model_len = strnlen(spec.model, sizeof(spec.model));
+    const std::string model(spec.model, model_len);
+    if (model.empty() || model_len == sizeof(spec.model) || model[0] == '/' || model.find("..") != std::string::npos)
+        return "invalid model path";
+
+    return nullptr;
+}
+
+static std::shared_ptr<Engine> load_engine(const RemoteSpec& spec, const std::string& model, std::string& error)
+{
+    const std::string parampath = models_dir + "/" + model + ".param";
+    const std::string modelpath = models_dir + "/" + model + ".bin";
+    if (!modelFileExists(parampath) || !modelFileExists(modelpath))
+    {
+        error = "can't open model file " + model;
+        return nullptr;
+    }
+
+    const double heap_budget = ncnn::get_gpu_device(spec.gpu_id)->get_heap_budget();
+    const int num_threads = std::min(2, (int)ncnn::get_gpu_info(spec.gpu_id).compute_queue_count());
+
+    std::shared_ptr<Engine> engine = std::make_shared<Engine>();
+    engine->scale = spec.scale;
+
+    if (spec.engine == REMOTE_ENGINE_WAIFU2X)
+    {
+        const int tilesize = heap_budget > 900 ? 360 : heap_budget > 450 ? 240 : 180;
+
+        engine->waifu2x.reset(new Waifu2x(spec.gpu_id, num_threads, spec.tta_mode, spec.precision, spec.arithmetic));
+        engine->waifu2x->noise = spec.noise;
+        engine->waifu2x->scale = spec.scale;
+        engine->waifu2x->tilesize_w = spec.tile_w ? spec.tile_w : tilesize;
+        engine->waifu2x->tilesize_h = spec.tile_h ? spec.tile_h : tilesize;
+        engine->waifu2x->prepadding = spec.prepadding;
+        if (engine->waifu2x->load(parampath, modelpath))
+        {
+            error = "can't load model " + model;
+            return nullptr;
+        }
+    }
+    else if (spec.engine == REMOTE_ENGINE_REALESRGAN)
+    {
+        const int tilesize = heap_budget > 1900 ? 200 : heap_budget > 550 ? 100 : heap_budget > 190 ? 64 : 32;
+
+        engine->realesrgan.reset(new RealESRGAN(spec.gpu_id, num_threads, spec.tta_mode, spec.precision, spec.arithmetic));
+        engine->realesrgan->scale = spec.scale;
+        engine->realesrgan->tilesize = spec.tile_w ? spec.tile_w : tilesize;
+        engine->realesrgan->prepadding = spec.prepadding;
+        if (engine->realesrgan->load(parampath, modelpath))
+        {
+            error = "can't load model " + model;
+            return nullptr;
+        }
+    }
+
+    fprintf(stderr, "vsnvk-server: loaded %s\n", model.c_str());
+    return engine;
+}
+
+// nets are shared by every client asking for the same spec, so each model is on the device once
+// past model_cache of them the least recently used one is dropped, jobs still holding it finish first;
+// a failed load is not kept, the next request for it tries again
+static std::shared_ptr<Engine> get_engine(const RemoteSpec& spec, std::string& error)
+{
+    const std::string model(spec.model, strnlen(spec.model, sizeof(spec.model)));
+    const std::string key = std::string(reinterpret_cast<const char*>(&spec), offsetof(RemoteSpec, model)) + model;
+
+    std::promise<std::shared_ptr<Engine> > loading;
+    std::shared_future<std::shared_ptr<Engine> > future;
+    // the last reference to a net may be here, so it is destroyed after unlocking
+    std::list<EngineEntry> evicted;
+    {
+        std::lock_guard<std::mutex> lock(engines_lock);
+
+        auto it = std::find_if(engines.begin(), engines.end(), [&](const EngineEntry& entry) { return entry.key == key; });
+        if (it != engines.end())
+        {
+            engines.splice(engines.begin(), engines, it);
+            future = it->engine;
+        }
+        else
+        {
+            engines.push_front(EngineEntry{ key, loading.get_future().share() });
+            if (engines.size() > model_cache)
+                evicted.splice(evicted.end(), engines, std::prev(engines.end()));
+        }
+    }
+    evicted.clear();
+
+    if (future.valid())
+    {
+        std::shared_ptr<Engine> engine = future.get();
+        if (!engine)
+            error = "can't load model " + model;
+        return engine;
+    }
+
+    std::shared_ptr<Engine> engine = load_engine(spec, model, error);
+    if (!engine)
+    {
+        std::lock_guard<std::mutex> lock(engines_lock);
+        engines.remove_if([&](const EngineEntry& entry) { return entry.key == key; });
+    }
+    loading.set_value(engine);
+    return engine;
+}
+
+// jobs from all connections run in arrival order on a fixed number of gpu threads
+static void gpu_worker()
+{
+    for (;;)
+    {
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(jobs_lock);
+            jobs_cv.wait(lock, [] { return !jobs.empty(); });
+            job = jobs.front();
+            jobs.pop_front();
+        }
+
+        const int w = job->width;
+        const int h = job->height;
+        const int64_t in_plane = int64_t(w) * h;
+        const int64_t out_plane = in_plane * job->engine->scale * job->engine->scale;
+        const int out_stride = w * job->engine->scale;
+
+        int ret;
+        if (job->engine->waifu2x)
+            ret = job->engine->waifu2x->process(job->in, job->in + in_plane, job->in + in_plane * 2, job->out, job->out + out_plane, job->out + out_plane * 2, w, h, w, out_stride);
+        else
+            ret = job->engine->realesrgan->process(job->in, job->in + in_plane, job->in + in_plane * 2, job->out, job->out + out_plane, job->out + out_plane * 2, w, h, w, out_stride);
+
+        job->done.set_value(ret);
+    }
+}
+
+static void reply_error(int fd, const std::string& error)
+{
+    RemoteReply reply{};
+    reply.status = -1;
+    strncpy(reply.error, error.c_str(), sizeof(reply.error) - 1);
+    remoteSend(fd, &reply, sizeof(reply));
+}
+
+static void serve_connection(int fd)
+{
+    RemoteHello hello{};
+    if (!remoteRecv(fd, &hello, sizeof(hello)) || hello.magic != REMOTE_MAGIC || hello.version != REMOTE_VERSION)
+    {
+        reply_error(fd, "protocol version mismatch");
+        close(fd);
+        return;
+    }
+    hello.shm_name[sizeof(hello.shm_name) - 1] = '\0';
+
+    // no shared memory name means the client is on another machine and the planes come over the socket
+    const bool inline_data = hello.shm_name[0] == '\0';
+
+    // an inline buffer grows with the frames actually sent, the hello's size only bounds them
+    std::vector<unsigned char> buffer;
+    unsigned char* shm = nullptr;
+    bool accepted = false;
+    if (inline_data)
+    {
+        accepted = hello.shm_size > 0 && hello.shm_size <= REMOTE_MAX_INLINE_SIZE;
+    }
+    else if (hello.shm_size > 0)
+    {
+        // touching pages past the end of the object would kill the server with SIGBUS
+        int shm_fd = shm_open(hello.shm_name, O_RDWR, 0);
+        struct stat st;
+        if (shm_fd >= 0 && fstat(shm_fd, &st) == 0 && st.st_size >= hello.shm_size)
+        {
+            void* p = mmap(nullptr, hello.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+            if (p != MAP_FAILED)
+                shm = static_cast<unsigned char*>(p);
+        }
+        accepted = shm != nullptr;
+        if (shm_fd >= 0)
+            close(shm_fd);
+    }
+    if (!accepted)
+    {
+        reply_error(fd, inline_data ? "frame buffer too large" : "can't map shared memory");
+        close(fd);
+        return;
+    }
+
+    RemoteReply ok{};
+    bool alive = remoteSend(fd, &ok, sizeof(ok));
+
+    while (alive)
+    {
+        RemoteRequest request;
+        if (!remoteRecv(fd, &request, sizeof(request)))
+            break;
+
+        const char* spec_error = check_spec(request.spec);
+        if (spec_error)
+        {
+            // nothing sized from a bad spec is trusted, so an inline payload isn't skipped and the stream is lost
+            reply_error(fd, spec_error);
+            if (inline_data)
+                break;
+            continue;
+        }
+
+        const int64_t in_size = int64_t(request.width) * request.height * 3 * sizeof(float);
+        const int64_t out_size = in_size * request.spec.scale * request.spec.scale;
+
+        if (request.width <= 0 || request.height <= 0 || request.spec.scale < 1 || in_size + out_size > hello.shm_size)
+        {
+            // an inline payload that does not fit can't be skipped, the stream is lost
+            reply_error(fd, "frame does not fit the shared memory");
+            if (inline_data)
+                break;
+            continue;
+        }
+
+        if (inline_data)
+        {
+            if (buffer.size() < size_t(in_size + out_size))
+                buffer.resize(in_size + out_size);
+            shm = buffer.data();
+            if (!remoteRecv(fd, shm, in_size))
+                break;
+        }
+
+        std::string error;
+        std::shared_ptr<Engine> engine = get_engine(request.spec, error);
+
+        if (!engine)
+        {
+            reply_error(fd, error);
+            continue;
+        }
+
+        Job job;
+        job.engine = engine;
+        job.width = request.width;
+        job.height = request.height;
+        job.in = reinterpret_cast<const float*>(shm);
+        job.out = reinterpret_cast<float*>(shm + in_size);
+        std::future<int> done = job.done.get_future();
+        {
+            std::lock_guard<std::mutex> lock(jobs_lock);
+            jobs.push_back(&job);
+        }
+        jobs_cv.notify_one();
+
+        if (done.get() != 0)
+        {
+            reply_error(fd, "processing failed");
+            continue;
+        }
+
+        RemoteReply reply{};
+        alive = remoteSend(fd, &reply, sizeof(reply)) && (!inline_data || remoteSend(fd, shm + in_size, out_size));
+    }
+
+    if (!inline_data)
+        munmap(shm, hello.shm_size);
+    close(fd);
+}
+
+static void accept_loop(int listen_fd, bool tcp)
+{
+    for (;;)
+    {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (tcp)
+        {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        std::thread(serve_connection, fd).detach();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string socket_path = "/tmp/vsnvk.sock";
+    int tcp_port = 0;
+    std::string bind_address = "127.0.0.1";
+    int gpu_threads = 2;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+            socket_path = argv[i + 1];
+        else if (strcmp(argv[i], "-t") == 0)
+            tcp_port = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-b") == 0)
+            bind_address = argv[i + 1];
+        else if (strcmp(argv[i], "-m") == 0)
+            models_dir = argv[i + 1];
+        else if (strcmp(argv[i], "-j") == 0)
+            gpu_threads = std::max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "-c") == 0)
+            model_cache = std::max(1, atoi(argv[i + 1]));
+        else
+        {
+            fprintf(stderr, "usage: %s [-s socket_path] [-t tcp_port] [-b bind_address] [-m models_dir] [-j gpu_threads] [-c model_cache]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (ncnn::create_gpu_instance() != 0)
+    {
+        fprintf(stderr, "vsnvk-server: create gpu instance failed\n");
+        return 1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || listen(listen_fd, 64))
+    {
+        fprintf(stderr, "vsnvk-server: can't listen on %s: %s\n", socket_path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    // a tcp port lets other machines use this device as a worker; clients aren't authenticated,
+    // so it only listens on the loopback interface unless another address is given
+    int tcp_fd = -1;
+    if (tcp_port > 0)
+    {
+        sockaddr_in tcp_addr{};
+        tcp_addr.sin_family = AF_INET;
+        tcp_addr.sin_port = htons(tcp_port);
+        if (inet_pton(AF_INET, bind_address.c_str(), &tcp_addr.sin_addr) != 1)
+        {
+            fprintf(stderr, "vsnvk-server: invalid bind address %s\n", bind_address.c_str());
+            return 1;
+        }
+        int one = 1;
+        tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (tcp_fd >= 0)
+            setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (tcp_fd < 0 || bind(tcp_fd, reinterpret_cast<sockaddr*>(&tcp_addr), sizeof(tcp_addr)) || listen(tcp_fd, 64))
+        {
+            fprintf(stderr, "vsnvk-server: can't listen on %s:%d: %s\n", bind_address.c_str(), tcp_port, strerror(errno));
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < gpu_threads; i++)
+        std::thread(gpu_worker).detach();
+
+    fprintf(stderr, "vsnvk-server: listening on %s\n", socket_path.c_str());
+
+    if (tcp_fd >= 0)
+    {
+        fprintf(stderr, "vsnvk-server: listening on %s:%d\n", bind_address.c_str(), tcp_port);
+        std::thread(accept_loop, tcp_fd, true).detach();
+    }
+
+    accept_loop(listen_fd, false);
+
+    close(listen_fd);
+    if (tcp_fd >= 0)
+        close(tcp_fd);
+    ncnn::destroy_gpu_instance();
+    return 0;
+}
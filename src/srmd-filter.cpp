@@ -0,0 +1,262 @@
+/*
+  MIT License
+
+  Copyright (c) 2018-2019 HolyWu
+  Copyright (c) 2019-2020 NaLan ZeYu
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <algorithm>
+#include <future>
+
+#include "filter-common.hpp"
+#include "model-file.hpp"
+#include "srmd-filter.hpp"
+#include "gpu.h"
+#include "srmd.hpp"
+#include "vsplugin.hpp"
+
+typedef struct {
+    VSNodeRef *node;
+    VSVideoInfo vi;
+    SRMD *srmd;
+    std::shared_future<int> loaded; // load runs in the background from create
+    Lookahead lookahead;
+} SRMDFilterData;
+
+static int SRMDFilter(const VSFrameRef *src, VSFrameRef *dst, SRMDFilterData * const VS_RESTRICT d, const VSAPI *vsapi) noexcept {
+    const int width = vsapi->getFrameWidth(src, 0);
+    const int height = vsapi->getFrameHeight(src, 0);
+    const int srcStride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
+    const int dstStride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
+    auto *             srcR = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0));
+    auto *             srcG = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1));
+    auto *             srcB = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2));
+    auto * VS_RESTRICT dstR = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0));
+    auto * VS_RESTRICT dstG = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1));
+    auto * VS_RESTRICT dstB = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2));
+    if (d->loaded.get())
+        return -1;
+
+    // a per-frame noise level only changes an input channel, so the loaded weights serve it as well
+    int err;
+    int noise = d->srmd->noise;
+    if (noise != -1) {
+        int frameNoise = int64ToIntS(vsapi->propGetInt(vsapi->getFramePropsRO(src), "NcnnNoise", 0, &err));
+        if (!err) {
+            if (frameNoise < 0 || frameNoise > 10)
+                return 1;
+            noise = frameNoise;
+        }
+    }
+
+    const int reductions = d->srmd->tile_reductions();
+    const int ret = d->srmd->process(srcR, srcG, srcB, dstR, dstG, dstB, noise, width, height, srcStride, dstStride);
+    logTileReduction("SRMD-NCNN-Vulkan", reductions, d->srmd->tile_reductions(), d->srmd->current_tilesize_w(), d->srmd->current_tilesize_h(), vsapi);
+    return ret;
+}
+
+static void VS_CC SRMDFilterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<SRMDFilterData *>(*instanceData);
+    vsapi->setVideoInfo(&d->vi, 1, node);
+}
+
+static const VSFrameRef *VS_CC SRMDFilterGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<SRMDFilterData *>(*instanceData);
+
+    const VSFrameRef *src = nullptr;
+    if (activationReason == arInitial) {
+        d->lookahead.prefetch(n, d->node, d->vi.numFrames, vsapi);
+        // a frame the lookahead already fetched isn't requested again and runs right away
+        src = d->lookahead.take(n);
+        if (!src) {
+            vsapi->requestFrameFilter(n, d->node, frameCtx);
+            return nullptr;
+        }
+    } else if (activationReason == arAllFramesReady) {
+        src = vsapi->getFrameFilter(n, d->node, frameCtx);
+    } else {
+        return nullptr;
+    }
+
+    VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
+    int err = SRMDFilter(src, dst, d, vsapi);
+    vsapi->freeFrame(src);
+    if (err > 0) {
+        vsapi->freeFrame(dst);
+        vsapi->setFilterError("SRMD-NCNN-Vulkan: SRMD filter error, 'NcnnNoise' must be between 0 and 10.", frameCtx);
+    } else if (err) {
+        vsapi->freeFrame(dst);
+        vsapi->setFilterError("SRMD-NCNN-Vulkan: SRMD filter error.", frameCtx);
+    } else {
+        return dst;
+    }
+    return nullptr;
+}
+
+static void VS_CC SRMDFilterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<SRMDFilterData *>(instanceData);
+    vsapi->freeNode(d->node);
+    d->loaded.wait();
+    delete d->srmd;
+    delete d;
+    tryDestoryGpuInstance();
+}
+
+void VS_CC SRMDFilterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    SRMDFilterData d{};
+    d.node = vsapi->propGetNode(in, "clip", 0, nullptr);
+    d.vi = *vsapi->getVideoInfo(d.node);
+
+    int gpuId, ttaMode, noise, scale, tileSizeW, tileSizeH, gpuThread;
+    std::string paramPath, modelPath;
+    char const * err_prompt = nullptr;
+    do {
+        int err;
+
+        err = tryCreateGpuInstance();
+        if (err) {
+            err_prompt = "create gpu instance failed";
+            break;
+        }
+
+        if (!isConstantFormat(&d.vi) || d.vi.format->colorFamily != cmRGB || d.vi.format->sampleType != stFloat || d.vi.format->bitsPerSample != 32) {
+            err_prompt = "only constant RGB format and 32 bit float input supported";
+            break;
+        }
+
+        gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", 0, &err));
+        if (gpuId < 0 || gpuId >= ncnn::get_gpu_count()) {
+            err_prompt = "invalid 'gpu_id'";
+            break;
+        }
+
+        ttaMode = int64ToIntS(vsapi->propGetInt(in, "tta_mode", 0, &err));
+        if (ttaMode != 0 && ttaMode != 1 && ttaMode != 2 && ttaMode != 4 && ttaMode != 8) {
+            err_prompt = "'tta_mode' must be 0, 1, 2, 4 or 8";
+            break;
+        }
+
+        d.lookahead.frames = int64ToIntS(vsapi->propGetInt(in, "lookahead", 0, &err));
+        if (d.lookahead.frames < 0) {
+            err_prompt = "'lookahead' must be greater than or equal to 0";
+            break;
+        }
+
+        noise = int64ToIntS(vsapi->propGetInt(in, "noise", 0, &err));
+        if (err)
+            noise = 3;
+        if (noise < -1 || noise > 10) {
+            err_prompt = "'noise' must be between -1 and 10";
+            break;
+        }
+
+        scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
+        if (err)
+            scale = 2;
+        if (scale < 2 || scale > 4) {
+            err_prompt = "'scale' must be 2, 3 or 4";
+            break;
+        }
+
+        int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
+        if (customGpuThread > 0) {
+            gpuThread = customGpuThread;
+        }
+        else {
+            gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
+        }
+        gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
+
+        int tileSize = int64ToIntS(vsapi->propGetInt(in, "tile_size", 0, &err));
+        if (err || tileSize == 0) {
+            double heap_budget = ncnn::get_gpu_device(gpuId)->get_heap_budget(); // in MByte
+            if (heap_budget > 2600)
+                tileSize = 400;
+            else if (heap_budget > 740)
+                tileSize = 200;
+            else if (heap_budget > 250)
+                tileSize = 100;
+            else
+                tileSize = 32;
+        }
+        if (tileSize < 32) {
+            err_prompt = "'tile_size' must be greater than or equal to 32";
+            break;
+        }
+        if (tileSize % 4) {
+            err_prompt = "'tile_size' must be multiple of 4";
+            break;
+        }
+        tileSizeW = tileSizeH = tileSize;
+
+        // set model path
+        const std::string pluginFilePath{ vsapi->getPluginPath(vsapi->getPluginById(VSPLUGIN_IDENTIFIER_STR, core)) };
+        const std::string pluginDir = pluginFilePath.substr(0, pluginFilePath.find_last_of('/'));
+
+        std::string modelsDir = pluginDir + "/ncnn-models/SRMD/";
+
+        std::string modelName;
+        if (noise == -1)
+            modelName = "srmdnf_x" + std::to_string(scale);
+        else
+            modelName = "srmd_x" + std::to_string(scale);
+
+        paramPath = modelsDir + modelName + ".param";
+        modelPath = modelsDir + modelName + ".bin";
+
+        // check model file readable
+        if (!modelFileExists(paramPath) || !modelFileExists(modelPath)) {
+            err_prompt = "can't open model file";
+            break;
+        }
+
+        break;
+    } while (false);
+
+    if (err_prompt) {
+        vsapi->setError(out, (std::string{"SRMD-NCNN-Vulkan: "} + err_prompt).c_str());
+        vsapi->freeNode(d.node);
+        tryDestoryGpuInstance();
+        return;
+    }
+
+    int prepadding = 12;
+
+    d.srmd = new SRMD(gpuId, gpuThread, ttaMode);
+    d.srmd->noise = noise;
+    d.srmd->scale = scale;
+    d.srmd->tilesize_w = tileSizeW;
+    d.srmd->tilesize_h = tileSizeH;
+    d.srmd->prepadding = prepadding;
+    d.srmd->strip_workers = stripWorkers(gpuId, gpuThread);
+
+    SRMD *srmd = d.srmd;
+    d.loaded = loadInBackground([=]() {
+        return srmd->load(paramPath, modelPath);
+    });
+
+    d.vi.width *= scale;
+    d.vi.height *= scale;
+
+    auto *data = new SRMDFilterData{ d };
+
+    vsapi->createFilter(in, out, "SRMD", SRMDFilterInit, SRMDFilterGetFrame, SRMDFilterFree, fmParallel, 0, data, core);
+}
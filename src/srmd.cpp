@@ -0,0 +1,390 @@
+// srmd implemented with ncnn library
+
+#include <vector>
+#include <algorithm>
+
+#include "srmd.hpp"
+
+static const uint32_t srmd_preproc_spv_data[] = {
+    #include "srmd_preproc.spv.hex.h"
+};
+static const uint32_t srmd_preproc_fp16s_spv_data[] = {
+    #include "srmd_preproc_fp16s.spv.hex.h"
+};
+static const uint32_t srmd_preproc_int8s_spv_data[] = {
+    #include "srmd_preproc_int8s.spv.hex.h"
+};
+static const uint32_t srmd_postproc_spv_data[] = {
+    #include "srmd_postproc.spv.hex.h"
+};
+static const uint32_t srmd_postproc_fp16s_spv_data[] = {
+    #include "srmd_postproc_fp16s.spv.hex.h"
+};
+static const uint32_t srmd_postproc_int8s_spv_data[] = {
+    #include "srmd_postproc_int8s.spv.hex.h"
+};
+
+static const uint32_t srmd_preproc_tta_spv_data[] = {
+    #include "srmd_preproc_tta.spv.hex.h"
+};
+static const uint32_t srmd_preproc_tta_fp16s_spv_data[] = {
+    #include "srmd_preproc_tta_fp16s.spv.hex.h"
+};
+static const uint32_t srmd_preproc_tta_int8s_spv_data[] = {
+    #include "srmd_preproc_tta_int8s.spv.hex.h"
+};
+static const uint32_t srmd_postproc_tta_spv_data[] = {
+    #include "srmd_postproc_tta.spv.hex.h"
+};
+static const uint32_t srmd_postproc_tta_fp16s_spv_data[] = {
+    #include "srmd_postproc_tta_fp16s.spv.hex.h"
+};
+static const uint32_t srmd_postproc_tta_int8s_spv_data[] = {
+    #include "srmd_postproc_tta_int8s.spv.hex.h"
+};
+
+SRMD::SRMD(int gpuid, int num_threads, int tta_mode)
+{
+    _net.opt.use_vulkan_compute = true;
+    _net.opt.use_fp16_packed = true;
+    _net.opt.use_fp16_storage = true;
+    _net.opt.use_fp16_arithmetic = false;
+    _net.opt.use_int8_storage = false;
+    _net.opt.use_int8_arithmetic = false;
+    _net.opt.num_threads = num_threads;
+
+    // tta_mode 1 keeps the original meaning of all 8 augmentations
+    _tta_count = tta_mode == 1 ? 8 : std::max(tta_mode, 1);
+    _tile_shift = 0;
+    strip_workers = 1;
+    _preproc = nullptr;
+    _postproc = nullptr;
+
+    _net.set_vulkan_device(gpuid);
+}
+
+SRMD::~SRMD()
+{
+    // cleanup preprocess and postprocess pipeline
+    if (_preproc) delete _preproc;
+    if (_postproc) delete _postproc;
+}
+
+int SRMD::load(const std::string& parampath, const std::string& modelpath)
+{
+    if (loadNet(_net, parampath, modelpath, _weights))
+        return -1;
+
+    // initialize preprocess and postprocess pipeline
+    {
+        std::vector<ncnn::vk_specialization_type> specializations(1);
+#if _WIN32
+        specializations[0].i = 1;
+#else
+        specializations[0].i = 0;
+#endif
+
+        std::vector<ncnn::vk_specialization_type> tta_specializations(2);
+        tta_specializations[0] = specializations[0];
+        tta_specializations[1].i = _tta_count;
+
+        _preproc = new ncnn::Pipeline(_net.vulkan_device());
+        _preproc->set_optimal_local_size_xyz(32, 32, 3);
+
+        _postproc = new ncnn::Pipeline(_net.vulkan_device());
+        _postproc->set_optimal_local_size_xyz(32, 32, 3);
+
+        if (_tta_count > 1)
+        {
+            if (_net.opt.use_fp16_storage && _net.opt.use_int8_storage)
+                _preproc->create(srmd_preproc_tta_int8s_spv_data, sizeof(srmd_preproc_tta_int8s_spv_data), tta_specializations);
+            else if (_net.opt.use_fp16_storage)
+                _preproc->create(srmd_preproc_tta_fp16s_spv_data, sizeof(srmd_preproc_tta_fp16s_spv_data), tta_specializations);
+            else
+                _preproc->create(srmd_preproc_tta_spv_data, sizeof(srmd_preproc_tta_spv_data), tta_specializations);
+
+            if (_net.opt.use_fp16_storage && _net.opt.use_int8_storage)
+                _postproc->create(srmd_postproc_tta_int8s_spv_data, sizeof(srmd_postproc_tta_int8s_spv_data), tta_specializations);
+            else if (_net.opt.use_fp16_storage)
+                _postproc->create(srmd_postproc_tta_fp16s_spv_data, sizeof(srmd_postproc_tta_fp16s_spv_data), tta_specializations);
+            else
+                _postproc->create(srmd_postproc_tta_spv_data, sizeof(srmd_postproc_tta_spv_data), tta_specializations);
+        }
+        else
+        {
+            if (_net.opt.use_fp16_storage && _net.opt.use_int8_storage)
+                _preproc->create(srmd_preproc_int8s_spv_data, sizeof(srmd_preproc_int8s_spv_data), specializations);
+            else if (_net.opt.use_fp16_storage)
+                _preproc->create(srmd_preproc_fp16s_spv_data, sizeof(srmd_preproc_fp16s_spv_data), specializations);
+            else
+                _preproc->create(srmd_preproc_spv_data, sizeof(srmd_preproc_spv_data), specializations);
+
+            if (_net.opt.use_fp16_storage && _net.opt.use_int8_storage)
+                _postproc->create(srmd_postproc_int8s_spv_data, sizeof(srmd_postproc_int8s_spv_data), specializations);
+            else if (_net.opt.use_fp16_storage)
+                _postproc->create(srmd_postproc_fp16s_spv_data, sizeof(srmd_postproc_fp16s_spv_data), specializations);
+            else
+                _postproc->create(srmd_postproc_spv_data, sizeof(srmd_postproc_spv_data), specializations);
+        }
+    }
+
+    return 0;
+}
+
+int SRMD::process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int noise_level, int w, int h, int src_stride, int dst_stride) const
+{
+    const StripFrame frame = { srcpR, srcpG, srcpB, nullptr, dstpR, dstpG, dstpB, nullptr, w, h, src_stride, dst_stride, nullptr, 0 };
+    return processShrinkingTiles(_tile_shift, tilesize_w, tilesize_h, w, h, [&](int tile_w, int tile_h, const TileRegion& region, FailedRegions& failed) {
+        return processStrips(_net.vulkan_device(), _net.opt, nullptr, scale, prepadding, strip_workers, frame, region, tile_w, tile_h,
+            [&](const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, const unsigned char*) {
+                return process_gpu_with_tile(in_gpu, x0, y0, width, height, out_gpu, noise_level, cmd, blob_vkallocator, staging_vkallocator, tile_w, tile_h);
+            }, failed);
+    });
+}
+
+int SRMD::process_gpu(const ncnn::VkMat& in_gpu, int x0, int y0, int w, int h, ncnn::VkMat& out_gpu, int noise_level, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator) const
+{
+    const int shift = _tile_shift;
+    return process_gpu_with_tile(in_gpu, x0, y0, w, h, out_gpu, noise_level, cmd, blob_vkallocator, staging_vkallocator, reducedTilesize(tilesize_w, shift), reducedTilesize(tilesize_h, shift));
+}
+
+int SRMD::process_gpu_with_tile(const ncnn::VkMat& in_gpu, int x0, int y0, int w, int h, ncnn::VkMat& out_gpu, int noise_level, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, int tile_w, int tile_h) const
+{
+    const int channels = 3;
+
+    const int TILE_SIZE_W = tile_w;
+    const int TILE_SIZE_H = tile_h;
+
+    const int xtiles = (w + TILE_SIZE_W - 1) / TILE_SIZE_W;
+    const int ytiles = (h + TILE_SIZE_H - 1) / TILE_SIZE_H;
+
+    const size_t in_out_tile_elemsize = _net.opt.use_fp16_storage ? 2u : 4u;
+
+    int ret = 0;
+
+    // the noise-free net has no noise level map, only rgb and the 15 degradation channels
+    const int in_tile_channels = noise == -1 ? 18 : 19;
+
+    const TtaExtractor tta(_net, _tta_count);
+
+    for (int yi = 0; yi < ytiles; yi++)
+    {
+        const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_H, h) - yi * TILE_SIZE_H;
+
+        // output rows are addressed through offset_x, the postproc shaders index top_blob linearly
+        const int out_tile_y0 = yi * TILE_SIZE_H * scale;
+        const int out_tile_h = tile_h_nopad * scale;
+
+        for (int xi = 0; xi < xtiles; xi++)
+        {
+            const int out_tile_x0 = xi * TILE_SIZE_W * scale;
+            const int out_tile_w = std::min(TILE_SIZE_W * scale, out_gpu.w - out_tile_x0);
+
+            if (_tta_count > 1)
+            {
+                // preproc
+                ncnn::VkMat in_tile_gpu[8];
+                {
+                    // crop tile
+                    int tile_x0 = xi * TILE_SIZE_W - prepadding;
+                    int tile_x1 = std::min((xi + 1) * TILE_SIZE_W, w) + prepadding;
+                    int tile_y0 = yi * TILE_SIZE_H - prepadding;
+                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_H, h) + prepadding;
+
+                    for (int ti = 0; ti < _tta_count; ti++)
+                    {
+                        // augmentations 4-7 are transposed
+                        if (ti < 4)
+                            in_tile_gpu[ti].create(tile_x1 - tile_x0, tile_y1 - tile_y0, in_tile_channels, in_out_tile_elemsize, 1, blob_vkallocator);
+                        else
+                            in_tile_gpu[ti].create(tile_y1 - tile_y0, tile_x1 - tile_x0, in_tile_channels, in_out_tile_elemsize, 1, blob_vkallocator);
+                    }
+                    for (int ti = 0; ti < _tta_count; ti++)
+                    {
+                        if (in_tile_gpu[ti].empty())
+                            ret = TILE_OUT_OF_MEMORY;
+                    }
+                    if (ret != 0)
+                        break;
+
+                    std::vector<ncnn::VkMat> bindings(9);
+                    bindings[0] = in_gpu;
+                    bindings[1] = in_tile_gpu[0];
+                    bindings[2] = in_tile_gpu[1];
+                    bindings[3] = in_tile_gpu[2];
+                    bindings[4] = in_tile_gpu[3];
+                    bindings[5] = in_tile_gpu[4];
+                    bindings[6] = in_tile_gpu[5];
+                    bindings[7] = in_tile_gpu[6];
+                    bindings[8] = in_tile_gpu[7];
+
+                    std::vector<ncnn::vk_constant_type> constants(12);
+                    constants[0].i = in_gpu.w;
+                    constants[1].i = in_gpu.h;
+                    constants[2].i = in_gpu.cstep;
+                    constants[3].i = in_tile_gpu[0].w;
+                    constants[4].i = in_tile_gpu[0].h;
+                    constants[5].i = in_tile_gpu[0].cstep;
+                    constants[6].i = prepadding;
+                    constants[7].i = prepadding;
+                    constants[8].i = x0 + xi * TILE_SIZE_W;
+                    constants[9].i = y0 + yi * TILE_SIZE_H;
+                    constants[10].i = noise_level;
+                    constants[11].i = channels;
+
+                    ncnn::VkMat dispatcher;
+                    dispatcher.w = in_tile_gpu[0].w;
+                    dispatcher.h = in_tile_gpu[0].h;
+                    dispatcher.c = in_tile_channels;
+
+                    cmd.record_pipeline(_preproc, bindings, constants, dispatcher);
+                }
+
+                // srmd
+                ncnn::VkMat out_tile_gpu[8];
+                ret = tta.extract("input", "output", in_tile_gpu, out_tile_gpu, cmd, blob_vkallocator, staging_vkallocator);
+
+                if (ret != 0)
+                    break;
+
+                // postproc
+                {
+                    std::vector<ncnn::VkMat> bindings(9);
+                    bindings[0] = out_tile_gpu[0];
+                    bindings[1] = out_tile_gpu[1];
+                    bindings[2] = out_tile_gpu[2];
+                    bindings[3] = out_tile_gpu[3];
+                    bindings[4] = out_tile_gpu[4];
+                    bindings[5] = out_tile_gpu[5];
+                    bindings[6] = out_tile_gpu[6];
+                    bindings[7] = out_tile_gpu[7];
+                    bindings[8] = out_gpu;
+
+                    std::vector<ncnn::vk_constant_type> constants(11);
+                    constants[0].i = out_tile_gpu[0].w;
+                    constants[1].i = out_tile_gpu[0].h;
+                    constants[2].i = out_tile_gpu[0].cstep;
+                    constants[3].i = out_gpu.w;
+                    constants[4].i = out_tile_h;
+                    constants[5].i = out_gpu.cstep;
+                    constants[6].i = out_tile_y0 * out_gpu.w + out_tile_x0;
+                    constants[7].i = out_tile_w;
+                    constants[8].i = prepadding * scale;
+                    constants[9].i = prepadding * scale;
+                    constants[10].i = channels;
+
+                    ncnn::VkMat dispatcher;
+                    dispatcher.w = out_tile_w;
+                    dispatcher.h = out_tile_h;
+                    dispatcher.c = channels;
+
+                    cmd.record_pipeline(_postproc, bindings, constants, dispatcher);
+                }
+            }
+            else
+            {
+                // preproc
+                ncnn::VkMat in_tile_gpu;
+                {
+                    // crop tile
+                    int tile_x0 = xi * TILE_SIZE_W - prepadding;
+                    int tile_x1 = std::min((xi + 1) * TILE_SIZE_W, w) + prepadding;
+                    int tile_y0 = yi * TILE_SIZE_H - prepadding;
+                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_H, h) + prepadding;
+
+                    in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, in_tile_channels, in_out_tile_elemsize, 1, blob_vkallocator);
+                    if (in_tile_gpu.empty())
+                    {
+                        ret = TILE_OUT_OF_MEMORY;
+                        break;
+                    }
+
+                    std::vector<ncnn::VkMat> bindings(2);
+                    bindings[0] = in_gpu;
+                    bindings[1] = in_tile_gpu;
+
+                    std::vector<ncnn::vk_constant_type> constants(12);
+                    constants[0].i = in_gpu.w;
+                    constants[1].i = in_gpu.h;
+                    constants[2].i = in_gpu.cstep;
+                    constants[3].i = in_tile_gpu.w;
+                    constants[4].i = in_tile_gpu.h;
+                    constants[5].i = in_tile_gpu.cstep;
+                    constants[6].i = prepadding;
+                    constants[7].i = prepadding;
+                    constants[8].i = x0 + xi * TILE_SIZE_W;
+                    constants[9].i = y0 + yi * TILE_SIZE_H;
+                    constants[10].i = noise_level;
+                    constants[11].i = channels;
+
+                    ncnn::VkMat dispatcher;
+                    dispatcher.w = in_tile_gpu.w;
+                    dispatcher.h = in_tile_gpu.h;
+                    dispatcher.c = in_tile_channels;
+
+                    cmd.record_pipeline(_preproc, bindings, constants, dispatcher);
+                }
+
+                // srmd
+                ncnn::VkMat out_tile_gpu;
+                {
+                    ncnn::Extractor ex = _net.create_extractor();
+
+                    ex.set_blob_vkallocator(blob_vkallocator);
+                    ex.set_workspace_vkallocator(blob_vkallocator);
+                    ex.set_staging_vkallocator(staging_vkallocator);
+
+                    ex.input("input", in_tile_gpu);
+
+                    ret = ex.extract("output", out_tile_gpu, cmd);
+                }
+
+                if (ret != 0)
+                    break;
+
+                // postproc
+                {
+                    std::vector<ncnn::VkMat> bindings(2);
+                    bindings[0] = out_tile_gpu;
+                    bindings[1] = out_gpu;
+
+                    std::vector<ncnn::vk_constant_type> constants(11);
+                    constants[0].i = out_tile_gpu.w;
+                    constants[1].i = out_tile_gpu.h;
+                    constants[2].i = out_tile_gpu.cstep;
+                    constants[3].i = out_gpu.w;
+                    constants[4].i = out_tile_h;
+                    constants[5].i = out_gpu.cstep;
+                    constants[6].i = out_tile_y0 * out_gpu.w + out_tile_x0;
+                    constants[7].i = out_tile_w;
+                    constants[8].i = prepadding * scale;
+                    constants[9].i = prepadding * scale;
+                    constants[10].i = channels;
+
+                    ncnn::VkMat dispatcher;
+                    dispatcher.w = out_tile_w;
+                    dispatcher.h = out_tile_h;
+                    dispatcher.c = channels;
+
+                    cmd.record_pipeline(_postproc, bindings, constants, dispatcher);
+                }
+            }
+
+            // tiles from the worker allocators must be consumed before they are reclaimed
+            if (xtiles * ytiles > 1 || tta.parallel())
+            {
+                if (cmd.submit_and_wait() != 0 && ret == 0)
+                    ret = -1;
+                cmd.reset();
+            }
+
+            if (ret != 0)
+                break;
+        }
+
+        if (ret != 0)
+            break;
+    }
+
+    return ret;
+}
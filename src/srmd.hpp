@@ -0,0 +1,64 @@
+// srmd implemented with ncnn library
+
+#ifndef SRMD_HPP
+#define SRMD_HPP
+
+#include <string>
+#include <atomic>
+
+// ncnn
+#include "net.h"
+#include "gpu.h"
+#include "layer.h"
+
+#include "model-file.hpp"
+#include "tile-process.hpp"
+
+class SRMD
+{
+public:
+    SRMD(int gpuid, int num_threads = 1, int tta_mode = 0);
+    ~SRMD();
+
+    int load(const std::string& parampath, const std::string& modelpath);
+
+    // noise_level is fed to the net as an input channel, any level from 0 to 10 works with the same weights
+    // a strip that fails for lack of device memory is retried with smaller tiles, which are kept from then on
+    int process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int noise_level, int width, int height, int src_stride, int dst_stride) const;
+
+    // run the network over the width x height region at (x0, y0) of in_gpu, which holds 0-255 planar rgb
+    // the upscaled region is written to out_gpu, which must be width * scale by height * scale
+    int process_gpu(const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, int noise_level, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator) const;
+
+    const ncnn::VulkanDevice* vulkan_device() const { return _net.vulkan_device(); }
+
+    // tile size in use, smaller than the configured one after running out of device memory
+    int current_tilesize_w() const { return reducedTilesize(tilesize_w, _tile_shift); }
+    int current_tilesize_h() const { return reducedTilesize(tilesize_h, _tile_shift); }
+    // how many times the tiles were halved
+    int tile_reductions() const { return _tile_shift; }
+
+public:
+    // -1 selects the noise-free net, which takes no noise level
+    int noise;
+    int scale;
+    int tilesize_w;
+    int tilesize_h;
+    int prepadding;
+
+    // strips of one frame run on up to this many compute queues at once, 1 keeps them in order on one
+    int strip_workers;
+
+private:
+    int process_gpu_with_tile(const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, int noise_level, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, int tile_w, int tile_h) const;
+
+    // declared before the net, which may still reference the mapped weights while it is destroyed
+    ModelFile _weights;
+    ncnn::Net _net;
+    ncnn::Pipeline* _preproc;
+    ncnn::Pipeline* _postproc;
+    int _tta_count;
+    mutable std::atomic<int> _tile_shift;
+};
+
+#endif // SRMD_HPP
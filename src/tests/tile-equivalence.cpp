@@ -0,0 +1,799 @@
+// tile-equivalence: run small synthetic nets through Waifu2x, RealESRGAN and the cpu tiles with many tile sizes, frame sizes,
+// tta modes and strip workers, and check every output against the same net over the whole frame
+// usage: tile-equivalence work_dir [timings.txt [baseline.txt]]
+//
+// the reference is the cpu net run by an extractor over the whole frame, padded as the engines' shaders pad it; tta outputs
+// and alpha are checked against the same engine run as one tile. the time of every configuration is written to timings.txt,
+// and a configuration more than 1.5 times slower than in baseline.txt fails
+// batches are checked by packing frames into a mosaic as the filters do and comparing each frame with the frame run alone,
+// strips cut into narrow groups of tile columns against the cpu reference, and a Chain against its stages run one after another
+// exits with 77 after the cpu checks when there is no vulkan device, lavapipe is enough
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <vapoursynth/VapourSynth.h>
+#include <vapoursynth/VSHelper.h>
+
+#include "net.h"
+#include "gpu.h"
+#include "filter-common.hpp"
+#include "tile-process.hpp"
+#include "waifu2x.hpp"
+#include "real-esrgan.hpp"
+#include "chain.hpp"
+
+#define SKIP_RETURN_CODE 77
+
+struct NetCase
+{
+    const char* name;
+    bool realesrgan;
+    int scale;
+    int prepadding;
+    const char* input;
+    const char* output;
+    // the right and bottom padding round the frame up to a multiple of this
+    int align;
+
+    // how processCpuTiles pads and crops the tiles of this net
+    CpuTileLayout layout() const
+    {
+        const CpuTileLayout layout = { input, output, realesrgan, align, realesrgan };
+        return layout;
+    }
+};
+
+// waifu2x nets repeat the edge pixels and shrink the padded tile by the padding, realesrgan nets mirror the frame
+// and keep the size of the tile, the padding being cropped off; both reach 2 pixels around every output pixel
+static const NetCase net_cases[] = {
+    { "waifu2x-1x", false, 1, 2, "Input1", "Eltwise4", 4 },
+    { "waifu2x-2x", false, 2, 2, "Input1", "Eltwise4", 2 },
+    { "realesrgan-2x", true, 2, 4, "data", "output", 1 },
+};
+
+// none of them a multiple of the tiles
+static const int frame_sizes[][2] = { { 67, 45 }, { 96, 64 }, { 33, 101 } };
+
+// larger than every frame, so the frame is one tile
+static const int whole_tile = 200;
+
+// the frames of a batch, small enough for several to share a tile
+static const int mosaic_frames = 3;
+static const int mosaic_size[2] = { 37, 29 };
+
+struct Planes
+{
+    int width;
+    int height;
+    std::vector<float> data;
+
+    Planes(int w, int h) : width(w), height(h), data(size_t(w) * h * 4) {}
+
+    // r, g, b, then alpha
+    float* plane(int c) { return data.data() + size_t(width) * height * c; }
+    const float* plane(int c) const { return data.data() + size_t(width) * height * c; }
+};
+
+static int failures = 0;
+static std::vector<std::pair<std::string, double> > timings;
+
+static uint32_t seed = 1;
+
+static float random_float(float lo, float hi)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return lo + (hi - lo) * (seed >> 8) / 16777216.f;
+}
+
+static void fail(const std::string& name, const char* what)
+{
+    fprintf(stderr, "FAIL %s: %s\n", name.c_str(), what);
+    failures++;
+}
+
+static bool write_blob(FILE* fp, int count, float lo, float hi, bool tagged)
+{
+    std::vector<float> values(count);
+    for (float& v : values)
+        v = random_float(lo, hi);
+
+    // a zero tag marks raw fp32 weights, biases are read without one
+    const uint32_t tag = 0;
+    if (tagged && fwrite(&tag, sizeof(tag), 1, fp) != 1)
+        return false;
+    return fwrite(values.data(), sizeof(float), count, fp) == size_t(count);
+}
+
+// two 3x3 convolutions from 3 to 8 to 3 channels and, for scale 2, a 2x2 stride 2 deconvolution, so every output pixel
+// depends on the 5x5 input pixels around it; the weights keep the output well inside 0-1
+static bool write_net(const NetCase& c, const std::string& parampath, const std::string& modelpath)
+{
+    const std::string input = c.input;
+    const std::string output = c.output;
+    const std::string pad = c.realesrgan ? " 4=1" : "";
+    const int layers = c.scale == 2 ? 5 : 4;
+
+    std::string param = "7767517\n" + std::to_string(layers) + " " + std::to_string(layers) + "\n";
+    param += "Input input 0 1 " + input + " 0=0 1=0 2=3\n";
+    param += "Convolution conv1 1 1 " + input + " conv1 0=8 1=3" + pad + " 5=1 6=216\n";
+    param += "ReLU relu1 1 1 conv1 relu1 0=1.000000e-01\n";
+    param += "Convolution conv2 1 1 relu1 " + (c.scale == 2 ? std::string("conv2") : output) + " 0=3 1=3" + pad + " 5=1 6=216\n";
+    if (c.scale == 2)
+        param += "Deconvolution deconv 1 1 conv2 " + output + " 0=3 1=2 3=2 5=1 6=36\n";
+
+    FILE* fp = fopen(parampath.c_str(), "wb");
+    if (!fp)
+        return false;
+    const bool param_ok = fwrite(param.data(), param.size(), 1, fp) == 1;
+    fclose(fp);
+
+    fp = fopen(modelpath.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool model_ok = write_blob(fp, 216, -0.3f, 0.3f, true) && write_blob(fp, 8, -0.1f, 0.1f, false)
+        && write_blob(fp, 216, -0.1f, 0.1f, true) && write_blob(fp, 3, 0.4f, 0.6f, false);
+    if (c.scale == 2)
+        model_ok = model_ok && write_blob(fp, 36, 0.f, 0.4f, true) && write_blob(fp, 3, 0.f, 0.1f, false);
+    fclose(fp);
+
+    return param_ok && model_ok;
+}
+
+static StripFrame strip_frame(const Planes& in, Planes& out, bool alpha)
+{
+    const StripFrame frame = { in.plane(0), in.plane(1), in.plane(2), alpha ? in.plane(3) : nullptr,
+        out.plane(0), out.plane(1), out.plane(2), alpha ? out.plane(3) : nullptr,
+        in.width, in.height, in.width, out.width, nullptr, 0 };
+    return frame;
+}
+
+static void check(const std::string& name, int ret, const Planes& out, const Planes& ref, int channels, double tolerance)
+{
+    if (ret != 0)
+    {
+        fail(name, "process failed");
+        return;
+    }
+
+    double diff = 0;
+    for (size_t i = 0; i < size_t(out.width) * out.height * channels; i++)
+        diff = std::max(diff, (double)std::fabs(out.data[i] - ref.data[i]));
+
+    if (diff > tolerance)
+    {
+        char what[64];
+        snprintf(what, sizeof(what), "max difference %g over %g", diff, tolerance);
+        fail(name, what);
+    }
+}
+
+// the net over the whole frame as one blob, extended past the edges as the engines' preproc extends their tiles,
+// and rounded as their postproc rounds: by half a step of 255
+static int reference(const ncnn::Net& net, const NetCase& c, const Planes& in, Planes& ref)
+{
+    const int w = in.width;
+    const int h = in.height;
+    const int pad_right = c.prepadding + (w + c.align - 1) / c.align * c.align - w;
+    const int pad_bottom = c.prepadding + (h + c.align - 1) / c.align * c.align - h;
+
+    ncnn::Mat padded(c.prepadding + w + pad_right, c.prepadding + h + pad_bottom, 3);
+    for (int ch = 0; ch < 3; ch++)
+    {
+        float* p = padded.channel(ch);
+        for (int y = 0; y < padded.h; y++)
+        {
+            for (int x = 0; x < padded.w; x++)
+            {
+                int sx = x - c.prepadding;
+                int sy = y - c.prepadding;
+                if (c.realesrgan)
+                {
+                    sx = sx < 0 ? -sx : sx >= w ? 2 * (w - 1) - sx : sx;
+                    sy = sy < 0 ? -sy : sy >= h ? 2 * (h - 1) - sy : sy;
+                }
+                else
+                {
+                    sx = std::min(std::max(sx, 0), w - 1);
+                    sy = std::min(std::max(sy, 0), h - 1);
+                }
+                p[padded.w * y + x] = in.plane(ch)[w * sy + sx];
+            }
+        }
+    }
+
+    ncnn::Mat out;
+    ncnn::Extractor ex = net.create_extractor();
+    ex.input(c.input, padded);
+    if (ex.extract(c.output, out) != 0)
+        return -1;
+
+    const int crop = c.realesrgan ? c.prepadding * c.scale : 0;
+    for (int ch = 0; ch < 3; ch++)
+    {
+        const float* o = out.channel(ch);
+        float* d = ref.plane(ch);
+        for (int y = 0; y < ref.height; y++)
+        {
+            for (int x = 0; x < ref.width; x++)
+            {
+                d[ref.width * y + x] = std::min(1.f, std::max(0.f, o[out.w * (y + crop) + x + crop] + 0.5f / 255.f));
+            }
+        }
+    }
+    return 0;
+}
+
+template<class Run>
+static int timed(const std::string& name, const Run& run)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const int ret = run();
+    timings.emplace_back(name, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    return ret;
+}
+
+static std::string frame_name(const std::string& prefix, const Planes& in, int tile_w, int tile_h)
+{
+    return prefix + "/" + std::to_string(in.width) + "x" + std::to_string(in.height) + "/" + std::to_string(tile_w) + "x" + std::to_string(tile_h);
+}
+
+static bool same_regions(const std::vector<TileRegion>& a, const std::vector<TileRegion>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (a[i].x0 != b[i].x0 || a[i].y0 != b[i].y0 || a[i].x1 != b[i].x1 || a[i].y1 != b[i].y1)
+            return false;
+    }
+    return true;
+}
+
+// regions running out of memory run again alone with halved tiles, down to 32, and the reduction is kept for the next frame;
+// any other error fails the frame as it is
+static void check_shrinking_tiles()
+{
+    std::atomic<int> shift(0);
+    std::vector<std::pair<int, int> > sizes;
+    std::vector<TileRegion> regions;
+    // the bottom half of a 400x300 frame only fits in 48x32 tiles
+    int ret = processShrinkingTiles(shift, 200, 100, 400, 300, [&](int tile_w, int tile_h, const TileRegion& region, FailedRegions& failed) {
+        sizes.emplace_back(tile_w, tile_h);
+        regions.push_back(region);
+        if (region.y1 > 150 && tile_w > 48)
+            failed.add({ region.x0, std::max(region.y0, 150), region.x1, region.y1 });
+        return 0;
+    });
+    const std::vector<std::pair<int, int> > expected = { { 200, 100 }, { 100, 48 }, { 48, 32 } };
+    if (ret != 0 || shift != 2 || sizes != expected)
+        fail("shrinking-tiles", "tiles not halved on running out of memory");
+    if (!same_regions(regions, { { 0, 0, 400, 300 }, { 0, 150, 400, 300 }, { 0, 150, 400, 300 } }))
+        fail("shrinking-tiles", "more than the failed region run again");
+
+    sizes.clear();
+    ret = processShrinkingTiles(shift, 200, 100, 400, 300, [&](int tile_w, int tile_h, const TileRegion&, FailedRegions&) {
+        sizes.emplace_back(tile_w, tile_h);
+        return 0;
+    });
+    if (ret != 0 || sizes.size() != 1 || sizes[0] != expected[2])
+        fail("shrinking-tiles", "reduction not kept for the next frame");
+
+    int runs = 0;
+    std::atomic<int> error_shift(0);
+    ret = processShrinkingTiles(error_shift, 200, 100, 400, 300, [&](int, int, const TileRegion&, FailedRegions&) {
+        runs++;
+        return -1;
+    });
+    if (ret != -1 || runs != 1 || error_shift != 0)
+        fail("shrinking-tiles", "an error other than running out of memory retried with smaller tiles");
+
+    ret = processShrinkingTiles(shift, 200, 100, 400, 300, [&](int, int, const TileRegion& region, FailedRegions& failed) {
+        failed.add(region);
+        return 0;
+    });
+    if (ret != TILE_OUT_OF_MEMORY || reducedTilesize(200, shift) != 32 || reducedTilesize(100, shift) != 32)
+        fail("shrinking-tiles", "regions running out of memory at 32 pixels not reported");
+}
+
+// the configured tiles, and the tiles they shrink to after running out of memory
+static std::vector<std::pair<int, int> > tile_sizes(bool square)
+{
+    std::vector<std::pair<int, int> > sizes = { { 32, 32 }, { 44, 44 }, { 64, 64 } };
+    for (int shift = 0; shift < 3; shift++)
+        sizes.emplace_back(reducedTilesize(100, shift), reducedTilesize(100, shift));
+    if (!square)
+    {
+        sizes.emplace_back(32, 64);
+        sizes.emplace_back(64, 36);
+    }
+    return sizes;
+}
+
+// Waifu2x or RealESRGAN, set up as the filters set them up
+struct Engine
+{
+    std::unique_ptr<Waifu2x> waifu2x;
+    std::unique_ptr<RealESRGAN> realesrgan;
+
+    Engine(const NetCase& c, int tta_mode, int precision)
+    {
+        if (c.realesrgan)
+        {
+            realesrgan.reset(new RealESRGAN(0, 1, tta_mode, precision, 32));
+            realesrgan->scale = c.scale;
+            realesrgan->tilesize = whole_tile;
+            realesrgan->prepadding = c.prepadding;
+        }
+        else
+        {
+            waifu2x.reset(new Waifu2x(0, 1, tta_mode, precision, 32));
+            waifu2x->noise = 0;
+            waifu2x->scale = c.scale;
+            waifu2x->tilesize_w = whole_tile;
+            waifu2x->tilesize_h = whole_tile;
+            waifu2x->prepadding = c.prepadding;
+        }
+    }
+
+    int load(const std::string& parampath, const std::string& modelpath)
+    {
+        return waifu2x ? waifu2x->load(parampath, modelpath) : realesrgan->load(parampath, modelpath);
+    }
+
+    int process(const Planes& in, Planes& out, bool alpha, int tile_w, int tile_h, int strip_workers)
+    {
+        const float* srcpA = alpha ? in.plane(3) : nullptr;
+        float* dstpA = alpha ? out.plane(3) : nullptr;
+        if (waifu2x)
+        {
+            waifu2x->tilesize_w = tile_w;
+            waifu2x->tilesize_h = tile_h;
+            waifu2x->strip_workers = strip_workers;
+            return waifu2x->process(in.plane(0), in.plane(1), in.plane(2), out.plane(0), out.plane(1), out.plane(2), in.width, in.height, in.width, out.width, nullptr, 0, srcpA, dstpA);
+        }
+
+        realesrgan->tilesize = tile_w;
+        realesrgan->strip_workers = strip_workers;
+        return realesrgan->process(in.plane(0), in.plane(1), in.plane(2), out.plane(0), out.plane(1), out.plane(2), in.width, in.height, in.width, out.width, nullptr, 0, srcpA, dstpA);
+    }
+
+    // the whole frame as one region of process, its strips cut into groups of tile columns at most group_width wide
+    // as a small heap budget cuts them; the tiles are square for realesrgan
+    int process_grouped(const Planes& in, Planes& out, int tile_w, int tile_h, int strip_workers, int group_width)
+    {
+        if (waifu2x)
+        {
+            waifu2x->tilesize_w = tile_w;
+            waifu2x->tilesize_h = tile_h;
+        }
+        else
+        {
+            realesrgan->tilesize = tile_w;
+        }
+
+        const ncnn::VulkanDevice* vkdev = waifu2x ? waifu2x->vulkan_device() : realesrgan->vulkan_device();
+        const ncnn::Option& opt = waifu2x ? waifu2x->net_options() : realesrgan->net_options();
+        const int scale = waifu2x ? waifu2x->scale : realesrgan->scale;
+        const int prepadding = waifu2x ? waifu2x->prepadding : realesrgan->prepadding;
+        const TileRegion region = { 0, 0, in.width, in.height };
+
+        FailedRegions failed;
+        const int ret = processStrips(vkdev, opt, nullptr, scale, prepadding, strip_workers, strip_frame(in, out, false), region, tile_w, tile_h,
+            [&](const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, const unsigned char* tile_mask) {
+                return waifu2x ? waifu2x->process_gpu(in_gpu, x0, y0, width, height, out_gpu, cmd, blob_vkallocator, staging_vkallocator, tile_mask)
+                    : realesrgan->process_gpu(in_gpu, x0, y0, width, height, out_gpu, cmd, blob_vkallocator, staging_vkallocator, tile_mask);
+            }, failed, group_width);
+        return ret == 0 && !failed.take().empty() ? TILE_OUT_OF_MEMORY : ret;
+    }
+};
+
+static void check_engine(const NetCase& c, const std::string& parampath, const std::string& modelpath, const std::vector<Planes>& inputs, const std::vector<Planes>& refs)
+{
+    struct Mode
+    {
+        int tta_mode;
+        int precision;
+        // checked against the cpu reference, otherwise against the engine over the whole frame
+        bool cpu_reference;
+        double tolerance;
+    };
+    // precision 8 runs the float net on the cpu, with fp16 storage where the cpu has it
+    const Mode modes[] = { { 0, 32, true, 2e-3 }, { 0, 16, true, 2e-2 }, { 2, 32, false, 2e-3 }, { 8, 32, false, 2e-3 }, { 0, 8, true, 2e-2 } };
+
+    for (const Mode& mode : modes)
+    {
+        const std::string prefix = std::string(c.name) + "/tta" + std::to_string(mode.tta_mode) + "/fp" + std::to_string(mode.precision);
+
+        Engine engine(c, mode.tta_mode, mode.precision);
+        if (engine.load(parampath, modelpath))
+        {
+            fail(prefix, "load failed");
+            continue;
+        }
+
+        const bool cpu = mode.precision == 8;
+        const std::vector<std::pair<int, int> > sizes = mode.tta_mode || mode.precision == 16 ? std::vector<std::pair<int, int> >{ { 32, 32 }, { 44, 44 } } : tile_sizes(c.realesrgan);
+        for (size_t fi = 0; fi < inputs.size(); fi++)
+        {
+            const Planes& in = inputs[fi];
+
+            // also warms the allocators up before anything is timed
+            Planes whole(in.width * c.scale, in.height * c.scale);
+            const bool alpha = fi == 0;
+            const int whole_ret = engine.process(in, whole, alpha, whole_tile, whole_tile, 1);
+            if (whole_ret)
+            {
+                fail(frame_name(prefix, in, whole_tile, whole_tile), "process failed");
+                continue;
+            }
+            if (mode.cpu_reference)
+                check(frame_name(prefix, in, whole_tile, whole_tile), whole_ret, whole, refs[fi], 3, mode.tolerance);
+
+            for (const std::pair<int, int>& tile : sizes)
+            {
+                // the cpu path has no strip workers, more than the device has queues run on the ones there are
+                for (int strip_workers = 1; strip_workers <= (cpu || mode.tta_mode ? 1 : 2); strip_workers++)
+                {
+                    const std::string name = frame_name(prefix, in, tile.first, tile.second) + "/workers" + std::to_string(strip_workers) + (alpha ? "/alpha" : "");
+
+                    Planes out(in.width * c.scale, in.height * c.scale);
+                    const int ret = timed(name, [&]() { return engine.process(in, out, alpha, tile.first, tile.second, strip_workers); });
+                    check(name, ret, out, mode.cpu_reference ? refs[fi] : whole, 3, mode.tolerance);
+
+                    // the alpha is resampled from the same padded tiles on either path, whatever the net computed
+                    if (alpha && ret == 0)
+                    {
+                        std::vector<float> tiled(out.plane(3), out.plane(3) + size_t(out.width) * out.height);
+                        std::vector<float> untiled(whole.plane(3), whole.plane(3) + size_t(out.width) * out.height);
+                        for (size_t i = 0; i < tiled.size(); i++)
+                        {
+                            if (std::fabs(tiled[i] - untiled[i]) > 2e-3)
+                            {
+                                fail(name, "alpha differs from the whole frame");
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+
+            // one and two tile columns per group, so every frame is streamed in several groups
+            if (!cpu && !mode.tta_mode && mode.precision == 32)
+            {
+                for (const std::pair<int, int>& tile : { std::make_pair(32, 32), std::make_pair(44, 44) })
+                {
+                    for (int group_width = tile.first; group_width <= tile.first * 2; group_width += tile.first)
+                    {
+                        for (int strip_workers = 1; strip_workers <= 2; strip_workers++)
+                        {
+                            const std::string name = frame_name(prefix, in, tile.first, tile.second) + "/group" + std::to_string(group_width) + "/workers" + std::to_string(strip_workers);
+
+                            Planes out(in.width * c.scale, in.height * c.scale);
+                            const int ret = timed(name, [&]() { return engine.process_grouped(in, out, tile.first, tile.second, strip_workers, group_width); });
+                            check(name, ret, out, refs[fi], 3, mode.tolerance);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// a Chain of first and second against first over the whole frame and second over its output,
+// with strips of several heights on one and two compute queues
+static void check_chain(const NetCase& first, const NetCase& second, const std::string& dir, const std::vector<Planes>& inputs)
+{
+    const std::string prefix = std::string("chain/") + first.name + "+" + second.name;
+    // large enough for the output of the first stage on every frame
+    const int stage_tile = 512;
+
+    Engine first_engine(first, 0, 32);
+    Engine second_engine(second, 0, 32);
+    Engine first_stage(first, 0, 32);
+    Engine second_stage(second, 0, 32);
+    if (first_engine.load(dir + "/" + first.name + ".param", dir + "/" + first.name + ".bin")
+        || second_engine.load(dir + "/" + second.name + ".param", dir + "/" + second.name + ".bin")
+        || first_stage.load(dir + "/" + first.name + ".param", dir + "/" + first.name + ".bin")
+        || second_stage.load(dir + "/" + second.name + ".param", dir + "/" + second.name + ".bin"))
+    {
+        fail(prefix, "load failed");
+        return;
+    }
+
+    Chain chain;
+    if (first_stage.waifu2x)
+        chain.add(first_stage.waifu2x.release());
+    else
+        chain.add(first_stage.realesrgan.release());
+    if (second_stage.waifu2x)
+        chain.add(second_stage.waifu2x.release());
+    else
+        chain.add(second_stage.realesrgan.release());
+
+    for (const Planes& in : inputs)
+    {
+        Planes mid(in.width * first.scale, in.height * first.scale);
+        Planes ref(mid.width * second.scale, mid.height * second.scale);
+        if (first_engine.process(in, mid, false, stage_tile, stage_tile, 1) || second_engine.process(mid, ref, false, stage_tile, stage_tile, 1))
+        {
+            fail(frame_name(prefix, in, stage_tile, stage_tile), "process failed");
+            continue;
+        }
+
+        for (int tilesize : { 32, 44, 100 })
+        {
+            for (int strip_workers = 1; strip_workers <= 2; strip_workers++)
+            {
+                const std::string name = frame_name(prefix, in, tilesize, tilesize) + "/workers" + std::to_string(strip_workers);
+
+                chain.tilesize = tilesize;
+                chain.strip_workers = strip_workers;
+                Planes out(ref.width, ref.height);
+                const int ret = timed(name, [&]() {
+                    return chain.process(in.plane(0), in.plane(1), in.plane(2), out.plane(0), out.plane(1), out.plane(2), in.width, in.height, in.width, out.width);
+                });
+                check(name, ret, out, ref, 3, 2e-3);
+            }
+        }
+    }
+}
+
+// pack frames into one mosaic with packMosaic, upscale it with run(in, out) and unpack the frames with unpackMosaic into outs
+template<class Run>
+static int run_mosaic(const NetCase& c, const std::vector<Planes>& frames, std::vector<Planes>& outs, const VSAPI* vsapi, VSCore* core, const Run& run)
+{
+    const VSFormat* format = vsapi->getFormatPreset(pfRGBS, core);
+
+    std::vector<const VSFrameRef*> srcs;
+    std::vector<VSFrameRef*> dsts;
+    for (const Planes& frame : frames)
+    {
+        VSFrameRef* src = vsapi->newVideoFrame(format, frame.width, frame.height, nullptr, core);
+        for (int p = 0; p < 3; p++)
+            vs_bitblt(vsapi->getWritePtr(src, p), vsapi->getStride(src, p), frame.plane(p), frame.width * sizeof(float), frame.width * sizeof(float), frame.height);
+        srcs.push_back(src);
+        dsts.push_back(vsapi->newVideoFrame(format, frame.width * c.scale, frame.height * c.scale, nullptr, core));
+    }
+
+    // the gutters are as wide as the padding, as the filters make them
+    std::vector<float> mosaic;
+    const int width = packMosaic(srcs, c.prepadding, c.realesrgan, mosaic, vsapi);
+    const int height = frames[0].height;
+
+    Planes in(width, height);
+    Planes out(width * c.scale, height * c.scale);
+    std::copy(mosaic.begin(), mosaic.end(), in.data.begin());
+    const int ret = run(in, out);
+
+    outs.clear();
+    if (ret == 0)
+    {
+        unpackMosaic(out.plane(0), width, height, c.prepadding, c.scale, dsts, vsapi);
+        for (const VSFrameRef* dst : dsts)
+        {
+            outs.emplace_back(vsapi->getFrameWidth(dst, 0), vsapi->getFrameHeight(dst, 0));
+            for (int p = 0; p < 3; p++)
+                vs_bitblt(outs.back().plane(p), outs.back().width * sizeof(float), vsapi->getReadPtr(dst, p), vsapi->getStride(dst, p), outs.back().width * sizeof(float), outs.back().height);
+        }
+    }
+
+    for (const VSFrameRef* src : srcs)
+        vsapi->freeFrame(src);
+    for (const VSFrameRef* dst : dsts)
+        vsapi->freeFrame(dst);
+    return ret;
+}
+
+// every frame of a batch upscaled by run(in, out) as a mosaic against the same frame upscaled by run alone
+template<class Run>
+static void check_mosaic(const std::string& prefix, const NetCase& c, const std::vector<Planes>& frames, const VSAPI* vsapi, VSCore* core, double tolerance, const Run& run)
+{
+    std::vector<Planes> batched;
+    const int ret = timed(prefix + "/batch" + std::to_string(frames.size()), [&]() { return run_mosaic(c, frames, batched, vsapi, core, run); });
+    if (ret != 0)
+    {
+        fail(prefix, "process failed");
+        return;
+    }
+
+    for (size_t fi = 0; fi < frames.size(); fi++)
+    {
+        Planes alone(frames[fi].width * c.scale, frames[fi].height * c.scale);
+        check(frame_name(prefix, frames[fi], frames[fi].width, frames[fi].height) + "/frame" + std::to_string(fi), run(frames[fi], alone), batched[fi], alone, 3, tolerance);
+    }
+}
+
+static bool read_baseline(const char* path, std::map<std::string, double>& baseline)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    char name[256];
+    double ms;
+    while (fscanf(fp, "%255s %lf", name, &ms) == 2)
+        baseline[name] = ms;
+    fclose(fp);
+    return true;
+}
+
+static void check_timings(const char* timings_path, const char* baseline_path)
+{
+    if (timings_path)
+    {
+        FILE* fp = fopen(timings_path, "wb");
+        if (!fp)
+        {
+            fail(timings_path, "can't write the timings");
+            return;
+        }
+        for (const std::pair<std::string, double>& t : timings)
+            fprintf(fp, "%s %.3f\n", t.first.c_str(), t.second);
+        fclose(fp);
+    }
+
+    if (!baseline_path)
+        return;
+
+    std::map<std::string, double> baseline;
+    if (!read_baseline(baseline_path, baseline))
+    {
+        fail(baseline_path, "can't read the baseline");
+        return;
+    }
+
+    // a few milliseconds of slack keep the tiny configurations from failing on scheduling noise
+    for (const std::pair<std::string, double>& t : timings)
+    {
+        std::map<std::string, double>::const_iterator base = baseline.find(t.first);
+        if (base != baseline.end() && t.second > base->second * 1.5 + 5)
+        {
+            char what[64];
+            snprintf(what, sizeof(what), "took %.1f ms, %.1f ms in the baseline", t.second, base->second);
+            fail(t.first, what);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s work_dir [timings.txt [baseline.txt]]\n", argv[0]);
+        return 1;
+    }
+    const std::string dir = argv[1];
+    const char* timings_path = argc > 2 ? argv[2] : nullptr;
+    const char* baseline_path = argc > 3 ? argv[3] : nullptr;
+
+    check_shrinking_tiles();
+
+    std::vector<Planes> inputs;
+    for (const int* size : frame_sizes)
+    {
+        inputs.emplace_back(size[0], size[1]);
+        for (float& v : inputs.back().data)
+            v = random_float(0.f, 1.f);
+    }
+
+    std::vector<Planes> batch;
+    for (int fi = 0; fi < mosaic_frames; fi++)
+    {
+        batch.emplace_back(mosaic_size[0], mosaic_size[1]);
+        for (float& v : batch.back().data)
+            v = random_float(0.f, 1.f);
+    }
+
+    const VSAPI* vsapi = getVapourSynthAPI(VAPOURSYNTH_API_VERSION);
+    VSCore* core = vsapi ? vsapi->createCore(1) : nullptr;
+    if (!core)
+        fail("mosaic", "can't create a vapoursynth core");
+
+    std::vector<std::vector<Planes> > refs(sizeof(net_cases) / sizeof(net_cases[0]));
+    for (size_t ci = 0; ci < refs.size(); ci++)
+    {
+        const NetCase& c = net_cases[ci];
+        const std::string parampath = dir + "/" + c.name + ".param";
+        const std::string modelpath = dir + "/" + c.name + ".bin";
+        if (!write_net(c, parampath, modelpath))
+        {
+            fail(c.name, "can't write the net");
+            continue;
+        }
+
+        // plain fp32 on the cpu, for the reference and the cpu tiles
+        ncnn::Net net;
+        net.opt.use_vulkan_compute = false;
+        net.opt.use_fp16_packed = false;
+        net.opt.use_fp16_storage = false;
+        net.opt.use_fp16_arithmetic = false;
+        net.opt.use_bf16_storage = false;
+        if (net.load_param(parampath.c_str()) || net.load_model(modelpath.c_str()))
+        {
+            fail(c.name, "can't load the net");
+            continue;
+        }
+
+        for (const Planes& in : inputs)
+        {
+            Planes ref(in.width * c.scale, in.height * c.scale);
+            if (reference(net, c, in, ref))
+                fail(frame_name(std::string(c.name) + "/reference", in, in.width, in.height), "extract failed");
+
+            for (const std::pair<int, int>& tile : tile_sizes(false))
+            {
+                const std::string name = frame_name(std::string(c.name) + "/cpu", in, tile.first, tile.second);
+
+                Planes out(in.width * c.scale, in.height * c.scale);
+                const int ret = timed(name, [&]() { return processCpuTiles(net, c.layout(), c.scale, c.prepadding, strip_frame(in, out, false), tile.first, tile.second); });
+                check(name, ret, out, ref, 3, 1e-4);
+            }
+
+            refs[ci].push_back(std::move(ref));
+        }
+
+        // the reference only pads the outer edges of the mosaic, so the gutters alone keep the frames apart
+        if (core)
+        {
+            check_mosaic(std::string(c.name) + "/mosaic/reference", c, batch, vsapi, core, 1e-4, [&](const Planes& in, Planes& out) {
+                return reference(net, c, in, out);
+            });
+        }
+    }
+
+    ncnn::create_gpu_instance();
+    const bool has_gpu = ncnn::get_gpu_count() > 0;
+    if (has_gpu)
+    {
+        for (size_t ci = 0; ci < refs.size(); ci++)
+        {
+            const NetCase& c = net_cases[ci];
+            if (refs[ci].size() == inputs.size())
+                check_engine(c, dir + "/" + c.name + ".param", dir + "/" + c.name + ".bin", inputs, refs[ci]);
+
+            if (!core)
+                continue;
+            Engine engine(c, 0, 32);
+            if (engine.load(dir + "/" + c.name + ".param", dir + "/" + c.name + ".bin"))
+            {
+                fail(std::string(c.name) + "/mosaic", "load failed");
+                continue;
+            }
+            check_mosaic(std::string(c.name) + "/mosaic/engine", c, batch, vsapi, core, 2e-3, [&](const Planes& in, Planes& out) {
+                return engine.process(in, out, false, 32, 32, 1);
+            });
+        }
+
+        // waifu2x-2x then realesrgan-2x, the realesrgan stage mirroring its edges inside the strips of the first
+        if (refs[1].size() == inputs.size() && refs[2].size() == inputs.size())
+            check_chain(net_cases[1], net_cases[2], dir, inputs);
+    }
+    ncnn::destroy_gpu_instance();
+
+    if (core)
+        vsapi->freeCore(core);
+
+    check_timings(timings_path, baseline_path);
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    if (!has_gpu)
+    {
+        fprintf(stderr, "no vulkan device, only the cpu tiles were checked\n");
+        return SKIP_RETURN_CODE;
+    }
+    return 0;
+}
@@ -0,0 +1,575 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+
+#include "tile-process.hpp"
+#include "layer.h"
+
+int reducedTilesize(int tilesize, int shift)
+{
+    return std::min(tilesize, std::max(32, (tilesize >> shift) / 4 * 4));
+}
+
+void FailedRegions::add(const TileRegion& region)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    _regions.push_back(region);
+}
+
+std::vector<TileRegion> FailedRegions::take()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    std::vector<TileRegion> regions;
+    regions.swap(_regions);
+    return regions;
+}
+
+int processShrinkingTiles(std::atomic<int>& shift, int tilesize_w, int tilesize_h, int width, int height, const RegionProcessor& process_tiles)
+{
+    std::vector<TileRegion> pending = { { 0, 0, width, height } };
+    for (;;)
+    {
+        int current = shift;
+        FailedRegions failed;
+        for (const TileRegion& region : pending)
+        {
+            const int ret = process_tiles(reducedTilesize(tilesize_w, current), reducedTilesize(tilesize_h, current), region, failed);
+            if (ret != 0)
+                return ret;
+        }
+
+        pending = failed.take();
+        if (pending.empty())
+            return 0;
+
+        if (reducedTilesize(tilesize_w, current + 1) == reducedTilesize(tilesize_w, current) && reducedTilesize(tilesize_h, current + 1) == reducedTilesize(tilesize_h, current))
+            return TILE_OUT_OF_MEMORY;
+
+        // another frame may have shrunk the tiles meanwhile
+        shift.compare_exchange_strong(current, current + 1);
+    }
+}
+
+int processStrips(const ncnn::VulkanDevice* vkdev, const ncnn::Option& net_opt, const ncnn::Pipeline* roi_blend, int scale, int prepadding, int strip_workers, const StripFrame& frame, const TileRegion& region, int tile_w, int tile_h, const StripRecorder& record, FailedRegions& failed, int group_width)
+{
+    const int w = frame.width;
+    const int h = frame.height;
+    const int src_stride = frame.src_stride;
+    const int dst_stride = frame.dst_stride;
+    const float* weight = frame.weight;
+    const int weight_stride = frame.weight_stride;
+
+    const int channels = frame.srcpA ? 4 : 3;
+
+    const int TILE_SIZE_W = tile_w;
+    const int TILE_SIZE_H = tile_h;
+
+    // each worker records its strips with its own allocators into its own command buffers
+    const int max_workers = std::max(1, std::min(strip_workers, (int)vkdev->info.compute_queue_count()));
+
+    // tiles are laid out from the corner of the region, the padding around it still comes from the frame
+    const int xtiles = (region.x1 - region.x0 + TILE_SIZE_W - 1) / TILE_SIZE_W;
+    const int ytiles = (region.y1 - region.y0 + TILE_SIZE_H - 1) / TILE_SIZE_H;
+
+    // a full-width row of tiles needs device memory proportional to the frame width,
+    // when that exceeds a quarter of the heap budget shared by the workers the row is streamed in narrower groups of tile columns
+    int group_xtiles = xtiles;
+    {
+        const size_t tile_bytes = ((size_t)(TILE_SIZE_W + prepadding * 2) * (TILE_SIZE_H + prepadding * 2) + (size_t)TILE_SIZE_W * scale * TILE_SIZE_H * scale) * channels * sizeof(float);
+        const size_t budget = (size_t)vkdev->get_heap_budget() * 1024 * 1024 / 4 / max_workers;
+        if (budget > 0)
+            group_xtiles = std::max(1, (int)std::min((size_t)xtiles, budget / tile_bytes));
+        if (group_width > 0)
+            group_xtiles = std::min(group_xtiles, std::max(1, group_width / TILE_SIZE_W));
+    }
+    const int xgroups = (xtiles + group_xtiles - 1) / group_xtiles;
+
+    const int workers = std::min(max_workers, ytiles * xgroups);
+
+    auto run_worker = [&](int wi) -> int {
+        ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
+        ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
+
+        ncnn::Option opt = net_opt;
+        opt.blob_vkallocator = blob_vkallocator;
+        opt.workspace_vkallocator = blob_vkallocator;
+        opt.staging_vkallocator = staging_vkallocator;
+
+        // a strip is copied on the transfer queue while the one before it computes,
+        // with its own allocators as the copy runs on another thread
+        ncnn::VkAllocator* upload_vkallocator = vkdev->acquire_blob_allocator();
+        ncnn::VkAllocator* upload_staging_vkallocator = vkdev->acquire_staging_allocator();
+
+        ncnn::Option upload_opt = opt;
+        upload_opt.blob_vkallocator = upload_vkallocator;
+        upload_opt.workspace_vkallocator = upload_vkallocator;
+        upload_opt.staging_vkallocator = upload_staging_vkallocator;
+        // preproc reads fp32, which VkTransfer would otherwise cast to fp16 on discrete devices
+        upload_opt.use_fp16_storage = false;
+        upload_opt.use_fp16_packed = false;
+
+        auto upload_strip = [&](int si, ncnn::VkMat& in_gpu) -> int {
+            const int yi = si / xgroups;
+            const int gi = si % xgroups;
+
+            const int group_x0 = region.x0 + gi * group_xtiles * TILE_SIZE_W;
+            const int group_x1 = std::min(region.x0 + (gi + 1) * group_xtiles * TILE_SIZE_W, region.x1);
+            const int strip_y0 = region.y0 + yi * TILE_SIZE_H;
+            const int strip_y1 = std::min(region.y0 + (yi + 1) * TILE_SIZE_H, region.y1);
+
+            int in_tile_x0 = std::max(group_x0 - prepadding, 0);
+            int in_tile_x1 = std::min(group_x1 + prepadding, w);
+            int in_tile_y0 = std::max(strip_y0 - prepadding, 0);
+            int in_tile_y1 = std::min(strip_y1 + prepadding, h);
+            const int in_tile_w = in_tile_x1 - in_tile_x0;
+            const int in_tile_h = in_tile_y1 - in_tile_y0;
+
+            // with unified memory the planes go straight into the mapped device buffer, skipping staging and the transfer,
+            // the allocator only knows whether it is mappable after its first allocation, until then the transfer is taken
+            const bool direct = upload_vkallocator->mappable;
+
+            ncnn::Mat in;
+            if (direct)
+            {
+                in_gpu.create(in_tile_w, in_tile_h, channels, sizeof(float), upload_vkallocator);
+                if (in_gpu.empty())
+                    return TILE_OUT_OF_MEMORY;
+                in = in_gpu.mapped();
+            }
+            else
+            {
+                in.create(in_tile_w, in_tile_h, channels, sizeof(float));
+            }
+
+            const float* srcps[4] = { frame.srcpR, frame.srcpG, frame.srcpB, frame.srcpA };
+            for (int c = 0; c < channels; c++)
+            {
+                float* in_tile = in.channel(c);
+                const float* s = srcps[c] + in_tile_y0 * src_stride + in_tile_x0;
+                for (int y = 0; y < in_tile_h; y++)
+                {
+                    for (int x = 0; x < in_tile_w; x++)
+                    {
+                        in_tile[in_tile_w * y + x] = s[src_stride * y + x] * 255.f;
+                    }
+                }
+            }
+
+            if (direct)
+            {
+                if (upload_vkallocator->flush(in_gpu.data) != 0)
+                    return -1;
+
+                // the first dispatch binding the strip barriers against these flags, which then cover the host writes above
+                in_gpu.data->access_flags = VK_ACCESS_HOST_WRITE_BIT;
+                in_gpu.data->stage_flags = VK_PIPELINE_STAGE_HOST_BIT;
+                return 0;
+            }
+
+            // unflattened, the shaders address the channels by cstep
+            ncnn::VkTransfer transfer(vkdev);
+            transfer.record_upload(in, in_gpu, upload_opt, false);
+            if (in_gpu.empty())
+                return TILE_OUT_OF_MEMORY;
+            if (transfer.submit_and_wait() != 0)
+                return -1;
+
+            return 0;
+        };
+
+        ncnn::VkMat in_gpu;
+        ncnn::VkMat next_in_gpu;
+        std::future<int> next_upload = std::async(std::launch::async, upload_strip, wi, std::ref(next_in_gpu));
+
+        int worker_ret = 0;
+
+        for (int si = wi; si < ytiles * xgroups; si += workers)
+        {
+            const int yi = si / xgroups;
+            const int gi = si % xgroups;
+
+            const int group_x0 = region.x0 + gi * group_xtiles * TILE_SIZE_W;
+            const int group_x1 = std::min(region.x0 + (gi + 1) * group_xtiles * TILE_SIZE_W, region.x1);
+            const int strip_y0 = region.y0 + yi * TILE_SIZE_H;
+            const int strip_y1 = std::min(region.y0 + (yi + 1) * TILE_SIZE_H, region.y1);
+
+            int in_tile_x0 = std::max(group_x0 - prepadding, 0);
+            int in_tile_x1 = std::min(group_x1 + prepadding, w);
+            int in_tile_y0 = std::max(strip_y0 - prepadding, 0);
+            int in_tile_y1 = std::min(strip_y1 + prepadding, h);
+            const int in_tile_w = in_tile_x1 - in_tile_x0;
+            const int in_tile_h = in_tile_y1 - in_tile_y0;
+
+            ncnn::VkCompute cmd(vkdev);
+
+            // upload, already running on the transfer queue since the previous strip
+            int strip_ret = next_upload.get();
+            in_gpu = next_in_gpu;
+            if (si + workers < ytiles * xgroups)
+                next_upload = std::async(std::launch::async, upload_strip, si + workers, std::ref(next_in_gpu));
+
+            const int out_tile_y0 = strip_y0;
+            const int out_tile_y1 = strip_y1;
+
+            ncnn::VkMat out_gpu;
+            if (strip_ret == 0)
+            {
+                out_gpu.create((group_x1 - group_x0) * scale, (out_tile_y1 - out_tile_y0) * scale, channels, sizeof(float), blob_vkallocator);
+                if (out_gpu.empty())
+                    strip_ret = TILE_OUT_OF_MEMORY;
+            }
+
+            // a strip that ran out of memory is left for smaller tiles while the next one goes ahead, anything else fails the frame
+            if (strip_ret != 0)
+            {
+                if (strip_ret != TILE_OUT_OF_MEMORY)
+                {
+                    worker_ret = strip_ret;
+                    break;
+                }
+                failed.add({ group_x0, strip_y0, group_x1, strip_y1 });
+                continue;
+            }
+
+            if (weight)
+            {
+                // the strip is a single row of tiles, keep those touching a non-zero weight
+                const int group_tiles = (group_x1 - group_x0 + TILE_SIZE_W - 1) / TILE_SIZE_W;
+
+                std::vector<unsigned char> tile_mask(group_tiles, 0);
+                int active_tiles = 0;
+                for (int xi = 0; xi < group_tiles; xi++)
+                {
+                    const int x1 = std::min(group_x0 + (xi + 1) * TILE_SIZE_W, group_x1);
+                    for (int y = out_tile_y0; y < out_tile_y1 && !tile_mask[xi]; y++)
+                    {
+                        const float* wp = weight + y * weight_stride;
+                        for (int x = group_x0 + xi * TILE_SIZE_W; x < x1; x++)
+                        {
+                            if (wp[x] > 0.f)
+                            {
+                                tile_mask[xi] = 1;
+                                active_tiles++;
+                                break;
+                            }
+                        }
+                    }
+                }
+
+                if (active_tiles > 0)
+                    strip_ret = record(in_gpu, group_x0 - in_tile_x0, out_tile_y0 - in_tile_y0, group_x1 - group_x0, out_tile_y1 - out_tile_y0, out_gpu, cmd, blob_vkallocator, staging_vkallocator, tile_mask.data());
+
+                ncnn::Mat weight_strip;
+                weight_strip.create(in_tile_w, in_tile_h, (size_t)4u);
+                for (int y = 0; y < in_tile_h; y++)
+                {
+                    memcpy(weight_strip.row(y), weight + (in_tile_y0 + y) * weight_stride + in_tile_x0, in_tile_w * sizeof(float));
+                }
+
+                ncnn::VkMat weight_gpu;
+                cmd.record_clone(weight_strip, weight_gpu, opt);
+                if (weight_gpu.empty() && strip_ret == 0)
+                    strip_ret = TILE_OUT_OF_MEMORY;
+
+                // a failed strip isn't submitted, and weight_gpu may not even exist
+                if (strip_ret == 0)
+                {
+                    std::vector<ncnn::VkMat> bindings(3);
+                    bindings[0] = in_gpu;
+                    bindings[1] = weight_gpu;
+                    bindings[2] = out_gpu;
+
+                    std::vector<ncnn::vk_constant_type> constants(10);
+                    constants[0].i = in_gpu.w;
+                    constants[1].i = in_gpu.h;
+                    constants[2].i = in_gpu.cstep;
+                    constants[3].i = out_gpu.w;
+                    constants[4].i = out_gpu.h;
+                    constants[5].i = out_gpu.cstep;
+                    constants[6].i = group_x0 - in_tile_x0;
+                    constants[7].i = out_tile_y0 - in_tile_y0;
+                    constants[8].i = scale;
+                    constants[9].i = channels;
+
+                    cmd.record_pipeline(roi_blend, bindings, constants, out_gpu);
+                }
+            }
+            else
+            {
+                strip_ret = record(in_gpu, group_x0 - in_tile_x0, out_tile_y0 - in_tile_y0, group_x1 - group_x0, out_tile_y1 - out_tile_y0, out_gpu, cmd, blob_vkallocator, staging_vkallocator, nullptr);
+            }
+
+            // download
+            {
+                // record_clone reads a strip in host-visible memory in place and otherwise through staging,
+                // either way after the compute to host-read barrier reading the mapped strip directly would lack
+                ncnn::Mat out;
+                if (strip_ret == 0)
+                {
+                    cmd.record_clone(out_gpu, out, opt);
+                    if (cmd.submit_and_wait() != 0)
+                        strip_ret = -1;
+                    else if (out.empty())
+                        strip_ret = TILE_OUT_OF_MEMORY;
+                }
+                if (strip_ret == TILE_OUT_OF_MEMORY)
+                {
+                    failed.add({ group_x0, strip_y0, group_x1, strip_y1 });
+                    continue;
+                }
+                if (strip_ret != 0)
+                {
+                    worker_ret = strip_ret;
+                    break;
+                }
+
+                float* dstps[4] = { frame.dstpR, frame.dstpG, frame.dstpB, frame.dstpA };
+                for (int c = 0; c < channels; c++)
+                {
+                    const float* out_tile = out.channel(c);
+                    float* d = dstps[c] + out_tile_y0 * scale * dst_stride + group_x0 * scale;
+                    for (int y = 0; y < out.h; y++)
+                    {
+                        for (int x = 0; x < out.w; x++)
+                        {
+                            d[dst_stride * y + x] = std::min(1.f, std::max(0.f, out_tile[out.w * y + x] / 255.f));
+                        }
+                    }
+                }
+            }
+        }
+
+        // a strip still uploading after a failure must be done with its allocators first
+        if (next_upload.valid())
+            next_upload.wait();
+        in_gpu.release();
+        next_in_gpu.release();
+
+        vkdev->reclaim_blob_allocator(upload_vkallocator);
+        vkdev->reclaim_staging_allocator(upload_staging_vkallocator);
+        vkdev->reclaim_blob_allocator(blob_vkallocator);
+        vkdev->reclaim_staging_allocator(staging_vkallocator);
+
+        return worker_ret;
+    };
+
+    // the workers are threads of their own rather than an omp team, so the omp region TtaExtractor opens
+    // for the augmentations of a tile is not nested in another one, which would leave it a single thread
+    std::vector<std::future<int>> others;
+    for (int wi = 1; wi < workers; wi++)
+        others.push_back(std::async(std::launch::async, run_worker, wi));
+
+    int ret = run_worker(0);
+    for (auto& other : others)
+    {
+        if (other.get() != 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int processCpuTiles(const ncnn::Net& net, const CpuTileLayout& layout, int scale, int prepadding, const StripFrame& frame, int tile_w, int tile_h)
+{
+    if (frame.weight)
+        return -1;
+
+    const int w = frame.width;
+    const int h = frame.height;
+    const float* srcps[3] = { frame.srcpR, frame.srcpG, frame.srcpB };
+    float* dstps[3] = { frame.dstpR, frame.dstpG, frame.dstpB };
+
+    // the gpu postproc rounds by adding half a step of 255 before the download divides, kept so both paths agree
+    const float round_eps = 0.5f / 255.f;
+
+    auto border = [&](int v, int n) {
+        if (layout.reflect)
+            return (n - 1) - std::abs(std::abs(v) - (n - 1));
+        return std::min(std::max(v, 0), n - 1);
+    };
+
+    const int xtiles = (w + tile_w - 1) / tile_w;
+    const int ytiles = (h + tile_h - 1) / tile_h;
+
+    for (int yi = 0; yi < ytiles; yi++)
+    {
+        for (int xi = 0; xi < xtiles; xi++)
+        {
+            const int x0 = xi * tile_w;
+            const int y0 = yi * tile_h;
+            const int tw = std::min(tile_w, w - x0);
+            const int th = std::min(tile_h, h - y0);
+            const int pad_right = prepadding + (tw + layout.align - 1) / layout.align * layout.align - tw;
+            const int pad_bottom = prepadding + (th + layout.align - 1) / layout.align * layout.align - th;
+
+            // the net takes 0-1 values, which the gpu path gets by scaling the 0-255 strips back in preproc
+            ncnn::Mat in(prepadding + tw + pad_right, prepadding + th + pad_bottom, 3);
+            if (in.empty())
+                return -1;
+            for (int c = 0; c < 3; c++)
+            {
+                float* p = in.channel(c);
+                for (int y = 0; y < in.h; y++)
+                {
+                    const float* s = srcps[c] + border(y0 - prepadding + y, h) * frame.src_stride;
+                    for (int x = 0; x < in.w; x++)
+                    {
+                        p[in.w * y + x] = s[border(x0 - prepadding + x, w)];
+                    }
+                }
+            }
+
+            ncnn::Mat out;
+            ncnn::Extractor ex = net.create_extractor();
+            ex.input(layout.input, in);
+            if (ex.extract(layout.output, out) != 0)
+                return -1;
+
+            const int crop = layout.padded_output ? prepadding * scale : 0;
+            if (out.w < crop + tw * scale || out.h < crop + th * scale || out.c < 3)
+                return -1;
+
+            for (int c = 0; c < 3; c++)
+            {
+                const float* o = out.channel(c);
+                float* d = dstps[c] + y0 * scale * frame.dst_stride + x0 * scale;
+                for (int y = 0; y < th * scale; y++)
+                {
+                    for (int x = 0; x < tw * scale; x++)
+                    {
+                        d[frame.dst_stride * y + x] = std::min(1.f, std::max(0.f, o[out.w * (y + crop) + x + crop] + round_eps));
+                    }
+                }
+            }
+        }
+    }
+
+    if (frame.srcpA)
+    {
+        ncnn::Mat alpha(w, h, 1);
+        for (int y = 0; y < h; y++)
+            memcpy(alpha.row(y), frame.srcpA + y * frame.src_stride, w * sizeof(float));
+
+        // the whole plane at once, the interpolation doesn't need tiles
+        ncnn::Mat alpha_out = alpha;
+        if (scale > 1)
+        {
+            ncnn::Layer* bicubic = ncnn::create_layer("Interp");
+
+            ncnn::ParamDict pd;
+            pd.set(0, 3);// bicubic
+            pd.set(1, (float)scale);
+            pd.set(2, (float)scale);
+            bicubic->load_param(pd);
+
+            bicubic->create_pipeline(net.opt);
+            const int forwarded = bicubic->forward(alpha, alpha_out, net.opt);
+            bicubic->destroy_pipeline(net.opt);
+            delete bicubic;
+
+            if (forwarded != 0 || alpha_out.empty())
+                return -1;
+        }
+
+        for (int y = 0; y < alpha_out.h; y++)
+        {
+            const float* a = alpha_out.row(y);
+            float* d = frame.dstpA + y * frame.dst_stride;
+            for (int x = 0; x < alpha_out.w; x++)
+            {
+                d[x] = std::min(1.f, std::max(0.f, a[x] + round_eps));
+            }
+        }
+    }
+
+    return 0;
+}
+
+TtaExtractor::TtaExtractor(const ncnn::Net& net, int count)
+    : _net(net), _count(count)
+{
+    _workers = std::min(count, (int)net.vulkan_device()->info.compute_queue_count());
+
+    for (int wi = 0; _workers > 1 && wi < _workers; wi++)
+    {
+        _blob_vkallocators.push_back(net.vulkan_device()->acquire_blob_allocator());
+        _staging_vkallocators.push_back(net.vulkan_device()->acquire_staging_allocator());
+    }
+}
+
+TtaExtractor::~TtaExtractor()
+{
+    for (int wi = 0; wi < (int)_blob_vkallocators.size(); wi++)
+    {
+        _net.vulkan_device()->reclaim_blob_allocator(_blob_vkallocators[wi]);
+        _net.vulkan_device()->reclaim_staging_allocator(_staging_vkallocators[wi]);
+    }
+}
+
+int TtaExtractor::extract(const char* input, const char* output, const ncnn::VkMat* in_tiles, ncnn::VkMat* out_tiles, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator) const
+{
+    int ret = 0;
+
+    if (_workers > 1)
+    {
+        // the augmentations read the preprocessed tiles from other queues
+        if (cmd.submit_and_wait() != 0)
+            ret = -1;
+        cmd.reset();
+
+        // each worker reports into its own slot, read once the region has joined
+        std::vector<int> worker_rets(_workers, 0);
+
+        #pragma omp parallel for num_threads(_workers)
+        for (int wi = 0; wi < _workers; wi++)
+        {
+            ncnn::VkCompute tta_cmd(_net.vulkan_device());
+
+            for (int ti = wi; ti < _count; ti += _workers)
+            {
+                ncnn::Extractor ex = _net.create_extractor();
+
+                ex.set_blob_vkallocator(_blob_vkallocators[wi]);
+                ex.set_workspace_vkallocator(_blob_vkallocators[wi]);
+                ex.set_staging_vkallocator(_staging_vkallocators[wi]);
+
+                ex.input(input, in_tiles[ti]);
+
+                const int extracted = ex.extract(output, out_tiles[ti], tta_cmd);
+
+                // let the next augmentation of this worker reuse the intermediate blobs
+                if (extracted != 0)
+                    worker_rets[wi] = extracted;
+                else if (tta_cmd.submit_and_wait() != 0)
+                    worker_rets[wi] = -1;
+                tta_cmd.reset();
+            }
+        }
+
+        for (int wi = 0; wi < _workers; wi++)
+        {
+            if (worker_rets[wi] != 0)
+                ret = worker_rets[wi];
+        }
+    }
+    else
+    {
+        for (int ti = 0; ti < _count; ti++)
+        {
+            ncnn::Extractor ex = _net.create_extractor();
+
+            ex.set_blob_vkallocator(blob_vkallocator);
+            ex.set_workspace_vkallocator(blob_vkallocator);
+            ex.set_staging_vkallocator(staging_vkallocator);
+
+            ex.input(input, in_tiles[ti]);
+
+            const int extracted = ex.extract(output, out_tiles[ti], cmd);
+            if (extracted != 0)
+                ret = extracted;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,120 @@
+#ifndef TILE_PROCESS_HPP
+#define TILE_PROCESS_HPP
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// ncnn
+#include "net.h"
+#include "gpu.h"
+
+// the frame-level half of the engines, shared by Waifu2x, RealESRGAN and SRMD: cutting a frame into strips,
+// moving them to and from the device and retrying with smaller tiles; the engines only record their networks
+
+// a device allocation that failed, the value ncnn layers return for it too; the only error smaller tiles can help with
+enum { TILE_OUT_OF_MEMORY = -100 };
+
+// the tile size after halving shift times, kept a multiple of 4 and no smaller than 32
+int reducedTilesize(int tilesize, int shift);
+
+// the input pixels [x0, x1) x [y0, y1) of a frame and the output they upscale to
+struct TileRegion
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+// regions that ran out of device memory, collected from every strip worker
+class FailedRegions
+{
+public:
+    void add(const TileRegion& region);
+    std::vector<TileRegion> take();
+
+private:
+    std::mutex _lock;
+    std::vector<TileRegion> _regions;
+};
+
+// process_tiles(tile_w, tile_h, region, failed) over the whole width x height frame with the configured tiles halved shift times;
+// the parts it adds to failed for running out of device memory run again with tiles half the size, and the smaller tiles
+// stay in shift for every later frame. any other error fails the frame straight away
+typedef std::function<int(int tile_w, int tile_h, const TileRegion& region, FailedRegions& failed)> RegionProcessor;
+int processShrinkingTiles(std::atomic<int>& shift, int tilesize_w, int tilesize_h, int width, int height, const RegionProcessor& process_tiles);
+
+// planar 0-1 float frame and its upscaled destination, srcpA/dstpA and weight are optional
+struct StripFrame
+{
+    const float* srcpR;
+    const float* srcpG;
+    const float* srcpB;
+    const float* srcpA;
+    float* dstpR;
+    float* dstpG;
+    float* dstpB;
+    float* dstpA;
+    int width;
+    int height;
+    int src_stride;
+    int dst_stride;
+    // one 0-1 value per input pixel, tiles where it is all zero are left to the blend
+    const float* weight;
+    int weight_stride;
+};
+
+// records the network over the width x height region at (x0, y0) of in_gpu into out_gpu, as the engines' process_gpu
+typedef std::function<int(const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, const unsigned char* tile_mask)> StripRecorder;
+
+// upscale region of frame by scale with tile_w x tile_h tiles, one row of tiles at a time
+// strips are spread over up to strip_workers compute queues, each strip uploading while the one before it computes;
+// with frame.weight the output is blended with a bilinear resample of the input by roi_blend
+// a strip that runs out of device memory is added to failed and the others carry on, 0 is then still returned
+// the strips are copied to and from vkdev with the options net_opt of the net record runs
+// a group of tile columns is at most group_width input pixels wide but at least one tile, 0 sizes the groups by the heap budget alone
+int processStrips(const ncnn::VulkanDevice* vkdev, const ncnn::Option& net_opt, const ncnn::Pipeline* roi_blend, int scale, int prepadding, int strip_workers, const StripFrame& frame, const TileRegion& region, int tile_w, int tile_h, const StripRecorder& record, FailedRegions& failed, int group_width = 0);
+
+// how the cpu path pads and crops tiles for an engine's network, as its preproc and postproc shaders do on the gpu
+struct CpuTileLayout
+{
+    const char* input;
+    const char* output;
+    // past the frame edge the padding mirrors the frame instead of repeating its edge pixels
+    bool reflect;
+    // the right and bottom padding also round the tile up to a multiple of this
+    int align;
+    // the output still holds the upscaled padding, which is cropped off
+    bool padded_output;
+};
+
+// upscale frame with a net loaded for the cpu, as precision=8 runs its int8 models, in tile_w x tile_h tiles one after another
+// the alpha plane is resampled bicubic like on the gpu; weight is not supported and fails
+int processCpuTiles(const ncnn::Net& net, const CpuTileLayout& layout, int scale, int prepadding, const StripFrame& frame, int tile_w, int tile_h);
+
+// runs a net on the augmented copies of one tile
+// with more than one compute queue the copies are spread over them, each worker extracting with its own allocators
+class TtaExtractor
+{
+public:
+    TtaExtractor(const ncnn::Net& net, int count);
+    ~TtaExtractor();
+
+    // whether the copies run on other queues, tiles must then be submitted before the caller's allocators are reused
+    bool parallel() const { return _workers > 1; }
+
+    // extract output from input for in_tiles[0..count) into out_tiles
+    // when parallel, what cmd recorded so far is submitted first, the other queues read the tiles it preprocessed
+    int extract(const char* input, const char* output, const ncnn::VkMat* in_tiles, ncnn::VkMat* out_tiles, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator) const;
+
+private:
+    const ncnn::Net& _net;
+    int _count;
+    int _workers;
+    std::vector<ncnn::VkAllocator*> _blob_vkallocators;
+    std::vector<ncnn::VkAllocator*> _staging_vkallocators;
+};
+
+#endif // TILE_PROCESS_HPP
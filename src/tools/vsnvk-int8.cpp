@@ -0,0 +1,432 @@
+// vsnvk-int8: calibrate a net on frames written by ExportFrame and write an int8 copy of it
+// usage: vsnvk-int8 [-t tile_size] [-n max_tiles] [-j threads] in.param in.bin out.param out.bin frame.raw [frame.raw ...]
+//
+// activation scales come from the largest absolute value seen at the input of every convolution,
+// weight scales from the largest absolute weight of every output channel
+// the calibration table is written next to out.param with a .table extension
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "net.h"
+#include "mat.h"
+#include "frame-writer.hpp"
+
+#define TAG_FP16 0x01306B47
+#define TAG_INT8 0x000D4B38
+#define TAG_FP32_EXTRA 0x0002C056
+
+struct LayerDesc
+{
+    std::string type;
+    std::string name;
+    std::vector<std::string> bottoms;
+    std::vector<std::string> tops;
+    std::vector<std::string> params; // "key=value" as found in the file
+
+    int get(int key, int default_value) const
+    {
+        const std::string prefix = std::to_string(key) + "=";
+        for (const std::string& p : params)
+        {
+            if (p.compare(0, prefix.size(), prefix) == 0)
+                return atoi(p.c_str() + prefix.size());
+        }
+        return default_value;
+    }
+};
+
+static bool read_file(const char* path, std::vector<unsigned char>& data)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    data.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    const bool ok = data.empty() || fread(data.data(), data.size(), 1, fp) == 1;
+    fclose(fp);
+    return ok;
+}
+
+static bool read_param(const char* path, int& blob_count, std::vector<LayerDesc>& layers)
+{
+    std::vector<unsigned char> data;
+    if (!read_file(path, data))
+        return false;
+
+    std::istringstream ss(std::string(data.begin(), data.end()));
+    int magic = 0, layer_count = 0;
+    ss >> magic >> layer_count >> blob_count;
+    if (magic != 7767517)
+        return false;
+
+    std::string line;
+    std::getline(ss, line);
+    for (int i = 0; i < layer_count && std::getline(ss, line); i++)
+    {
+        std::istringstream ls(line);
+        LayerDesc layer;
+        int bottom_count = 0, top_count = 0;
+        ls >> layer.type >> layer.name >> bottom_count >> top_count;
+        if (ls.fail())
+        {
+            i--;
+            continue;
+        }
+        layer.bottoms.resize(bottom_count);
+        layer.tops.resize(top_count);
+        for (std::string& b : layer.bottoms)
+            ls >> b;
+        for (std::string& t : layer.tops)
+            ls >> t;
+        std::string p;
+        while (ls >> p)
+            layer.params.push_back(p);
+        layers.push_back(layer);
+    }
+
+    return (int)layers.size() == layer_count;
+}
+
+// size in bytes of a weight blob stored with a leading tag, and its values when wanted
+static size_t read_tagged(const std::vector<unsigned char>& bin, size_t pos, size_t count, std::vector<float>* values)
+{
+    if (pos + 4 > bin.size())
+        return 0;
+
+    uint32_t tag;
+    memcpy(&tag, &bin[pos], 4);
+    const unsigned char* p = &bin[pos + 4];
+
+    size_t size;
+    if (tag == TAG_FP16)
+        size = 4 + (count * 2 + 3) / 4 * 4;
+    else if (tag == TAG_INT8)
+        size = 4 + (count + 3) / 4 * 4;
+    else if (tag == TAG_FP32_EXTRA || tag == 0)
+        size = 4 + count * 4;
+    else
+        size = 4 + 256 * 4 + (count + 3) / 4 * 4; // 8 bit indices into a table
+    if (pos + size > bin.size())
+        return 0;
+
+    if (values)
+    {
+        values->resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (tag == TAG_FP16)
+            {
+                unsigned short h;
+                memcpy(&h, p + i * 2, 2);
+                (*values)[i] = ncnn::float16_to_float32(h);
+            }
+            else if (tag == TAG_INT8)
+                return 0; // already quantized
+            else if (tag == TAG_FP32_EXTRA || tag == 0)
+                memcpy(&(*values)[i], p + i * 4, 4);
+            else
+                memcpy(&(*values)[i], p + p[256 * 4 + i] * 4, 4);
+        }
+    }
+
+    return size;
+}
+
+static bool read_frame(const char* path, FrameWriterHeader& header, std::vector<unsigned char>& data)
+{
+    if (!read_file(path, data) || data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, FRAME_WRITER_MAGIC, sizeof(header.magic)) != 0 || header.version != 1)
+        return false;
+    if (header.colorFamily != cmRGB || header.sampleType != stFloat || header.bytesPerSample != 4 || header.numPlanes != 3)
+        return false;
+    for (int plane = 0; plane < 3; plane++)
+    {
+        if (header.offset[plane] + int64_t(header.width[plane]) * header.height[plane] * 4 > (int64_t)data.size())
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int tile_size = 200;
+    int max_tiles = 500;
+    int threads = 4;
+
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        if (strcmp(argv[i], "-t") == 0)
+            tile_size = std::max(16, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "-n") == 0)
+            max_tiles = std::max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "-j") == 0)
+            threads = std::max(1, atoi(argv[i + 1]));
+        else
+            break;
+    }
+    if (argc - i < 5)
+    {
+        fprintf(stderr, "usage: %s [-t tile_size] [-n max_tiles] [-j threads] in.param in.bin out.param out.bin frame.raw [frame.raw ...]\n", argv[0]);
+        return 1;
+    }
+
+    const char* in_param = argv[i];
+    const char* in_bin = argv[i + 1];
+    const std::string out_param = argv[i + 2];
+    const char* out_bin = argv[i + 3];
+    const int first_frame = i + 4;
+
+    int blob_count = 0;
+    std::vector<LayerDesc> layers;
+    std::vector<unsigned char> bin;
+    if (!read_param(in_param, blob_count, layers) || !read_file(in_bin, bin))
+    {
+        fprintf(stderr, "vsnvk-int8: can't read %s / %s\n", in_param, in_bin);
+        return 1;
+    }
+
+    std::string input_name;
+    std::map<std::string, float> absmax; // blob at the input of a convolution -> largest absolute value
+    for (const LayerDesc& layer : layers)
+    {
+        if (layer.type == "Input" && input_name.empty() && !layer.tops.empty())
+            input_name = layer.tops[0];
+        if (layer.type == "Convolution")
+        {
+            if (layer.get(8, 0) != 0)
+            {
+                fprintf(stderr, "vsnvk-int8: %s is already quantized\n", layer.name.c_str());
+                return 1;
+            }
+            absmax[layer.bottoms[0]] = 0.f;
+        }
+    }
+    if (input_name.empty() || absmax.empty())
+    {
+        fprintf(stderr, "vsnvk-int8: the net has no input or no convolution\n");
+        return 1;
+    }
+
+    // calibration runs on the cpu in plain fp32 so every intermediate blob can be read back
+    ncnn::Net net;
+    net.opt.use_vulkan_compute = false;
+    net.opt.use_packing_layout = false;
+    net.opt.use_fp16_packed = false;
+    net.opt.use_fp16_storage = false;
+    net.opt.use_fp16_arithmetic = false;
+    net.opt.use_bf16_storage = false;
+    net.opt.use_int8_inference = false;
+    net.opt.lightmode = false;
+    net.opt.num_threads = threads;
+    if (net.load_param(in_param) || net.load_model(in_bin))
+    {
+        fprintf(stderr, "vsnvk-int8: can't load %s\n", in_param);
+        return 1;
+    }
+
+    int tiles = 0;
+    for (int fi = first_frame; fi < argc && tiles < max_tiles; fi++)
+    {
+        FrameWriterHeader header;
+        std::vector<unsigned char> frame;
+        if (!read_frame(argv[fi], header, frame))
+        {
+            fprintf(stderr, "vsnvk-int8: %s is not an RGBS frame written by ExportFrame\n", argv[fi]);
+            return 1;
+        }
+
+        // whole tiles only, sized to a multiple of 4 so every model accepts them
+        const int w = header.width[0];
+        const int h = header.height[0];
+        const int tw = std::min(tile_size, w) / 4 * 4;
+        const int th = std::min(tile_size, h) / 4 * 4;
+        if (tw == 0 || th == 0)
+            continue;
+
+        for (int y0 = 0; y0 + th <= h && tiles < max_tiles; y0 += th)
+        {
+            for (int x0 = 0; x0 + tw <= w && tiles < max_tiles; x0 += tw)
+            {
+                // the nets see 0-1 rgb, the same range the preprocess shaders produce
+                ncnn::Mat in(tw, th, 3);
+                for (int c = 0; c < 3; c++)
+                {
+                    const float* plane = reinterpret_cast<const float*>(frame.data() + header.offset[c]);
+                    float* out = in.channel(c);
+                    for (int y = 0; y < th; y++)
+                        memcpy(out + y * tw, plane + int64_t(y0 + y) * w + x0, tw * sizeof(float));
+                }
+
+                ncnn::Extractor ex = net.create_extractor();
+                ex.input(input_name.c_str(), in);
+                for (auto& stat : absmax)
+                {
+                    ncnn::Mat blob;
+                    if (ex.extract(stat.first.c_str(), blob))
+                        continue;
+                    const float* p = blob;
+                    const size_t total = blob.total() * blob.elempack;
+                    for (size_t k = 0; k < total; k++)
+                        stat.second = std::max(stat.second, std::fabs(p[k]));
+                }
+
+                tiles++;
+            }
+        }
+
+        fprintf(stderr, "vsnvk-int8: %s, %d tiles\n", argv[fi], tiles);
+    }
+
+    if (tiles == 0)
+    {
+        fprintf(stderr, "vsnvk-int8: no calibration tiles\n");
+        return 1;
+    }
+
+    const std::string table_path = out_param.substr(0, out_param.rfind('.')) + ".table";
+    FILE* param_fp = fopen(out_param.c_str(), "wb");
+    FILE* bin_fp = fopen(out_bin, "wb");
+    FILE* table_fp = fopen(table_path.c_str(), "wb");
+    if (!param_fp || !bin_fp || !table_fp)
+    {
+        fprintf(stderr, "vsnvk-int8: can't create the output files\n");
+        return 1;
+    }
+
+    fprintf(param_fp, "7767517\n%d %d\n", (int)layers.size(), blob_count);
+
+    // rewrite the weights layer by layer, every layer type with weights in the file has to be known to find the next one
+    size_t pos = 0;
+    bool ok = true;
+    for (LayerDesc& layer : layers)
+    {
+        const bool conv_like = layer.type == "Convolution" || layer.type == "ConvolutionDepthWise" || layer.type == "Deconvolution" || layer.type == "DeconvolutionDepthWise" || layer.type == "InnerProduct";
+
+        if (layer.type == "Convolution")
+        {
+            const int num_output = layer.get(0, 0);
+            const int weight_data_size = layer.get(6, 0);
+            const bool bias_term = layer.get(5, 0) != 0;
+
+            std::vector<float> weights;
+            const size_t size = read_tagged(bin, pos, weight_data_size, &weights);
+            if (size == 0 || num_output <= 0 || pos + size + (bias_term ? num_output * 4 : 0) > bin.size())
+            {
+                ok = false;
+                break;
+            }
+            pos += size;
+
+            // one scale per output channel
+            const int per_channel = weight_data_size / num_output;
+            std::vector<float> weight_scales(num_output);
+            std::vector<signed char> qweights(weight_data_size);
+            for (int oc = 0; oc < num_output; oc++)
+            {
+                float m = 0.f;
+                for (int k = 0; k < per_channel; k++)
+                    m = std::max(m, std::fabs(weights[oc * per_channel + k]));
+                weight_scales[oc] = m == 0.f ? 1.f : 127.f / m;
+                for (int k = 0; k < per_channel; k++)
+                {
+                    const float q = std::round(weights[oc * per_channel + k] * weight_scales[oc]);
+                    qweights[oc * per_channel + k] = (signed char)std::min(127.f, std::max(-127.f, q));
+                }
+            }
+
+            const float m = absmax[layer.bottoms[0]];
+            const float bottom_scale = m == 0.f ? 1.f : 127.f / m;
+
+            const uint32_t tag = TAG_INT8;
+            const unsigned char pad[4] = { 0, 0, 0, 0 };
+            fwrite(&tag, 4, 1, bin_fp);
+            fwrite(qweights.data(), 1, qweights.size(), bin_fp);
+            fwrite(pad, 1, (4 - qweights.size() % 4) % 4, bin_fp);
+            if (bias_term)
+            {
+                fwrite(&bin[pos], 4, num_output, bin_fp);
+                pos += num_output * 4;
+            }
+            fwrite(weight_scales.data(), 4, num_output, bin_fp);
+            fwrite(&bottom_scale, 4, 1, bin_fp);
+
+            layer.params.push_back("8=1");
+
+            fprintf(table_fp, "%s_param_0", layer.name.c_str());
+            for (float s : weight_scales)
+                fprintf(table_fp, " %f", s);
+            fprintf(table_fp, "\n%s %f\n", layer.name.c_str(), bottom_scale);
+        }
+        else if (conv_like)
+        {
+            // kept in float, copied as they are
+            const int num_output = layer.get(0, 0);
+            const int weight_data_size = layer.type == "InnerProduct" ? layer.get(2, 0) : layer.get(6, 0);
+            const bool bias_term = layer.get(layer.type == "InnerProduct" ? 1 : 5, 0) != 0;
+
+            const size_t size = read_tagged(bin, pos, weight_data_size, nullptr) + (bias_term ? num_output * 4 : 0);
+            if (size == 0 || pos + size > bin.size())
+            {
+                ok = false;
+                break;
+            }
+            fwrite(&bin[pos], 1, size, bin_fp);
+            pos += size;
+        }
+        else if (layer.type == "PReLU")
+        {
+            const size_t size = layer.get(0, 0) * 4;
+            if (pos + size > bin.size())
+            {
+                ok = false;
+                break;
+            }
+            fwrite(&bin[pos], 1, size, bin_fp);
+            pos += size;
+        }
+        else if (layer.type == "BatchNorm" || layer.type == "Scale" || layer.type == "MemoryData" || layer.type == "Embed" || layer.type == "InstanceNorm" || layer.type == "GroupNorm" || layer.type == "LayerNorm")
+        {
+            fprintf(stderr, "vsnvk-int8: layer type %s is not supported\n", layer.type.c_str());
+            ok = false;
+            break;
+        }
+
+        fprintf(param_fp, "%-16s %-24s %d %d", layer.type.c_str(), layer.name.c_str(), (int)layer.bottoms.size(), (int)layer.tops.size());
+        for (const std::string& b : layer.bottoms)
+            fprintf(param_fp, " %s", b.c_str());
+        for (const std::string& t : layer.tops)
+            fprintf(param_fp, " %s", t.c_str());
+        for (const std::string& p : layer.params)
+            fprintf(param_fp, " %s", p.c_str());
+        fprintf(param_fp, "\n");
+    }
+
+    fclose(param_fp);
+    fclose(bin_fp);
+    fclose(table_fp);
+
+    if (!ok || pos != bin.size())
+    {
+        fprintf(stderr, "vsnvk-int8: %s does not match %s\n", in_bin, in_param);
+        remove(out_param.c_str());
+        remove(out_bin);
+        remove(table_path.c_str());
+        return 1;
+    }
+
+    fprintf(stderr, "vsnvk-int8: wrote %s, %s and %s from %d tiles\n", out_param.c_str(), out_bin, table_path.c_str(), tiles);
+    return 0;
+}
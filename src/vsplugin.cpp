@@ -2,6 +2,9 @@
 #include "waifu2x-filter.hpp"
 #include "real-esrgan-filter.hpp"
 #include "export-frame-filter.hpp"
+#include "chain-filter.hpp"
+#include "srmd-filter.hpp"
+#include "raw-source-filter.hpp"
 
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin)
@@ -18,8 +21,19 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
         "tta_mode:int:opt;"
         "gpu_thread:int:opt;"
         "precision:int:opt;"
+        "arithmetic:int:opt;"
         "tile_size_w:int:opt;"
         "tile_size_h:int:opt;"
+        "model_cache:int:opt;"
+        "roi:int[]:opt;"
+        "mask:clip:opt;"
+        "feather:int:opt;"
+        "cache_dir:data:opt;"
+        "server:data[]:opt;"
+        "lookahead:int:opt;"
+        "autotune:int:opt;"
+        "alpha:clip:opt;"
+        "batch:int:opt;"
         , Waifu2xFilterCreate, nullptr, plugin);
 
     registerFunc("RealESRGAN",
@@ -30,12 +44,59 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
         "gpu_id:int:opt;"
         "tta_mode:int:opt;"
         "gpu_thread:int:opt;"
+        "precision:int:opt;"
+        "arithmetic:int:opt;"
+        "roi:int[]:opt;"
+        "mask:clip:opt;"
+        "feather:int:opt;"
+        "cache_dir:data:opt;"
+        "server:data[]:opt;"
+        "lookahead:int:opt;"
+        "autotune:int:opt;"
+        "alpha:clip:opt;"
+        "batch:int:opt;"
         , RealESRGANFilterCreate, nullptr, plugin);
 
+    registerFunc("SRMD",
+        "clip:clip;"
+        "noise:int:opt;"
+        "scale:int:opt;"
+        "tile_size:int:opt;"
+        "gpu_id:int:opt;"
+        "tta_mode:int:opt;"
+        "gpu_thread:int:opt;"
+        "lookahead:int:opt;"
+        , SRMDFilterCreate, nullptr, plugin);
+
     registerFunc("ExportFrame",
+        "clip:clip;"
         "dir:data;"
         "prefix:data:opt;"
         "suffix:data:opt;"
         "frame:int:opt;"
+        "threads:int:opt;"
+        "queue:int:opt;"
+        "direct_io:int:opt;"
         , ExportFrameFilterCreate, nullptr, plugin);
+
+    registerFunc("RawSource",
+        "dir:data;"
+        "prefix:data:opt;"
+        "suffix:data:opt;"
+        "length:int:opt;"
+        "fpsnum:int:opt;"
+        "fpsden:int:opt;"
+        "readahead:int:opt;"
+        , RawSourceFilterCreate, nullptr, plugin);
+
+    registerFunc("Chain",
+        "clip:clip;"
+        "filter:data[];"
+        "model:data[]:opt;"
+        "noise:int[]:opt;"
+        "scale:int[]:opt;"
+        "tile_size:int:opt;"
+        "gpu_id:int:opt;"
+        "gpu_thread:int:opt;"
+        , ChainFilterCreate, nullptr, plugin);
 }
@@ -1,278 +1,679 @@
-/*
-  MIT License
-
-  Copyright (c) 2018-2019 HolyWu
-  Copyright (c) 2019-2020 NaLan ZeYu
-
-  Permission is hereby granted, free of charge, to any person obtaining a copy
-  of this software and associated documentation files (the "Software"), to deal
-  in the Software without restriction, including without limitation the rights
-  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
-  copies of the Software, and to permit persons to whom the Software is
-  furnished to do so, subject to the following conditions:
-
-  The above copyright notice and this permission notice shall be included in all
-  copies or substantial portions of the Software.
-
-  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-  SOFTWARE.
-*/
-
-#include <fstream>
-#include <algorithm>
-
-#include "filter-common.hpp"
-#include "waifu2x-filter.hpp"
-#include "gpu.h"
-#include "waifu2x.hpp"
-#include "vsplugin.hpp"
-
-typedef struct {
-    VSNodeRef *node;
-    VSVideoInfo vi;
-    Waifu2x *waifu2x;
-} Waifu2xFilterData;
-
-static int Waifu2xFilter(const VSFrameRef *src, VSFrameRef *dst, Waifu2xFilterData * const VS_RESTRICT d, const VSAPI *vsapi) noexcept {
-    const int width = vsapi->getFrameWidth(src, 0);
-    const int height = vsapi->getFrameHeight(src, 0);
-    const int srcStride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
-    const int dstStride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
-    auto *             srcR = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0));
-    auto *             srcG = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1));
-    auto *             srcB = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2));
-    auto * VS_RESTRICT dstR = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0));
-    auto * VS_RESTRICT dstG = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1));
-    auto * VS_RESTRICT dstB = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2));
-    return d->waifu2x->process(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride);
-}
-
-static void VS_CC Waifu2xFilterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
-    auto *d = static_cast<Waifu2xFilterData *>(*instanceData);
-    vsapi->setVideoInfo(&d->vi, 1, node);
-}
-
-static const VSFrameRef *VS_CC Waifu2xFilterGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    auto *d = static_cast<Waifu2xFilterData *>(*instanceData);
-
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
-        int err = Waifu2xFilter(src, dst, d, vsapi);
-        if (err) {
-            vsapi->setFilterError("Waifu2x-NCNN-Vulkan: Waifu2x filter error.", frameCtx);
-        } else {
-            return dst;
-        }
-    }
-    return nullptr;
-}
-
-static void VS_CC Waifu2xFilterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    auto *d = static_cast<Waifu2xFilterData *>(instanceData);
-    vsapi->freeNode(d->node);
-    delete d->waifu2x;
-    delete d;
-    tryDestoryGpuInstance();
-}
-
-void VS_CC Waifu2xFilterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
-    Waifu2xFilterData d{};
-    d.node = vsapi->propGetNode(in, "clip", 0, nullptr);
-    d.vi = *vsapi->getVideoInfo(d.node);
-
-    int gpuId, ttaMode, noise, scale, model, tileSizeW, tileSizeH, gpuThread, precision;
-    std::string paramPath, modelPath;
-    char const * err_prompt = nullptr;
-    do {
-        int err;
-
-        err = tryCreateGpuInstance();
-        if (err) {
-            err_prompt = "create gpu instance failed";
-            break;
-        }
-
-        if (!isConstantFormat(&d.vi) || d.vi.format->colorFamily != cmRGB || d.vi.format->sampleType != stFloat || d.vi.format->bitsPerSample != 32) {
-            err_prompt = "only constant RGB format and 32 bit float input supported";
-            break;
-        }
-
-        gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", 0, &err));
-        if (gpuId < 0 || gpuId >= ncnn::get_gpu_count()) {
-            err_prompt = "invalid 'gpu_id'";
-            break;
-        }
-
-        ttaMode = int64ToIntS(vsapi->propGetInt(in, "tta_mode", 0, &err));
-        if (ttaMode < 0 || ttaMode > 1) {
-            err_prompt = "'tta_mode' must be 0 or 1";
-            break;
-        }
-
-        noise = int64ToIntS(vsapi->propGetInt(in, "noise", 0, &err));
-        if (noise < -1 || noise > 3) {
-            err_prompt = "'noise' must be -1, 0, 1, 2, or 3";
-            break;
-        }
-
-        scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
-        if (err)
-            scale = 2;
-        if (scale != 1 && scale != 2) {
-            err_prompt = "'scale' must be 1 or 2";
-            break;
-        }
-
-        model = int64ToIntS(vsapi->propGetInt(in, "model", 0, &err));
-        if (model < 0 || model > 2) {
-            err_prompt = "'model' must be 0, 1 or 2";
-            break;
-        }
-
-        precision = int64ToIntS(vsapi->propGetInt(in, "precision", 0, &err));
-        if (err)
-            precision = 16;
-        if (precision != 16 && precision != 32) {
-            err_prompt = "'precision' must be 16 or 32";
-            break;
-        }
-
-        int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
-        if (customGpuThread > 0) {
-            gpuThread = customGpuThread;
-        }
-        else {
-            gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
-        }
-        gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
-
-        int tileSize = int64ToIntS(vsapi->propGetInt(in, "tile_size", 0, &err));
-        if (tileSize == 0) {
-            double vram = ncnn::get_gpu_device(gpuId)->get_heap_budget(); // in MByte
-            double factor = (precision == 32 ? 2 : 1) * (model == 2 ? 1.5 : 1) * gpuThread;
-            if (vram / factor > 900)
-                tileSize = 360;
-            else if (vram / factor > 450)
-                tileSize = 240;
-            else
-                tileSize = 180;
-        }
-        if (tileSize < 32) {
-            err_prompt = "'tile_size' must be greater than or equal to 32";
-            break;
-        }
-        if (tileSize % 4) {
-            err_prompt = "'tile_size' must be multiple of 4";
-            break;
-        }
-        tileSizeW = tileSizeH = tileSize;
-
-        int tw = int64ToIntS(vsapi->propGetInt(in, "tile_size_w", 0, &err));
-        if (!err) {
-            if (tw < 32) {
-                err_prompt = "'tile_size_w' must be greater than or equal to 32";
-                break;
-            }
-            if (tw % 4) {
-                err_prompt = "'tile_size_w' must be multiple of 4";
-                break;
-            }
-            tileSizeW = tw;
-        }
-
-        int th = int64ToIntS(vsapi->propGetInt(in, "tile_size_h", 0, &err));
-        if (!err) {
-            if (th < 32) {
-                err_prompt = "'tile_size_h' must be greater than or equal to 32";
-                break;
-            }
-            if (th % 4) {
-                err_prompt = "'tile_size_h' must be multiple of 4";
-                break;
-            }
-            tileSizeH = th;
-        }
-
-        if (scale == 1 && noise == -1) {
-            err_prompt = "use 'noise=-1' and 'scale=1' at same time is useless";
-            break;
-        }
-
-        if (scale == 1 && model != 2) {
-            err_prompt = "only cunet model support 'scale=1'";
-            break;
-        }
-
-        // set model path
-        const std::string pluginFilePath{ vsapi->getPluginPath(vsapi->getPluginById(VSPLUGIN_IDENTIFIER_STR, core)) };
-        const std::string pluginDir = pluginFilePath.substr(0, pluginFilePath.find_last_of('/'));
-
-        std::string modelsDir = pluginDir + "/ncnn-models/Waifu2x/";
-        if (model == 0)
-            modelsDir += "models-upconv_7_anime_style_art_rgb/";
-        else if (model == 1)
-            modelsDir += "models-upconv_7_photo/";
-        else
-            modelsDir += "models-cunet/";
-
-        std::string modelName;
-        if (noise == -1)
-            modelName = "scale2.0x_model";
-        else if (scale == 1)
-            modelName = "noise" + std::to_string(noise) + "_model";
-        else
-            modelName = "noise" + std::to_string(noise) + "_scale2.0x_model";
-
-        paramPath = modelsDir + modelName + ".param";
-        modelPath = modelsDir + modelName + ".bin";
-
-        // check model file readable
-        std::ifstream pf(paramPath);
-        std::ifstream mf(modelPath);
-        if (!pf.good() || !mf.good()) {
-            err_prompt = "can't open model file";
-            break;
-        }
-
-        break;
-    } while (false);
-
-    if (err_prompt) {
-        vsapi->setError(out, (std::string{"Waifu2x-NCNN-Vulkan: "} + err_prompt).c_str());
-        vsapi->freeNode(d.node);
-        tryDestoryGpuInstance();
-        return;
-    }
-
-    int prepadding;
-    if (model == 2 && scale == 1)
-        prepadding = 28;
-    else if (model == 2)
-        prepadding = 18;
-    else
-        prepadding = 7;
-
-    d.waifu2x = new Waifu2x(gpuId, gpuThread, ttaMode);
-    d.waifu2x->noise = noise;
-    d.waifu2x->scale = scale;
-    d.waifu2x->tilesize_w = tileSizeW;
-    d.waifu2x->tilesize_h = tileSizeH;
-    d.waifu2x->prepadding = prepadding;
-
-    d.waifu2x->load(paramPath, modelPath);
-
-    d.vi.width *= scale;
-    d.vi.height *= scale;
-
-    auto *data = new Waifu2xFilterData{ d };
-
-    vsapi->createFilter(in, out, "Waifu2x", Waifu2xFilterInit, Waifu2xFilterGetFrame, Waifu2xFilterFree, fmParallel, 0, data, core);
-}
+/*
+  MIT License
+
+  Copyright (c) 2018-2019 HolyWu
+  Copyright (c) 2019-2020 NaLan ZeYu
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+
+#include "autotune.hpp"
+#include "filter-common.hpp"
+#include "model-file.hpp"
+#include "frame-cache.hpp"
+#include "remote-client.hpp"
+#include "waifu2x-filter.hpp"
+#include "gpu.h"
+#include "waifu2x.hpp"
+#include "vsplugin.hpp"
+
+typedef struct {
+    int model;
+    int noise;
+    std::shared_future<std::shared_ptr<Waifu2x>> waifu2x; // holds nullptr when loading failed
+} Waifu2xNet;
+
+typedef struct {
+    VSNodeRef *node;
+    VSNodeRef *mask;
+    VSNodeRef *alpha;
+    VSVideoInfo vi;
+    std::vector<float> roiWeight;
+    int feather;
+    int gpuId, ttaMode, gpuThread, precision, arithmetic, scale;
+    int tileSizeW, tileSizeH; // 0 = auto choose per model
+    int noise, model; // used when a frame has no NcnnNoise / NcnnModel
+    size_t modelCache;
+    std::string pluginDir;
+    std::mutex cacheLock;
+    std::list<Waifu2xNet> nets; // most recently used first
+    std::unique_ptr<FrameCache> cache;
+    std::unique_ptr<RemoteClient> remote; // set when frames go to a vsnvk-server
+    Lookahead lookahead;
+    FrameBatch batch;
+    bool autotune;
+    std::string autotuneCache;
+} Waifu2xFilterData;
+
+static const char *checkModel(int model, int noise, int scale) {
+    if (scale == 1 && noise == -1)
+        return "use 'noise=-1' and 'scale=1' at same time is useless";
+    if (scale == 1 && model != 2)
+        return "only cunet model support 'scale=1'";
+    return nullptr;
+}
+
+// model files relative to ncnn-models, without extension
+static std::string getModelName(int model, int noise, int scale, int precision) {
+    std::string modelDir = "Waifu2x/";
+    if (model == 0)
+        modelDir += "models-upconv_7_anime_style_art_rgb/";
+    else if (model == 1)
+        modelDir += "models-upconv_7_photo/";
+    else
+        modelDir += "models-cunet/";
+
+    // precision=8 uses the copy written by vsnvk-int8 next to the float model
+    const std::string suffix = precision == 8 ? "-int8" : "";
+
+    if (noise == -1)
+        return modelDir + "scale2.0x_model" + suffix;
+    else if (scale == 1)
+        return modelDir + "noise" + std::to_string(noise) + "_model" + suffix;
+    else
+        return modelDir + "noise" + std::to_string(noise) + "_scale2.0x_model" + suffix;
+}
+
+static void getModelPath(const std::string &pluginDir, int model, int noise, int scale, int precision, std::string &paramPath, std::string &modelPath) {
+    const std::string modelName = getModelName(model, noise, scale, precision);
+    paramPath = pluginDir + "/ncnn-models/" + modelName + ".param";
+    modelPath = pluginDir + "/ncnn-models/" + modelName + ".bin";
+}
+
+static int getPrepadding(int model, int scale) {
+    if (model == 2 && scale == 1)
+        return 28;
+    else if (model == 2)
+        return 18;
+    else
+        return 7;
+}
+
+static int autoTileSize(int gpuId, int gpuThread, int precision, int model) {
+    double vram = ncnn::get_gpu_device(gpuId)->get_heap_budget(); // in MByte
+    double factor = (precision == 32 ? 2 : 1) * (model == 2 ? 1.5 : 1) * gpuThread;
+    if (vram / factor > 900)
+        return 360;
+    else if (vram / factor > 450)
+        return 240;
+    else
+        return 180;
+}
+
+// look up the net for (model, noise), starting to load it on a background thread on first use
+// and moving the least recently used one past 'model_cache' to evicted; the caller holds cacheLock
+// and destroys evicted after unlocking, as dropping a net that is still loading waits for the load
+static std::shared_future<std::shared_ptr<Waifu2x>> startWaifu2x(Waifu2xFilterData *d, int model, int noise, std::list<Waifu2xNet> &evicted, char const *&err_prompt) {
+    for (auto it = d->nets.begin(); it != d->nets.end(); ++it) {
+        if (it->model == model && it->noise == noise) {
+            d->nets.splice(d->nets.begin(), d->nets, it);
+            return it->waifu2x;
+        }
+    }
+
+    std::string paramPath, modelPath;
+    getModelPath(d->pluginDir, model, noise, d->scale, d->precision, paramPath, modelPath);
+
+    // check model file readable
+    if (!modelFileExists(paramPath) || !modelFileExists(modelPath)) {
+        err_prompt = "can't open model file";
+        return {};
+    }
+
+    // a net that has finished loading lends its pipelines, one still loading is not waited for
+    std::shared_ptr<Waifu2x> source;
+    if (!d->nets.empty() && d->nets.front().waifu2x.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        source = d->nets.front().waifu2x.get();
+
+    // the loader only sees copies, the filter may be freed while it runs
+    const int gpuId = d->gpuId, gpuThread = d->gpuThread, ttaMode = d->ttaMode, precision = d->precision, arithmetic = d->arithmetic;
+    const int scale = d->scale, tileSizeW = d->tileSizeW, tileSizeH = d->tileSizeH;
+    const bool autotune = d->autotune;
+    const std::string autotuneCache = d->autotuneCache;
+    std::shared_future<std::shared_ptr<Waifu2x>> future = loadInBackground([=]() {
+        auto waifu2x = std::make_shared<Waifu2x>(gpuId, gpuThread, ttaMode, precision, arithmetic);
+        waifu2x->noise = noise;
+        waifu2x->scale = scale;
+        waifu2x->tilesize_w = tileSizeW ? tileSizeW : autoTileSize(gpuId, gpuThread, precision, model);
+        waifu2x->tilesize_h = tileSizeH ? tileSizeH : autoTileSize(gpuId, gpuThread, precision, model);
+        waifu2x->prepadding = getPrepadding(model, scale);
+        waifu2x->strip_workers = stripWorkers(gpuId, gpuThread);
+
+        if (waifu2x->load(paramPath, modelPath, source.get()))
+            return std::shared_ptr<Waifu2x>();
+        if (autotune)
+            waifu2x->autotune(paramPath, modelPath, autotuneCache);
+        return waifu2x;
+    });
+
+    d->nets.push_front(Waifu2xNet{ model, noise, future });
+    if (d->nets.size() > d->modelCache)
+        evicted.splice(evicted.end(), d->nets, std::prev(d->nets.end()));
+
+    return future;
+}
+
+// the net for (model, noise), waiting for it to finish loading
+static std::shared_ptr<Waifu2x> acquireWaifu2x(Waifu2xFilterData *d, int model, int noise, char const *&err_prompt) {
+    std::shared_future<std::shared_ptr<Waifu2x>> future;
+    std::list<Waifu2xNet> evicted;
+    {
+        std::lock_guard<std::mutex> lock(d->cacheLock);
+        future = startWaifu2x(d, model, noise, evicted, err_prompt);
+    }
+    evicted.clear();
+    if (!future.valid())
+        return nullptr;
+
+    std::shared_ptr<Waifu2x> waifu2x = future.get();
+    if (!waifu2x)
+        err_prompt = "can't load model";
+    return waifu2x;
+}
+
+static int Waifu2xFilter(const VSFrameRef *src, VSFrameRef *dst, const VSFrameRef *srcAlpha, VSFrameRef *dstAlpha, const float *weight, const Waifu2x *waifu2x, const VSAPI *vsapi) noexcept {
+    const int width = vsapi->getFrameWidth(src, 0);
+    const int height = vsapi->getFrameHeight(src, 0);
+    const int srcStride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
+    const int dstStride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
+    auto *             srcR = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0));
+    auto *             srcG = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1));
+    auto *             srcB = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2));
+    auto * VS_RESTRICT dstR = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0));
+    auto * VS_RESTRICT dstG = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1));
+    auto * VS_RESTRICT dstB = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2));
+    auto *             srcA = srcAlpha ? reinterpret_cast<const float *>(vsapi->getReadPtr(srcAlpha, 0)) : nullptr;
+    auto * VS_RESTRICT dstA = dstAlpha ? reinterpret_cast<float *>(vsapi->getWritePtr(dstAlpha, 0)) : nullptr;
+    const int reductions = waifu2x->tile_reductions();
+    const int ret = waifu2x->process(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride, weight, width, srcA, dstA);
+    logTileReduction("Waifu2x-NCNN-Vulkan", reductions, waifu2x->tile_reductions(), waifu2x->current_tilesize_w(), waifu2x->current_tilesize_h(), vsapi);
+    return ret;
+}
+
+// the model and noise of a frame, its NcnnModel / NcnnNoise or else the filter arguments
+static const char *getFrameModel(const Waifu2xFilterData *d, const VSFrameRef *src, int &model, int &noise, const VSAPI *vsapi) {
+    const VSMap *props = vsapi->getFramePropsRO(src);
+    int err;
+
+    noise = int64ToIntS(vsapi->propGetInt(props, "NcnnNoise", 0, &err));
+    if (err)
+        noise = d->noise;
+    model = int64ToIntS(vsapi->propGetInt(props, "NcnnModel", 0, &err));
+    if (err)
+        model = d->model;
+
+    if (noise < -1 || noise > 3)
+        return "'NcnnNoise' must be -1, 0, 1, 2, or 3";
+    if (model < 0 || model > 2)
+        return "'NcnnModel' must be 0, 1 or 2";
+    return checkModel(model, noise, d->scale);
+}
+
+// upscale a group of frames as mosaics, see FrameBatch; a run of frames sharing model and noise makes one mosaic
+static const char *Waifu2xBatch(const std::vector<const VSFrameRef *> &srcs, std::vector<VSFrameRef *> &dsts, Waifu2xFilterData *d, VSCore *core, const VSAPI *vsapi) {
+    std::vector<int> models(srcs.size()), noises(srcs.size());
+    for (size_t i = 0; i < srcs.size(); i++) {
+        const char *err_prompt = getFrameModel(d, srcs[i], models[i], noises[i], vsapi);
+        if (err_prompt)
+            return err_prompt;
+    }
+
+    for (auto src : srcs) {
+        VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
+        // batches don't take alpha, an attached one no longer matches the frame size
+        vsapi->propDeleteKey(vsapi->getFramePropsRW(dst), "_Alpha");
+        dsts.push_back(dst);
+    }
+
+    for (size_t first = 0, last; first < srcs.size(); first = last) {
+        for (last = first + 1; last < srcs.size() && models[last] == models[first] && noises[last] == noises[first]; last++) {}
+
+        char const * err_prompt = nullptr;
+        std::shared_ptr<Waifu2x> waifu2x = acquireWaifu2x(d, models[first], noises[first], err_prompt);
+        if (!waifu2x)
+            return err_prompt;
+
+        const std::vector<const VSFrameRef *> runSrcs(srcs.begin() + first, srcs.begin() + last);
+        const std::vector<VSFrameRef *> runDsts(dsts.begin() + first, dsts.begin() + last);
+        const int gutter = waifu2x->prepadding;
+        const int scale = d->scale;
+        std::vector<float> in, out;
+        const int width = packMosaic(runSrcs, gutter, false, in, vsapi);
+        const int height = vsapi->getFrameHeight(srcs[0], 0);
+        const size_t inPlane = static_cast<size_t>(width) * height;
+        const size_t outPlane = inPlane * scale * scale;
+        out.resize(outPlane * 3);
+
+        const int reductions = waifu2x->tile_reductions();
+        const int ret = waifu2x->process(in.data(), in.data() + inPlane, in.data() + inPlane * 2, out.data(), out.data() + outPlane, out.data() + outPlane * 2, width, height, width, width * scale);
+        logTileReduction("Waifu2x-NCNN-Vulkan", reductions, waifu2x->tile_reductions(), waifu2x->current_tilesize_w(), waifu2x->current_tilesize_h(), vsapi);
+        if (ret)
+            return "Waifu2x filter error";
+
+        unpackMosaic(out.data(), width, height, gutter, scale, runDsts, vsapi);
+    }
+    return nullptr;
+}
+
+static void VS_CC Waifu2xFilterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<Waifu2xFilterData *>(*instanceData);
+    vsapi->setVideoInfo(&d->vi, 1, node);
+}
+
+static const VSFrameRef *VS_CC Waifu2xFilterGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<Waifu2xFilterData *>(*instanceData);
+
+    const VSFrameRef *src = nullptr;
+    if (activationReason == arInitial) {
+        d->lookahead.prefetch(n, d->node, d->vi.numFrames, vsapi);
+        // a frame the lookahead already fetched isn't requested again, with no other clip to wait for it runs right away
+        if (d->batch.frames == 1)
+            src = d->lookahead.take(n);
+        if (!src || d->mask || d->alpha) {
+            *frameData = const_cast<VSFrameRef *>(src);
+            if (!src)
+                vsapi->requestFrameFilter(n, d->node, frameCtx);
+            if (d->batch.frames > 1)
+                d->batch.request(n, d->node, d->vi.numFrames, frameCtx, vsapi);
+            if (d->mask)
+                vsapi->requestFrameFilter(n, d->mask, frameCtx);
+            if (d->alpha)
+                vsapi->requestFrameFilter(n, d->alpha, frameCtx);
+            return nullptr;
+        }
+    } else if (activationReason == arAllFramesReady) {
+        if (d->batch.frames > 1) {
+            std::string batchError;
+            const VSFrameRef *dst = d->batch.get(n, d->node, d->vi.numFrames, frameCtx, vsapi, [&](const std::vector<const VSFrameRef *> &srcs, std::vector<VSFrameRef *> &dsts) {
+                return Waifu2xBatch(srcs, dsts, d, core, vsapi);
+            }, batchError);
+            if (!dst)
+                vsapi->setFilterError(("Waifu2x-NCNN-Vulkan: " + batchError + ".").c_str(), frameCtx);
+            return dst;
+        }
+
+        src = *frameData ? static_cast<const VSFrameRef *>(*frameData) : vsapi->getFrameFilter(n, d->node, frameCtx);
+    } else {
+        if (activationReason == arError)
+            vsapi->freeFrame(static_cast<const VSFrameRef *>(*frameData));
+        return nullptr;
+    }
+
+    std::string remoteError;
+    int noise, model;
+    char const * err_prompt = getFrameModel(d, src, model, noise, vsapi);
+
+    VSFrameRef *dst = nullptr;
+    const VSFrameRef *srcAlpha = nullptr;
+    VSFrameRef *dstAlpha = nullptr;
+    if (!err_prompt && !d->remote)
+        err_prompt = getAlphaFrame(n, d->alpha, src, &srcAlpha, frameCtx, vsapi);
+    if (!err_prompt) {
+        const VSFrameRef *mask = d->mask ? vsapi->getFrameFilter(n, d->mask, frameCtx) : nullptr;
+        dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
+        if (srcAlpha)
+            dstAlpha = vsapi->newVideoFrame(vsapi->getFrameFormat(srcAlpha), d->vi.width, d->vi.height, srcAlpha, core);
+
+        // per-frame model and noise go into the key, the filter arguments into the cache file name
+        // the cache holds rgb only, frames with alpha always run
+        uint64_t cacheKey = 0;
+        bool cached = false;
+        if (d->cache && !srcAlpha) {
+            const int frameParams[2] = { model, noise };
+            cacheKey = hashFrame(src, vsapi, hashBytes(frameParams, sizeof(frameParams)));
+            if (mask)
+                cacheKey = hashFrame(mask, vsapi, cacheKey);
+            cached = d->cache->read(cacheKey, dst, vsapi);
+        }
+
+        if (!cached && d->remote) {
+            RemoteSpec spec{};
+            spec.engine = REMOTE_ENGINE_WAIFU2X;
+            spec.gpu_id = d->gpuId;
+            spec.tta_mode = d->ttaMode;
+            spec.noise = noise;
+            spec.scale = d->scale;
+            spec.tile_w = d->tileSizeW;
+            spec.tile_h = d->tileSizeH;
+            spec.prepadding = getPrepadding(model, d->scale);
+            spec.precision = d->precision;
+            spec.arithmetic = d->arithmetic;
+            strncpy(spec.model, getModelName(model, noise, d->scale, d->precision).c_str(), sizeof(spec.model) - 1);
+
+            // servers don't take alpha, an attached one no longer matches the frame size
+            vsapi->propDeleteKey(vsapi->getFramePropsRW(dst), "_Alpha");
+
+            const int srcStride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
+            const int dstStride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
+            if (d->remote->process(spec,
+                    reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0)), reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1)), reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2)),
+                    reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0)), reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1)), reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2)),
+                    srcStride, dstStride, remoteError)) {
+                err_prompt = remoteError.c_str();
+            } else if (d->cache) {
+                d->cache->write(cacheKey, dst, vsapi);
+            }
+        } else if (!cached) {
+            std::shared_ptr<Waifu2x> waifu2x = acquireWaifu2x(d, model, noise, err_prompt);
+
+            std::vector<float> maskWeight;
+            const float *weight = d->roiWeight.empty() ? nullptr : d->roiWeight.data();
+            if (mask) {
+                maskWeight.resize(static_cast<size_t>(vsapi->getFrameWidth(src, 0)) * vsapi->getFrameHeight(src, 0));
+                makeMaskWeight(maskWeight.data(), mask, d->feather, vsapi);
+                weight = maskWeight.data();
+            }
+
+            if (waifu2x && Waifu2xFilter(src, dst, srcAlpha, dstAlpha, weight, waifu2x.get(), vsapi))
+                err_prompt = "Waifu2x filter error";
+
+            if (!err_prompt && dstAlpha)
+                vsapi->propSetFrame(vsapi->getFramePropsRW(dst), "_Alpha", dstAlpha, paReplace);
+            else if (!err_prompt && d->cache)
+                d->cache->write(cacheKey, dst, vsapi);
+        }
+
+        vsapi->freeFrame(mask);
+        vsapi->freeFrame(dstAlpha);
+        if (err_prompt) {
+            vsapi->freeFrame(dst);
+            dst = nullptr;
+        }
+    }
+    vsapi->freeFrame(srcAlpha);
+    vsapi->freeFrame(src);
+
+    if (err_prompt) {
+        vsapi->setFilterError((std::string{"Waifu2x-NCNN-Vulkan: "} + err_prompt + ".").c_str(), frameCtx);
+    } else {
+        return dst;
+    }
+    return nullptr;
+}
+
+static void VS_CC Waifu2xFilterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    auto *d = static_cast<Waifu2xFilterData *>(instanceData);
+    vsapi->freeNode(d->node);
+    vsapi->freeNode(d->mask);
+    vsapi->freeNode(d->alpha);
+    bool remote = !!d->remote;
+    // nets still loading must be done with the device before the instance goes away
+    for (auto &net : d->nets)
+        net.waifu2x.wait();
+    delete d;
+    if (!remote)
+        tryDestoryGpuInstance();
+}
+
+void VS_CC Waifu2xFilterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::unique_ptr<Waifu2xFilterData> d{ new Waifu2xFilterData{} };
+    d->node = vsapi->propGetNode(in, "clip", 0, nullptr);
+    d->vi = *vsapi->getVideoInfo(d->node);
+
+    char const * err_prompt = nullptr;
+    int err;
+    const std::vector<std::string> servers = getServerArgs(in, vsapi);
+    const bool remote = !servers.empty();
+    do {
+        // with a server this process never touches the device
+        if (!remote) {
+            err = tryCreateGpuInstance();
+            if (err) {
+                err_prompt = "create gpu instance failed";
+                break;
+            }
+        }
+
+        if (!isConstantFormat(&d->vi) || d->vi.format->colorFamily != cmRGB || d->vi.format->sampleType != stFloat || d->vi.format->bitsPerSample != 32) {
+            err_prompt = "only constant RGB format and 32 bit float input supported";
+            break;
+        }
+
+        d->gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", 0, &err));
+        if (d->gpuId < 0 || (!remote && d->gpuId >= ncnn::get_gpu_count())) {
+            err_prompt = "invalid 'gpu_id'";
+            break;
+        }
+
+        d->ttaMode = int64ToIntS(vsapi->propGetInt(in, "tta_mode", 0, &err));
+        if (d->ttaMode != 0 && d->ttaMode != 1 && d->ttaMode != 2 && d->ttaMode != 4 && d->ttaMode != 8) {
+            err_prompt = "'tta_mode' must be 0, 1, 2, 4 or 8";
+            break;
+        }
+
+        d->noise = int64ToIntS(vsapi->propGetInt(in, "noise", 0, &err));
+        if (d->noise < -1 || d->noise > 3) {
+            err_prompt = "'noise' must be -1, 0, 1, 2, or 3";
+            break;
+        }
+
+        d->scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
+        if (err)
+            d->scale = 2;
+        if (d->scale != 1 && d->scale != 2) {
+            err_prompt = "'scale' must be 1 or 2";
+            break;
+        }
+
+        d->model = int64ToIntS(vsapi->propGetInt(in, "model", 0, &err));
+        if (d->model < 0 || d->model > 2) {
+            err_prompt = "'model' must be 0, 1 or 2";
+            break;
+        }
+
+        d->precision = int64ToIntS(vsapi->propGetInt(in, "precision", 0, &err));
+        if (err)
+            d->precision = 16;
+        if (d->precision != 0 && d->precision != 8 && d->precision != 16 && d->precision != 32) {
+            err_prompt = "'precision' must be 0, 8, 16 or 32";
+            break;
+        }
+
+        d->arithmetic = int64ToIntS(vsapi->propGetInt(in, "arithmetic", 0, &err));
+        if (err)
+            d->arithmetic = d->precision == 0 ? 0 : 32;
+        if (d->arithmetic != 0 && d->arithmetic != 16 && d->arithmetic != 32) {
+            err_prompt = "'arithmetic' must be 0, 16 or 32";
+            break;
+        }
+
+        int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
+        if (remote) {
+            // frames in flight to each server
+            d->gpuThread = customGpuThread > 0 ? customGpuThread : 2;
+        }
+        else {
+            if (customGpuThread > 0) {
+                d->gpuThread = customGpuThread;
+            }
+            else {
+                d->gpuThread = int64ToIntS(ncnn::get_gpu_info(d->gpuId).transfer_queue_count());
+            }
+            d->gpuThread = std::min(d->gpuThread, int64ToIntS(ncnn::get_gpu_info(d->gpuId).compute_queue_count()));
+        }
+
+        int tileSize = int64ToIntS(vsapi->propGetInt(in, "tile_size", 0, &err));
+        if (tileSize != 0 && tileSize < 32) {
+            err_prompt = "'tile_size' must be greater than or equal to 32";
+            break;
+        }
+        if (tileSize % 4) {
+            err_prompt = "'tile_size' must be multiple of 4";
+            break;
+        }
+        d->tileSizeW = d->tileSizeH = tileSize;
+
+        int tw = int64ToIntS(vsapi->propGetInt(in, "tile_size_w", 0, &err));
+        if (!err) {
+            if (tw < 32) {
+                err_prompt = "'tile_size_w' must be greater than or equal to 32";
+                break;
+            }
+            if (tw % 4) {
+                err_prompt = "'tile_size_w' must be multiple of 4";
+                break;
+            }
+            d->tileSizeW = tw;
+        }
+
+        int th = int64ToIntS(vsapi->propGetInt(in, "tile_size_h", 0, &err));
+        if (!err) {
+            if (th < 32) {
+                err_prompt = "'tile_size_h' must be greater than or equal to 32";
+                break;
+            }
+            if (th % 4) {
+                err_prompt = "'tile_size_h' must be multiple of 4";
+                break;
+            }
+            d->tileSizeH = th;
+        }
+
+        int modelCache = int64ToIntS(vsapi->propGetInt(in, "model_cache", 0, &err));
+        if (err)
+            modelCache = 4;
+        if (modelCache < 1) {
+            err_prompt = "'model_cache' must be greater than or equal to 1";
+            break;
+        }
+        d->modelCache = modelCache;
+
+        err_prompt = checkModel(d->model, d->noise, d->scale);
+        if (err_prompt)
+            break;
+
+        err_prompt = getRoiMaskArgs(in, &d->vi, &d->mask, d->roiWeight, d->feather, vsapi);
+        if (err_prompt)
+            break;
+
+        err_prompt = getAlphaArg(in, &d->vi, &d->alpha, vsapi);
+        if (err_prompt)
+            break;
+
+        d->lookahead.frames = int64ToIntS(vsapi->propGetInt(in, "lookahead", 0, &err));
+        if (d->lookahead.frames < 0) {
+            err_prompt = "'lookahead' must be greater than or equal to 0";
+            break;
+        }
+
+        d->batch.frames = int64ToIntS(vsapi->propGetInt(in, "batch", 0, &err));
+        if (err)
+            d->batch.frames = 1;
+        if (d->batch.frames < 1) {
+            err_prompt = "'batch' must be greater than or equal to 1";
+            break;
+        }
+        d->batch.maxGroups = vsapi->getCoreInfo(core)->numThreads;
+
+        d->autotune = !!vsapi->propGetInt(in, "autotune", 0, &err);
+        if (d->autotune)
+            d->autotuneCache = autotuneCachePath();
+
+        // every frame of a batch gets the same treatment as a whole mosaic
+        if (d->batch.frames > 1 && (remote || d->mask || !d->roiWeight.empty() || d->alpha || vsapi->propNumElements(in, "cache_dir") > 0)) {
+            err_prompt = "'batch' can't be used with 'roi', 'mask', 'alpha', 'cache_dir' or 'server'";
+            break;
+        }
+
+        // the int8 net runs on the cpu, which has neither the augmentation nor the roi shaders
+        if (d->precision == 8 && (remote || d->ttaMode != 0 || d->mask || !d->roiWeight.empty())) {
+            err_prompt = "'precision=8' runs on the CPU and can't be used with 'tta_mode', 'roi', 'mask' or 'server'";
+            break;
+        }
+
+        if (remote) {
+            if (d->mask || !d->roiWeight.empty()) {
+                err_prompt = "'roi' and 'mask' can't be used with 'server'";
+                break;
+            }
+            if (d->alpha) {
+                err_prompt = "'alpha' can't be used with 'server'";
+                break;
+            }
+            d->remote.reset(new RemoteClient(servers, d->vi.width, d->vi.height, d->scale, d->gpuThread));
+        }
+
+        const char *cacheDir = vsapi->propGetData(in, "cache_dir", 0, &err);
+        if (!err) {
+            // everything that changes the output except the per-frame model and noise
+            const int params[8] = { d->vi.width, d->vi.height, d->scale, d->ttaMode, d->precision, d->arithmetic, d->feather, d->mask != nullptr };
+            uint64_t name = hashBytes(params, sizeof(params));
+            if (!d->roiWeight.empty())
+                name = hashBytes(d->roiWeight.data(), d->roiWeight.size() * sizeof(float), name);
+
+            char cacheName[32];
+            snprintf(cacheName, sizeof(cacheName), "waifu2x-%016llx", static_cast<unsigned long long>(name));
+
+            d->cache.reset(new FrameCache);
+            if (d->cache->open(cacheDir, cacheName, int64_t(d->vi.width) * d->scale * d->vi.height * d->scale * 3 * sizeof(float))) {
+                err_prompt = "can't open cache in 'cache_dir'";
+                break;
+            }
+        }
+
+        // set model path
+        const std::string pluginFilePath{ vsapi->getPluginPath(vsapi->getPluginById(VSPLUGIN_IDENTIFIER_STR, core)) };
+        d->pluginDir = pluginFilePath.substr(0, pluginFilePath.find_last_of('/'));
+
+        if (remote)
+            break;
+
+        std::string paramPath, modelPath;
+        getModelPath(d->pluginDir, d->model, d->noise, d->scale, d->precision, paramPath, modelPath);
+
+        // check model file readable
+        if (!modelFileExists(paramPath) || !modelFileExists(modelPath)) {
+            err_prompt = "can't open model file";
+            break;
+        }
+
+        break;
+    } while (false);
+
+    if (err_prompt) {
+        vsapi->setError(out, (std::string{"Waifu2x-NCNN-Vulkan: "} + err_prompt).c_str());
+        vsapi->freeNode(d->node);
+        vsapi->freeNode(d->mask);
+        vsapi->freeNode(d->alpha);
+        if (!remote)
+            tryDestoryGpuInstance();
+        return;
+    }
+
+    // the default net starts loading now, other nets are loaded on first use, see acquireWaifu2x
+    if (!remote) {
+        std::list<Waifu2xNet> evicted;
+        std::lock_guard<std::mutex> lock(d->cacheLock);
+        startWaifu2x(d.get(), d->model, d->noise, evicted, err_prompt);
+    }
+
+    d->vi.width *= d->scale;
+    d->vi.height *= d->scale;
+
+    vsapi->createFilter(in, out, "Waifu2x", Waifu2xFilterInit, Waifu2xFilterGetFrame, Waifu2xFilterFree, fmParallel, 0, d.release(), core);
+}
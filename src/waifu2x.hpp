@@ -2,21 +2,54 @@
 #define WAIFU2X_HPP
 
 #include <string>
+#include <memory>
+#include <atomic>
 
 // ncnn
 #include "net.h"
 #include "gpu.h"
 #include "layer.h"
 
+#include "model-file.hpp"
+#include "tile-process.hpp"
+
 class Waifu2x
 {
 public:
-    Waifu2x(int gpuid, int num_threads = 1, bool tta_mode = false);
+    // precision is 32 for fp32 blobs, 16 for fp16 storage, arithmetic 16 also computes in fp16
+    // precision 8 runs an int8 model on the cpu with every big core instead, process_gpu and tta_mode are then unavailable
+    // 0 for either picks the fastest the device supports
+    Waifu2x(int gpuid, int num_threads = 1, int tta_mode = 0, int precision = 16, int arithmetic = 32);
     ~Waifu2x();
 
-    int load(const std::string& parampath, const std::string& modelpath);
+    // pipeline_source, when given, shares its preprocess and postprocess pipelines instead of building new ones
+    int load(const std::string& parampath, const std::string& modelpath, const Waifu2x* pipeline_source = nullptr);
+
+    // time the ncnn option sets autotune knows on one tile and reload the net with the fastest
+    // the choice is remembered in cache_path, which may be empty, and reused without timing
+    int autotune(const std::string& parampath, const std::string& modelpath, const std::string& cache_path);
+
+    // weight, when given, holds one 0-1 value per input pixel; tiles where it is all zero skip the network
+    // and the output is blended with a bilinear resample of the input by that weight
+    // a strip that fails for lack of device memory is retried with smaller tiles, which are kept from then on
+    // srcpA and dstpA, when given, are an alpha plane with the same strides, upscaled bicubic instead of by the network
+    int process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int width, int height, int src_stride, int dst_stride, const float* weight = nullptr, int weight_stride = 0, const float* srcpA = nullptr, float* dstpA = nullptr) const;
+
+    // run the network over the width x height region at (x0, y0) of in_gpu, which holds 0-255 planar rgb,
+    // or rgba with out_gpu also rgba, the fourth channel then being upscaled bicubic
+    // the upscaled region is written to out_gpu, which must be width * scale by height * scale
+    // tile_mask, when given, has one flag per tile in row-major order and tiles flagged 0 are left unwritten
+    int process_gpu(const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, const unsigned char* tile_mask = nullptr) const;
 
-    int process(const float* srcpR, const float* srcpG, const float* srcpB, float* dstpR, float* dstpG, float* dstpB, int width, int height, int src_stride, int dst_stride) const;
+    const ncnn::VulkanDevice* vulkan_device() const { return _net.vulkan_device(); }
+    // the options the net was loaded with, for callers recording their own copies around process_gpu
+    const ncnn::Option& net_options() const { return _net.opt; }
+
+    // tile size in use, smaller than the configured one after running out of device memory
+    int current_tilesize_w() const { return reducedTilesize(tilesize_w, _tile_shift); }
+    int current_tilesize_h() const { return reducedTilesize(tilesize_h, _tile_shift); }
+    // how many times the tiles were halved
+    int tile_reductions() const { return _tile_shift; }
 
 public:
     int noise;
@@ -25,11 +58,24 @@ public:
     int tilesize_h;
     int prepadding;
 
+    // strips of one frame run on up to this many compute queues at once, 1 keeps them in order on one
+    int strip_workers;
+
 private:
+    int reload(const std::string& parampath, const std::string& modelpath, const ncnn::Option& opt);
+
+    int process_gpu_with_tile(const ncnn::VkMat& in_gpu, int x0, int y0, int width, int height, ncnn::VkMat& out_gpu, ncnn::VkCompute& cmd, ncnn::VkAllocator* blob_vkallocator, ncnn::VkAllocator* staging_vkallocator, int tile_w, int tile_h, const unsigned char* tile_mask = nullptr) const;
+
+    // declared before the net, which may still reference the mapped weights while it is destroyed
+    ModelFile _weights;
     ncnn::Net _net;
-    ncnn::Pipeline* _preproc;
-    ncnn::Pipeline* _postproc;
-    bool _tta_mode;
+    std::shared_ptr<ncnn::Pipeline> _preproc;
+    std::shared_ptr<ncnn::Pipeline> _postproc;
+    std::shared_ptr<ncnn::Pipeline> _roi_blend;
+    // upscales the alpha tiles, null at scale 1
+    std::shared_ptr<ncnn::Layer> _bicubic;
+    int _tta_count;
+    mutable std::atomic<int> _tile_shift;
 };
 
 #endif